@@ -0,0 +1,24 @@
+#!/usr/bin/env bash
+
+ROM_FILE="$1"
+FRAMES="${2:-3000}"
+BRICKBOY_BIN="./build/brickboy"
+
+if [[ $ROM_FILE == "" ]]; then
+    echo "Usage: $0 <rom_file> [frames]"
+    exit 1
+fi
+
+ROM_BASENAME=$(basename "$ROM_FILE")
+echo "Benchmarking ${ROM_BASENAME} (${FRAMES} frames)"
+
+# Run the same frames headless with each scheduler and compare the speed.
+for SCHED in lockstep event coro; do
+    RESULT=$($BRICKBOY_BIN --nologo --headless --stats --frames="${FRAMES}" --sched="${SCHED}" "${ROM_FILE}" 2>&1 | grep "Frames:")
+    if [[ $RESULT == "" ]]; then
+        echo "${SCHED}: failed"
+        exit 1
+    fi
+
+    printf "%-10s %s\n" "${SCHED}:" "${RESULT#*Frames: }"
+done
@@ -6,6 +6,7 @@ TIMEOUT="${3:-5s}"
 STATE_LOG="state.log"
 DEBUG_LOG="debug.log"
 BRICKBOY_BIN="./build/brickboy"
+LINECMP_BIN="./build/linecmp"
 
 if [[ $ROM_FILE == "" || $GOLDEN_LOG == "" ]]; then
     echo "Usage: $0 <rom_file> <golden_log>"
@@ -15,9 +16,17 @@ fi
 ROM_BASENAME=$(basename "$ROM_FILE")
 echo "Testing ${ROM_BASENAME} (timeout: $TIMEOUT)"
 
-# Run the emulator and compare the CPU state log with the golden log.
-timeout $TIMEOUT $BRICKBOY_BIN --nologo --state="${STATE_LOG}" --debug="${DEBUG_LOG}" "${ROM_FILE}"
-LINECMP_RESULT=$(./scripts/linecmp.py --lineno "$GOLDEN_LOG" "$STATE_LOG")
+# Run the emulator and compare the CPU state log with the golden log. The
+# test mode exits as soon as the ROM reports a result, the timeout is only
+# a safety net.
+timeout $TIMEOUT $BRICKBOY_BIN --nologo --test --state="${STATE_LOG}" --debug="${DEBUG_LOG}" "${ROM_FILE}"
+
+# The native linecmp gives the same output as the script, only faster.
+if [[ ! -x $LINECMP_BIN ]]; then
+    LINECMP_BIN="./scripts/linecmp.py"
+fi
+
+LINECMP_RESULT=$($LINECMP_BIN --lineno "$GOLDEN_LOG" "$STATE_LOG")
 LINECMP_EXIT_CODE=$?
 
 if [[ $LINECMP_EXIT_CODE == 0 ]]; then
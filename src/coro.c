@@ -0,0 +1,263 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "coro.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define CORO_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define CORO_ASAN 1
+#endif
+#endif
+
+#ifdef CORO_ASAN
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CORO_ASM 1
+#else
+#include <ucontext.h>
+#endif
+
+struct Coro {
+#ifdef CORO_ASM
+    void *sp; // saved stack pointer of a suspended coroutine
+#else
+    ucontext_t context;
+#endif
+    CoroFunc fn;
+    void *arg;
+    unsigned char *stack;
+    size_t stack_size;
+
+#ifdef CORO_ASAN
+    const void *asan_bottom;
+    size_t asan_size;
+    void *asan_fake_stack;
+#endif
+};
+
+#ifdef CORO_ASAN
+// The coroutine being switched away from, so that the one being resumed
+// can record the bounds of its stack. Each thread switches its own set.
+static _Thread_local Coro *coro_prev;
+#endif
+
+static void
+coro_enter(Coro *coro)
+{
+#ifdef CORO_ASAN
+    __sanitizer_finish_switch_fiber(NULL, &coro_prev->asan_bottom, &coro_prev->asan_size);
+#endif
+
+    coro->fn(coro->arg);
+    PANIC("coroutine returned");
+}
+
+#ifdef CORO_ASM
+
+#ifdef __APPLE__
+#define CORO_SYMBOL(name) "_" #name
+#else
+#define CORO_SYMBOL(name) #name
+#endif
+
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer to *from_sp, then restores the registers saved on to_sp and
+// returns into that context. A new coroutine "returns" into coro_start,
+// which calls coro_enter with the Coro it finds in a callee-saved register.
+void coro_swap(void **from_sp, void *to_sp);
+
+void coro_start(void);
+
+#if defined(__x86_64__)
+
+#define CORO_FRAME_WORDS 7 // rbp, rbx, r12-r15, return address
+
+__asm__(
+    ".text\n"
+    ".globl " CORO_SYMBOL(coro_swap) "\n"
+    CORO_SYMBOL(coro_swap) ":\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".globl " CORO_SYMBOL(coro_start) "\n"
+    CORO_SYMBOL(coro_start) ":\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+);
+
+static void *
+coro_init_stack(Coro *coro)
+{
+    // Aligned so that the stack is 16-byte aligned again after coro_start
+    // has been "returned" into, as the ABI expects at the call.
+    uintptr_t top = ((uintptr_t) coro->stack + coro->stack_size) & ~(uintptr_t) 15;
+    void **frame = (void **) top - CORO_FRAME_WORDS;
+
+    frame[0] = NULL;                            // r15
+    frame[1] = NULL;                            // r14
+    frame[2] = (void *) (uintptr_t) coro_enter; // r13
+    frame[3] = coro;                            // r12
+    frame[4] = NULL;                            // rbx
+    frame[5] = NULL;                            // rbp
+    frame[6] = (void *) (uintptr_t) coro_start; // return address
+
+    return frame;
+}
+
+#elif defined(__aarch64__)
+
+#define CORO_FRAME_WORDS 20 // x19-x30, d8-d15
+
+__asm__(
+    ".text\n"
+    ".globl " CORO_SYMBOL(coro_swap) "\n"
+    ".p2align 2\n"
+    CORO_SYMBOL(coro_swap) ":\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".globl " CORO_SYMBOL(coro_start) "\n"
+    ".p2align 2\n"
+    CORO_SYMBOL(coro_start) ":\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+);
+
+static void *
+coro_init_stack(Coro *coro)
+{
+    uintptr_t top = ((uintptr_t) coro->stack + coro->stack_size) & ~(uintptr_t) 15;
+    void **frame = (void **) top - CORO_FRAME_WORDS;
+
+    for (int i = 0; i < CORO_FRAME_WORDS; i++) {
+        frame[i] = NULL;
+    }
+
+    frame[0] = coro;                             // x19
+    frame[1] = (void *) (uintptr_t) coro_enter;  // x20
+    frame[11] = (void *) (uintptr_t) coro_start; // x30
+
+    return frame;
+}
+
+#endif
+
+#else // ucontext fallback
+
+static void
+coro_entry(unsigned int hi, unsigned int lo)
+{
+    coro_enter((Coro *) (((uintptr_t) hi << 32) | lo));
+}
+
+#endif
+
+Coro *
+coro_new(CoroFunc fn, void *arg, size_t stack_size)
+{
+    Coro *coro = xalloc(sizeof(Coro));
+    coro->fn = fn;
+    coro->arg = arg;
+
+    if (fn == NULL) {
+        return coro;
+    }
+
+    coro->stack = xalloc(stack_size);
+    coro->stack_size = stack_size;
+
+#ifdef CORO_ASAN
+    coro->asan_bottom = coro->stack;
+    coro->asan_size = stack_size;
+#endif
+
+#ifdef CORO_ASM
+    coro->sp = coro_init_stack(coro);
+#else
+    if (getcontext(&coro->context) != 0) {
+        PANIC("getcontext failed");
+    }
+
+    uintptr_t ptr = (uintptr_t) coro;
+    coro->context.uc_stack.ss_sp = coro->stack;
+    coro->context.uc_stack.ss_size = stack_size;
+    coro->context.uc_link = NULL;
+    makecontext(&coro->context, (void (*)(void)) coro_entry, 2,
+                (unsigned int) (ptr >> 32), (unsigned int) ptr);
+#endif
+
+    return coro;
+}
+
+void
+coro_free(Coro **coro)
+{
+    if (*coro != NULL) {
+        xfree((*coro)->stack);
+    }
+
+    xfree(*coro);
+}
+
+void
+coro_switch(Coro *from, Coro *to)
+{
+#ifdef CORO_ASAN
+    coro_prev = from;
+    __sanitizer_start_switch_fiber(&from->asan_fake_stack, to->asan_bottom, to->asan_size);
+#endif
+
+#ifdef CORO_ASM
+    coro_swap(&from->sp, to->sp);
+#else
+    if (swapcontext(&from->context, &to->context) != 0) {
+        PANIC("swapcontext failed");
+    }
+#endif
+
+#ifdef CORO_ASAN
+    __sanitizer_finish_switch_fiber(from->asan_fake_stack, &coro_prev->asan_bottom, &coro_prev->asan_size);
+#endif
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+// Stackful coroutines with explicit switching, for running emulated
+// components as cooperative threads on a single OS thread.
+typedef struct Coro Coro;
+
+typedef void (*CoroFunc)(void *arg);
+
+// Creates a coroutine that runs fn(arg) on a stack of its own once it is
+// switched to. fn must never return. With a NULL fn the handle refers to
+// the calling thread's stack, so that coroutines can switch back to it.
+Coro *coro_new(CoroFunc fn, void *arg, size_t stack_size);
+
+// Frees a coroutine, which must not be running.
+void coro_free(Coro **coro);
+
+// Suspends the running coroutine from and resumes to.
+void coro_switch(Coro *from, Coro *to);
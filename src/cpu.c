@@ -6,6 +6,7 @@
 #include "common.h"
 #include "cpu.h"
 #include "mmu.h"
+#include "prof.h"
 
 static const uint16_t reset_addr[8] = {
     0x00, 0x08, 0x10, 0x18,
@@ -40,6 +41,7 @@ cpu_reset(CPU *cpu)
     cpu->halted = false;
     cpu->ime_delay = -1;
     cpu->cycle = 0;
+    cpu->instructions = 0;
     cpu->step = 0;
 }
 
@@ -284,15 +286,36 @@ cpu_pop(CPU *cpu, MMU *bus)
     return value;
 }
 
+static inline void
+cpu_call(CPU *cpu, MMU *bus, uint16_t addr)
+{
+    cpu_push(cpu, bus, cpu->PC);
+    cpu->PC = addr;
+
+    if (cpu->prof != NULL) {
+        prof_call(cpu->prof, bus, addr, cpu->SP);
+    }
+}
+
+static inline void
+cpu_return(CPU *cpu, MMU *bus)
+{
+    if (cpu->prof != NULL) {
+        prof_ret(cpu->prof, cpu->SP);
+    }
+
+    cpu->PC = cpu_pop(cpu, bus);
+}
+
 const Instruction *
 cpu_decode(MMU *bus, uint16_t pc)
 {
-    uint8_t opcode = mmu_read(bus, pc);
+    uint8_t opcode = mmu_peek(bus, pc);
     const Instruction *op = &opcodes[opcode];
 
     // Prefixed instructions
     if (opcode == 0xCB) {
-        opcode = mmu_read(bus, pc + 1);
+        opcode = mmu_peek(bus, pc + 1);
         op = &cb_opcodes[opcode];
     }
 
@@ -316,9 +339,7 @@ cpu_interrupt(CPU *cpu, MMU *bus, uint16_t addr)
 
     cpu->IME = 0; // disable interrupts
 
-    cpu_push(cpu, bus, cpu->PC);
-
-    cpu->PC = addr;
+    cpu_call(cpu, bus, addr);
 }
 
 static inline const Instruction *
@@ -333,6 +354,10 @@ cpu_execute(CPU *cpu, MMU *bus)
         op = &cb_opcodes[opcode];
     }
 
+#if CPU_PROFILE
+    cpu->profile[op == &cb_opcodes[opcode] ? 0x100 | opcode : opcode]++;
+#endif
+
     if (op->handler == NULL) {
         PANIC("invalid opcode: 0x%02X", opcode);
     }
@@ -360,10 +385,95 @@ cpu_step(CPU *cpu, MMU *bus)
         return;
     }
 
+    if (cpu->prof != NULL) {
+        prof_step(cpu->prof, bus, cpu->PC, cpu_decode(bus, cpu->PC)->cycles);
+    }
+
     const Instruction *op = cpu_execute(cpu, bus);
     cpu->step = op->cycles - 1;
+    cpu->instructions++;
+}
+
+#if CPU_PROFILE
+typedef struct {
+    const Instruction *op;
+    uint16_t index;
+    uint64_t count;
+    uint64_t cycles;
+} CPUProfileEntry;
+
+static int
+cpu_profile_compare(const void *a, const void *b)
+{
+    const CPUProfileEntry *x = a;
+    const CPUProfileEntry *y = b;
+
+    if (x->cycles != y->cycles) {
+        return x->cycles < y->cycles ? 1 : -1;
+    }
+
+    return x->index < y->index ? -1 : 1;
+}
+
+// Writes the text of an instruction with n8/n16 in place of the operand.
+static void
+cpu_profile_text(const Instruction *op, FILE *out)
+{
+    for (const char *t = op->text; *t != '\0'; t++) {
+        if (t[0] == '%' && t[1] == '0' && (t[2] == '2' || t[2] == '4') && t[3] == 'X') {
+            fputs(t[2] == '2' ? "n8" : "n16", out);
+            t += 3;
+            continue;
+        }
+
+        fputc(*t, out);
+    }
 }
 
+void
+cpu_profile_report(CPU *cpu, FILE *out)
+{
+    CPUProfileEntry entries[512];
+    size_t count = 0;
+    uint64_t total_count = 0;
+    uint64_t total_cycles = 0;
+
+    // Cycles are counted in M-cycles, as in the opcode tables.
+    for (uint16_t i = 0; i < ARRAY_SIZE(entries); i++) {
+        const Instruction *op = i < 0x100 ? &opcodes[i] : &cb_opcodes[i & 0xFF];
+        if (cpu->profile[i] == 0) {
+            continue;
+        }
+
+        entries[count++] = (CPUProfileEntry) {
+            .op = op,
+            .index = i,
+            .count = cpu->profile[i],
+            .cycles = cpu->profile[i] * op->cycles,
+        };
+
+        total_count += cpu->profile[i];
+        total_cycles += cpu->profile[i] * op->cycles;
+    }
+
+    qsort(entries, count, sizeof(entries[0]), cpu_profile_compare);
+
+    fprintf(out, "CPU profile: %llu instructions, %llu M-cycles\n",
+            (unsigned long long) total_count, (unsigned long long) total_cycles);
+    fprintf(out, "  %-7s %14s %7s %14s %7s  %s\n", "Opcode", "Count", "%", "M-cycles", "%", "Instruction");
+
+    for (size_t i = 0; i < count; i++) {
+        const CPUProfileEntry *e = &entries[i];
+        fprintf(out, "  %s%02X%*s %14llu %6.2f%% %14llu %6.2f%%  ",
+                e->index < 0x100 ? "" : "CB ", e->index & 0xFF, e->index < 0x100 ? 5 : 2, "",
+                (unsigned long long) e->count, 100.0 * (double) e->count / (double) total_count,
+                (unsigned long long) e->cycles, 100.0 * (double) e->cycles / (double) total_cycles);
+        cpu_profile_text(e->op, out);
+        fputc('\n', out);
+    }
+}
+#endif
+
 /* ----------------------------------------------------------------------------
  * Instruction Handlers
  * -------------------------------------------------------------------------- */
@@ -894,8 +1004,7 @@ static void
 call(CPU *cpu, MMU *bus, const Instruction *op)
 {
     uint16_t addr = cpu_get_operand(cpu, bus, op->arg1);
-    cpu_push(cpu, bus, cpu->PC);
-    cpu->PC = addr;
+    cpu_call(cpu, bus, addr);
 }
 
 /* CALL F,a16
@@ -908,9 +1017,8 @@ call_if(CPU *cpu, MMU *bus, const Instruction *op)
     uint16_t addr = cpu_get_operand(cpu, bus, op->arg2);
 
     if (flag) {
-        cpu_push(cpu, bus, cpu->PC);
+        cpu_call(cpu, bus, addr);
         cpu->step += 3;
-        cpu->PC = addr;
     }
 }
 
@@ -924,9 +1032,8 @@ call_ifn(CPU *cpu, MMU *bus, const Instruction *op)
     uint16_t addr = cpu_get_operand(cpu, bus, op->arg2);
 
     if (!flag) {
-        cpu_push(cpu, bus, cpu->PC);
+        cpu_call(cpu, bus, addr);
         cpu->step += 3;
-        cpu->PC = addr;
     }
 }
 
@@ -936,10 +1043,9 @@ call_ifn(CPU *cpu, MMU *bus, const Instruction *op)
 static void
 ret(CPU *cpu, MMU *bus, const Instruction *op)
 {
-    UNUSED(bus);
     UNUSED(op);
 
-    cpu->PC = cpu_pop(cpu, bus);
+    cpu_return(cpu, bus);
 }
 
 /* RET F
@@ -951,7 +1057,7 @@ ret_if(CPU *cpu, MMU *bus, const Instruction *op)
     bool flag = cpu_get_operand(cpu, bus, op->arg1);
 
     if (flag) {
-        cpu->PC = cpu_pop(cpu, bus);
+        cpu_return(cpu, bus);
         cpu->step += 3;
     }
 }
@@ -965,7 +1071,7 @@ ret_ifn(CPU *cpu, MMU *bus, const Instruction *op)
     bool flag = cpu_get_operand(cpu, bus, op->arg1);
 
     if (!flag) {
-        cpu->PC = cpu_pop(cpu, bus);
+        cpu_return(cpu, bus);
         cpu->step += 3;
     }
 }
@@ -976,10 +1082,9 @@ ret_ifn(CPU *cpu, MMU *bus, const Instruction *op)
 static void
 reti(CPU *cpu, MMU *bus, const Instruction *op)
 {
-    UNUSED(bus);
     UNUSED(op);
 
-    cpu->PC = cpu_pop(cpu, bus);
+    cpu_return(cpu, bus);
     cpu->IME = 1; // looks like not delayed unlike EI
     cpu->ime_delay = -1;
 }
@@ -992,8 +1097,7 @@ static void
 rst(CPU *cpu, MMU *bus, const Instruction *op)
 {
     uint16_t addr = cpu_get_operand(cpu, bus, op->arg1);
-    cpu_push(cpu, bus, cpu->PC);
-    cpu->PC = addr;
+    cpu_call(cpu, bus, addr);
 }
 
 /* RLC r8
@@ -1,10 +1,18 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "interrupt.h"
 #include "common.h"
 #include "mmu.h"
+#include "prof.h"
+
+// Counts the executions of each opcode, see cpu_profile_report. Enabled with
+// -DCPU_PROFILE=1 (cmake -DBRICKBOY_CPU_PROFILE=ON), compiled out otherwise.
+#ifndef CPU_PROFILE
+#define CPU_PROFILE 0
+#endif
 
 typedef struct CPUFlags {
     uint8_t _unused_ : 4;
@@ -60,8 +68,15 @@ typedef struct CPU {
 
     uint8_t step;
     uint64_t cycle;
+    uint64_t instructions; // Executed since reset
     int8_t ime_delay;
     uint8_t halted;
+
+    Profiler *prof; // Follows the calls and charges each instruction, if not NULL
+
+#if CPU_PROFILE
+    uint64_t profile[512]; // Executions of opcodes (0x000 - 0x0FF) and cb_opcodes (0x100 - 0x1FF)
+#endif
 } CPU;
 
 typedef enum {
@@ -149,8 +164,14 @@ bool cpu_interrput_enabled(CPU *cpu);
 
 void cpu_interrupt(CPU *cpu, MMU *bus, uint16_t addr);
 
+#if CPU_PROFILE
+// Writes the executions and cycles of each opcode, most cycles first.
+void cpu_profile_report(CPU *cpu, FILE *out);
+#endif
+
+// Looks up the instruction at pc without side effects.
 const Instruction *cpu_decode(MMU *bus, uint16_t pc);
 
-const Instruction opcodes[256];
+extern const Instruction opcodes[256];
 
-const Instruction cb_opcodes[256];
+extern const Instruction cb_opcodes[256];
@@ -1,11 +1,44 @@
+#include <stddef.h>
 #include <stdint.h>
-#include <string.h>
-#include <stdio.h>
 
+#include "common.h"
 #include "disasm.h"
 #include "mmu.h"
 #include "cpu.h"
-#include "str.h"
+
+static const char disasm_hex_digits[] = "0123456789ABCDEF";
+
+static inline char *
+disasm_hex(char *p, uint16_t value, int digits)
+{
+    for (int i = digits - 1; i >= 0; i--) {
+        p[i] = disasm_hex_digits[value & 0x0F];
+        value >>= 4;
+    }
+
+    return p + digits;
+}
+
+static inline char *
+disasm_str(char *p, const char *str)
+{
+    while (*str != '\0') {
+        *p++ = *str++;
+    }
+
+    return p;
+}
+
+// Pads the line that starts at line with spaces up to width.
+static inline char *
+disasm_pad(char *line, char *p, size_t width)
+{
+    while ((size_t) (p - line) < width) {
+        *p++ = ' ';
+    }
+
+    return p;
+}
 
 static inline int
 disasm_arg_size(ArgType arg)
@@ -23,157 +56,198 @@ disasm_arg_size(ArgType arg)
 }
 
 static inline uint16_t
-disasm_arg_value(ArgType arg, MMU *mmu, uint16_t pc)
+disasm_arg_value(ArgType arg, const uint8_t *bytes)
 {
     switch (arg) {
     case ARG_IMM_8:
     case ARG_IND_8:
-        return mmu_read(mmu, pc);
+        return bytes[0];
     case ARG_IMM_16:
     case ARG_IND_16:
-        return mmu_read16(mmu, pc);
+        return (uint16_t) (bytes[0] | bytes[1] << 8);
     default:
         return 0;
     }
 }
 
-static inline String
-disasm_add_memval(String str, ArgType arg, MMU *mmu, CPU *cpu)
+static inline const Instruction *
+disasm_instruction(const uint8_t *bytes)
+{
+    if (bytes[0] == 0xCB) {
+        return &cb_opcodes[bytes[1]];
+    }
+
+    return &opcodes[bytes[0]];
+}
+
+int
+disasm_size(const uint8_t *bytes)
+{
+    const Instruction *op = disasm_instruction(bytes);
+    int size = bytes[0] == 0xCB ? 2 : 1;
+
+    return size + disasm_arg_size(op->arg1) + disasm_arg_size(op->arg2);
+}
+
+// Instruction bytes: 20 FC
+static inline char *
+disasm_format_bytes(char *p, const uint8_t *bytes, int size)
+{
+    for (int i = 0; i < size; i++) {
+        if (i > 0) {
+            *p++ = ' ';
+        }
+
+        p = disasm_hex(p, bytes[i], 2);
+    }
+
+    return p;
+}
+
+// Instruction text: JR NZ,$FC. The text of an instruction with an
+// immediate operand contains a %02X or %04X where the value goes.
+static inline char *
+disasm_format_text(char *p, const uint8_t *bytes)
+{
+    const Instruction *op = disasm_instruction(bytes);
+    const uint8_t *args = bytes + (bytes[0] == 0xCB ? 2 : 1);
+
+    if (op->handler == NULL) {
+        return disasm_str(p, "???");
+    }
+
+    uint16_t value = 0;
+    if (disasm_arg_size(op->arg1) > 0) {
+        value = disasm_arg_value(op->arg1, args);
+    } else if (disasm_arg_size(op->arg2) > 0) {
+        value = disasm_arg_value(op->arg2, args);
+    }
+
+    for (const char *t = op->text; *t != '\0'; t++) {
+        if (t[0] == '%' && t[1] == '0' && (t[2] == '2' || t[2] == '4') && t[3] == 'X') {
+            p = disasm_hex(p, value, t[2] - '0');
+            t += 3;
+            continue;
+        }
+
+        *p++ = *t;
+    }
+
+    return p;
+}
+
+// Indirect memory value: @ (HL)=00
+static inline char *
+disasm_format_memval(char *p, ArgType arg, const uint8_t *bytes, MMU *mmu, CPU *cpu)
 {
-    uint16_t pc = cpu->PC;
-    uint16_t addr = 0;
-    uint16_t val = 0;
+    const uint8_t *args = bytes + (bytes[0] == 0xCB ? 2 : 1);
+    uint16_t addr;
 
     switch (arg) {
     case ARG_IND_C:
         addr = 0xFF00 + cpu->C;
-        val = mmu_read(mmu, addr);
-        str = str_addf(str, " @ (C)=%02X", val);
+        p = disasm_str(p, " @ (C)=");
         break;
     case ARG_IND_BC:
         addr = cpu->BC;
-        val = mmu_read(mmu, addr);
-        str = str_addf(str, " @ (BC)=%02X", val);
+        p = disasm_str(p, " @ (BC)=");
         break;
     case ARG_IND_DE:
         addr = cpu->DE;
-        val = mmu_read(mmu, addr);
-        str = str_addf(str, " @ (DE)=%02X", val);
+        p = disasm_str(p, " @ (DE)=");
         break;
     case ARG_IND_HL:
     case ARG_IND_HLI:
     case ARG_IND_HLD:
         addr = cpu->HL;
-        val = mmu_read(mmu, addr);
-        str = str_addf(str, " @ (HL)=%02X", val);
+        p = disasm_str(p, " @ (HL)=");
         break;
     case ARG_IND_8:
-        val = mmu_read(mmu, addr);
-        addr = 0xFF00 + disasm_arg_value(arg, mmu, pc + 1);
-        str = str_addf(str, " @ ($%02X)=%02X", addr, val);
+        addr = 0xFF00 + disasm_arg_value(arg, args);
+        p = disasm_str(p, " @ ($");
+        p = disasm_hex(p, addr, 4);
+        p = disasm_str(p, ")=");
         break;
     case ARG_IND_16:
-        val = mmu_read(mmu, addr);
-        addr = disasm_arg_value(arg, mmu, pc + 1);
-        str = str_addf(str, " @ ($%04X)=%02X", addr, val);
+        addr = disasm_arg_value(arg, args);
+        p = disasm_str(p, " @ ($");
+        p = disasm_hex(p, addr, 4);
+        p = disasm_str(p, ")=");
         break;
     default:
-        break;
+        return p;
     }
 
-    return str;
+    return disasm_hex(p, mmu_peek(mmu, addr), 2);
 }
 
-static inline String
-disasm_format_bytes(String str, MMU *mmu, uint16_t pc)
+size_t
+disasm_step(MMU *mmu, CPU *cpu, char *buf)
 {
-    uint8_t opcode = mmu_read(mmu, pc++);
-    str = str_addf(str, "%02X", opcode);
-
-    const Instruction *op = &opcodes[opcode];
-    int opsize = 1;
-
-    if (opcode == 0xCB) {
-        opcode = mmu_read(mmu, pc++);
-        str = str_addf(str, " %02X", opcode);
-        op = &cb_opcodes[opcode];
-        opsize = 2;
-    }
-
-    opsize += disasm_arg_size(op->arg1);
-    opsize += disasm_arg_size(op->arg2);
+    uint8_t bytes[4];
+    mmu_peek_range(mmu, cpu->PC, bytes, sizeof(bytes));
+    const Instruction *op = disasm_instruction(bytes);
+    char *p = buf;
 
-    // Instruction operands
-    for (int i = 0; i < opsize - 1; i++) {
-        str = str_addf(str, " %02X", mmu_read(mmu, pc++));
-    }
-
-    return str;
-}
+    // Program counter: 0x0216
+    p = disasm_str(p, "  0x");
+    p = disasm_hex(p, cpu->PC, 4);
+    p = disasm_str(p, ": ");
 
-static inline String
-disasm_format_text(String str, MMU *mmu, CPU *cpu)
-{
-    uint16_t value;
-    uint16_t pc = cpu->PC;
-    uint8_t opcode = mmu_read(mmu, pc++);
-    const Instruction *op = &opcodes[opcode];
-
-    if (opcode == 0xCB) {
-        opcode = mmu_read(mmu, pc++);
-        op = &cb_opcodes[opcode];
-    }
+    p = disasm_format_bytes(p, bytes, disasm_size(bytes));
+    p = disasm_pad(buf, p, 28);
 
-    if (op->handler == NULL) {
-        str = str_add(str, "???");
-        return str;
+    // Instruction text: JR NZ,$FC @ (HL)=00
+    p = disasm_format_text(p, bytes);
+    if (op->handler != NULL) {
+        p = disasm_format_memval(p, op->arg1, bytes, mmu, cpu);
+        p = disasm_format_memval(p, op->arg2, bytes, mmu, cpu);
     }
+    p = disasm_pad(buf, p, 54);
 
-    // Instruction text may contain a format specifier, where in instruction
-    // containing an immediate operand, the operand value is substituted.
-    if (disasm_arg_size(op->arg1) > 0) {
-        value = disasm_arg_value(op->arg1, mmu, pc);
-        str = str_addf(str, op->text, value);
-    } else if (disasm_arg_size(op->arg2) > 0) {
-        value = disasm_arg_value(op->arg2, mmu, pc);
-        str = str_addf(str, op->text, value);
-    } else {
-        str = str_add(str, op->text);
+    // CPU flags: [Z N - C]
+    *p++ = '[';
+    *p++ = cpu->flags.zero ? 'Z' : '-';
+    *p++ = ' ';
+    *p++ = cpu->flags.negative ? 'N' : '-';
+    *p++ = ' ';
+    *p++ = cpu->flags.half_carry ? 'H' : '-';
+    *p++ = ' ';
+    *p++ = cpu->flags.carry ? 'C' : '-';
+    *p++ = ']';
+    p = disasm_pad(buf, p, 68);
+
+    // CPU registers: A:00 F:00 B:00 C:00 D:00 E:00 H:00 L:00 SP:0000
+    static const char names[][4] = {"A:", " F:", " B:", " C:", " D:", " E:", " H:", " L:"};
+    const uint8_t regs[] = {cpu->A, cpu->F, cpu->B, cpu->C, cpu->D, cpu->E, cpu->H, cpu->L};
+    for (size_t i = 0; i < ARRAY_SIZE(regs); i++) {
+        p = disasm_str(p, names[i]);
+        p = disasm_hex(p, regs[i], 2);
     }
+    p = disasm_str(p, " SP:");
+    p = disasm_hex(p, cpu->SP, 4);
 
-    // Indirect memory value: @ (HL)=00
-    str = disasm_add_memval(str, op->arg1, mmu, cpu);
-    str = disasm_add_memval(str, op->arg2, mmu, cpu);
-
-    return str;
+    *p = '\0';
+    return (size_t) (p - buf);
 }
 
-String
-disasm_step(MMU *mmu, CPU *cpu, String str)
+size_t
+disasm_static(const uint8_t *bytes, uint16_t bank, uint16_t addr, char *buf)
 {
-    // Program counter: 0x0216
-    str = str_addf(str, "  0x%04X: ", cpu->PC);
-    str = str_pad(str, 9, ' ');
+    char *p = buf;
 
-    // Instruction bytes: 20 FC
-    str = disasm_format_bytes(str, mmu, cpu->PC);
-    str = str_pad(str, 28, ' ');
+    // Location: 02:4000, banks past 0xFF take a third digit like %02X does.
+    int bank_digits = bank > 0xFF ? 3 : 2;
+    p = disasm_hex(p, bank, bank_digits);
+    *p++ = ':';
+    p = disasm_hex(p, addr, 4);
+    p = disasm_str(p, "  ");
 
-    // Instruction text: JR NZ,$FC @ (HL)=00
-    str = disasm_format_text(str, mmu, cpu);
-    str = str_pad(str, 54, ' ');
+    p = disasm_format_bytes(p, bytes, disasm_size(bytes));
+    p = disasm_pad(buf, p, (size_t) (17 + bank_digits));
 
-    // CPU flags: [Z N - C]
-    str = str_addf(str, "[%c %c %c %c]",
-                    (cpu->flags.zero ? 'Z' : '-'),
-                    (cpu->flags.negative ? 'N' : '-'),
-                    (cpu->flags.half_carry ? 'H' : '-'),
-                    (cpu->flags.carry ? 'C' : '-'));
-    str = str_pad(str, 68, ' ');
-
-    // CPU registers: A:00 B:00 C:00 D:00 E:00 H:00 L:00 SP:0000
-    str = str_addf(str, "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X SP:%04X",
-                    cpu->A, cpu->F, cpu->B, cpu->C, cpu->D, cpu->E, cpu->H, cpu->L, cpu->SP);
-
-    return str;
+    p = disasm_format_text(p, bytes);
+
+    *p = '\0';
+    return (size_t) (p - buf);
 }
@@ -1,10 +1,24 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 
 #include "cpu.h"
 #include "mmu.h"
-#include "str.h"
 
-String disasm_step(MMU *mmu, CPU *cpu, String str);
+// Longest line produced by the disassembler, without the terminator.
+#define DISASM_LINE_SIZE 127
+
+// Longest instruction, disassembling reads this many bytes.
+#define DISASM_MAX_SIZE 3
+
+// Returns the length of the instruction in bytes.
+int disasm_size(const uint8_t *bytes);
+
+// Disassembles the instruction at PC along with the CPU state, for the
+// debug log. Returns the length of the line written to buf.
+size_t disasm_step(MMU *mmu, CPU *cpu, char *buf);
+
+// Disassembles the instruction in bytes, located at bank:addr in the ROM,
+// without any CPU state. Returns the length of the line written to buf.
+size_t disasm_static(const uint8_t *bytes, uint16_t bank, uint16_t addr, char *buf);
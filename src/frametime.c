@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "frametime.h"
+#include "hist.h"
+
+uint64_t
+frametime_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+void
+frametime_init(FrameTimes *ft, double refresh_hz)
+{
+    hist_reset(&ft->emulate);
+    hist_reset(&ft->present);
+    hist_reset(&ft->interval);
+    ft->period_ns = (uint64_t) (1e9 / refresh_hz);
+    ft->missed = 0;
+    ft->last_present = 0;
+}
+
+void
+frametime_emulate(FrameTimes *ft, uint64_t start, uint64_t end)
+{
+    hist_record(&ft->emulate, end - start);
+}
+
+void
+frametime_present(FrameTimes *ft, uint64_t start, uint64_t end)
+{
+    hist_record(&ft->present, end - start);
+
+    if (ft->last_present != 0) {
+        uint64_t interval = end - ft->last_present;
+        hist_record(&ft->interval, interval);
+
+        // An interval of n periods, give or take half of one, means n-1
+        // refreshes went by without a new frame.
+        uint64_t periods = (interval + ft->period_ns / 2) / ft->period_ns;
+        if (periods > 1) {
+            ft->missed += periods - 1;
+        }
+    }
+
+    ft->last_present = end;
+}
+
+static void
+frametime_report_hist(const char *name, const Hist *h, FILE *out)
+{
+    fprintf(out, "  %-9s p50 %6.2f ms  p99 %6.2f ms  p99.9 %6.2f ms  max %6.2f ms\n", name,
+            (double) hist_percentile(h, 50.0) / 1e6,
+            (double) hist_percentile(h, 99.0) / 1e6,
+            (double) hist_percentile(h, 99.9) / 1e6,
+            (double) h->max / 1e6);
+}
+
+void
+frametime_report(const FrameTimes *ft, FILE *out)
+{
+    fprintf(out, "Frame times (%llu frames):\n", (unsigned long long) ft->emulate.count);
+    frametime_report_hist("emulate:", &ft->emulate, out);
+    frametime_report_hist("present:", &ft->present, out);
+    frametime_report_hist("interval:", &ft->interval, out);
+    fprintf(out, "  missed refreshes: %llu\n", (unsigned long long) ft->missed);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hist.h"
+
+// Host wall time of every emulated frame and of every presentation, to tell
+// slow emulation apart from presentation stalls.
+typedef struct {
+    Hist emulate;  // gb_run_frame
+    Hist present;  // ui_refresh, including the wait for the next refresh
+    Hist interval; // Between the ends of two presentations
+    uint64_t period_ns;  // Expected interval
+    uint64_t missed;     // Refreshes skipped, from the intervals
+    uint64_t last_present;
+} FrameTimes;
+
+// Monotonic clock in ns.
+uint64_t frametime_now(void);
+
+void frametime_init(FrameTimes *ft, double refresh_hz);
+
+void frametime_emulate(FrameTimes *ft, uint64_t start, uint64_t end);
+
+void frametime_present(FrameTimes *ft, uint64_t start, uint64_t end);
+
+// Writes the percentiles and missed refreshes, one zone per line.
+void frametime_report(const FrameTimes *ft, FILE *out);
@@ -0,0 +1,652 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "coro.h"
+#include "cpu.h"
+#include "disasm.h"
+#include "gb.h"
+#include "interrupt.h"
+#include "joypad.h"
+#include "mapper.h"
+#include "mmu.h"
+#include "ppu.h"
+#include "serial.h"
+#include "str.h"
+#include "timer.h"
+#include "trace.h"
+
+// Large enough for the ASan instrumented build, only a few pages are
+// ever touched otherwise.
+#define GB_CORO_STACK_SIZE (256 * 1024)
+
+static void gb_cpu_main(void *arg);
+
+static void gb_ppu_main(void *arg);
+
+static void gb_timer_main(void *arg);
+
+GameBoy *
+gb_new(CPU *cpu, MMU *mmu, GBScheduler sched)
+{
+    GameBoy *gb = xalloc(sizeof(GameBoy));
+    gb->cpu = cpu;
+    gb->mmu = mmu;
+    gb->sched = sched;
+    gb->ppu_event = ppu_next_event(mmu->ppu);
+    gb->timer_event = timer_next_overflow(mmu->timer);
+    gb->window = GB_TRACE_WINDOW_ALL;
+
+    if (sched == GB_SCHED_CORO) {
+        gb->host = coro_new(NULL, NULL, 0);
+        gb->cpu_coro = coro_new(gb_cpu_main, gb, GB_CORO_STACK_SIZE);
+        gb->ppu_coro = coro_new(gb_ppu_main, gb, GB_CORO_STACK_SIZE);
+        gb->timer_coro = coro_new(gb_timer_main, gb, GB_CORO_STACK_SIZE);
+        gb->resume = gb->cpu_coro;
+    }
+
+    return gb;
+}
+
+void
+gb_free(GameBoy **gb)
+{
+    if (*gb != NULL) {
+        coro_free(&(*gb)->cpu_coro);
+        coro_free(&(*gb)->ppu_coro);
+        coro_free(&(*gb)->timer_coro);
+        coro_free(&(*gb)->host);
+        xfree((*gb)->history);
+    }
+
+    xfree(*gb);
+}
+
+// Starts looking for the trace window from the current point of the run.
+static void
+gb_trace_arm(GameBoy *gb)
+{
+    gb->trace_next = gb->window.from;
+    gb->trace_left = gb->window.around;
+    gb->history_len = 0;
+    gb->history_pos = 0;
+    gb->mmu->watch_addr = gb->window.write_addr;
+    gb->mmu->watch_hit = false;
+}
+
+void
+gb_set_trace_window(GameBoy *gb, const GBTraceWindow *window)
+{
+    gb->window = *window;
+
+    xfree(gb->history);
+    if (window->write_addr >= 0 && window->around > 0) {
+        gb->history = xalloc(window->around * sizeof(TraceRecord));
+    }
+
+    gb_trace_arm(gb);
+}
+
+void
+gb_reset(GameBoy *gb)
+{
+    cpu_reset(gb->cpu);
+    mmu_reset(gb->mmu);
+    gb->ppu_event = ppu_next_event(gb->mmu->ppu);
+    gb->timer_event = timer_next_overflow(gb->mmu->timer);
+    gb->test_result = GB_TEST_RUNNING;
+    gb->serial_len = 0;
+    gb_trace_arm(gb);
+}
+
+static inline void
+gb_print_state(const TraceRecord *rec, FILE *out)
+{
+    char line[TRACE_LINE_SIZE + 1];
+
+    size_t len = trace_format(rec, line);
+    line[len++] = '\n';
+    fwrite(line, 1, len, out);
+
+    if (ferror(out)) {
+        PANIC("%s", strerror(errno));
+    }
+}
+
+static inline void
+gb_handle_interrupts(CPU *cpu, MMU *mmu)
+{
+    static const uint8_t ints[] =  {INT_VBLANK, INT_LCD_STAT, INT_TIMER, INT_SERIAL, INT_JOYPAD};
+    static const uint16_t addrs[] = {0x0040, 0x0048, 0x0050, 0x0058, 0x0060};
+    static_assert(ARRAY_SIZE(ints) == ARRAY_SIZE(addrs), "");
+
+    if (mmu->IF == 0 || mmu->IE == 0) {
+        return;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(ints); i++) {
+        bool requested = mmu_interrupt_requested(mmu, ints[i]);
+        bool enabled = mmu_interrupt_enabled(mmu, ints[i]);
+
+        if (requested && enabled) {
+            if (cpu_interrput_enabled(cpu)) {
+                mmu_clear_interrupt(mmu, ints[i]);
+                cpu_interrupt(cpu, mmu, addrs[i]);
+            }
+
+            return;
+        }
+    }
+}
+
+// Looks for the result of a test ROM before each instruction. Blargg's
+// tests print it over the serial port, most test ROMs end in a JR -2 loop.
+static bool
+gb_test_done(GameBoy *gb)
+{
+    CPU *cpu = gb->cpu;
+    MMU *mmu = gb->mmu;
+    Serial *serial = mmu->serial;
+
+    if (serial->output.len != gb->serial_len) {
+        // Only the new bytes can complete a match.
+        size_t from = gb->serial_len > 5 ? gb->serial_len - 5 : 0;
+        const char *output = serial_output(serial) + from;
+        gb->serial_len = serial->output.len;
+
+        if (strstr(output, "Passed") != NULL) {
+            gb->test_result = GB_TEST_PASSED;
+        } else if (strstr(output, "Failed") != NULL) {
+            gb->test_result = GB_TEST_FAILED;
+        }
+    }
+
+    // A JR -2 loop only ends the test when no interrupt can leave it, an
+    // interrupt-driven ROM waits in one for its handlers. EI is delayed,
+    // so a pending EI counts as enabled.
+    bool ime = cpu->IME != 0 || cpu->ime_delay == 1;
+    bool can_interrupt = ime && (mmu->IE & 0x1F) != 0;
+
+    if (gb->test_result == GB_TEST_RUNNING && !can_interrupt &&
+        mmu_peek(mmu, cpu->PC) == 0x18 && mmu_peek(mmu, cpu->PC + 1) == 0xFE) {
+        gb->test_result = GB_TEST_HUNG;
+    }
+
+    if (gb->test_result != GB_TEST_RUNNING) {
+        gb->test_ticks = mmu->ticks;
+        return true;
+    }
+
+    return false;
+}
+
+// Writes an instruction to the outputs. The disassembly reads memory, so
+// it is only written for the instruction that is about to run.
+static void
+gb_trace_write(GameBoy *gb, const TraceRecord *rec, bool current)
+{
+    if (gb->state_out != NULL) {
+        gb_print_state(rec, gb->state_out);
+    }
+
+    if (gb->trace != NULL) {
+        trace_push(gb->trace, rec);
+    }
+
+    if (gb->debug_out != NULL && current) {
+        char line[DISASM_LINE_SIZE + 1];
+        size_t len = disasm_step(gb->mmu, gb->cpu, line);
+        line[len++] = '\n';
+        fwrite(line, 1, len, gb->debug_out);
+
+        if (ferror(gb->debug_out)) {
+            PANIC("%s", strerror(errno));
+        }
+    }
+}
+
+// Keeps the last instructions before the watched write in a ring.
+static inline void
+gb_trace_remember(GameBoy *gb, const TraceRecord *rec)
+{
+    size_t size = gb->window.around;
+    if (size == 0) {
+        return;
+    }
+
+    gb->history[gb->history_pos] = *rec;
+    gb->history_pos = (gb->history_pos + 1) % size;
+    if (gb->history_len < size) {
+        gb->history_len++;
+    }
+}
+
+static void
+gb_trace_flush_history(GameBoy *gb)
+{
+    if (gb->history_len == 0) {
+        return;
+    }
+
+    size_t size = gb->window.around;
+    size_t start = (gb->history_pos + size - gb->history_len) % size;
+
+    for (size_t i = 0; i < gb->history_len; i++) {
+        gb_trace_write(gb, &gb->history[(start + i) % size], false);
+    }
+
+    gb->history_len = 0;
+}
+
+// Decides whether the instruction that is about to run is logged. It is
+// only called once the master clock reaches trace_next, which is pushed to
+// the end of time whenever nothing can be logged for a while.
+static void
+gb_trace_step(GameBoy *gb)
+{
+    CPU *cpu = gb->cpu;
+    MMU *mmu = gb->mmu;
+    const GBTraceWindow *w = &gb->window;
+
+    if (gb->debug_out == NULL && gb->state_out == NULL && gb->trace == NULL) {
+        gb->trace_next = UINT64_MAX;
+        return;
+    }
+
+    if (mmu->ticks < w->from) {
+        gb->trace_next = w->from;
+        return;
+    }
+
+    // gb_run_frame checks again at the VBLANK that opens the window.
+    if (gb->frames < w->frame || (w->until != 0 && mmu->ticks >= w->until)) {
+        gb->trace_next = UINT64_MAX;
+        return;
+    }
+
+    if (cpu->PC < w->pc_start || cpu->PC > w->pc_end) {
+        return;
+    }
+
+    if (w->bank >= 0 && (cpu->PC >= 0x8000 || mapper_rom_bank(mmu->mapper, cpu->PC) != w->bank)) {
+        return;
+    }
+
+    TraceRecord rec;
+    trace_capture(&rec, cpu, mmu);
+
+    if (w->write_addr >= 0) {
+        if (!mmu->watch_hit) {
+            gb_trace_remember(gb, &rec);
+            return;
+        }
+
+        gb_trace_flush_history(gb);
+
+        if (gb->trace_left == 0) {
+            gb->trace_next = UINT64_MAX;
+            return;
+        }
+
+        gb->trace_left--;
+    }
+
+    gb_trace_write(gb, &rec, true);
+}
+
+// Runs the CPU for one M-cycle, logging the instruction that is about to
+// start when requested.
+static inline void
+gb_cpu_cycle(GameBoy *gb)
+{
+    CPU *cpu = gb->cpu;
+    MMU *mmu = gb->mmu;
+
+    if (cpu->step == 0 && !cpu->halted) {
+        if (gb->test && gb_test_done(gb)) {
+            return;
+        }
+
+        // Outside the trace window this is the only check.
+        if (mmu->ticks >= gb->trace_next) {
+            gb_trace_step(gb);
+        }
+    }
+
+    gb_handle_interrupts(cpu, mmu);
+    cpu_step(cpu, mmu);
+}
+
+static inline void
+gb_timer_interrupts(MMU *mmu)
+{
+    if (timer_interrupt(mmu->timer, mmu->ticks)) {
+        mmu_set_interrupt(mmu, INT_TIMER);
+    }
+}
+
+// Forwards the interrupts requested by the PPU, returns true on VBLANK.
+static inline bool
+gb_ppu_interrupts(MMU *mmu)
+{
+    bool vblank = ppu_vblank_interrupt(mmu->ppu);
+    if (vblank) {
+        mmu_set_interrupt(mmu, INT_VBLANK);
+    }
+
+    if (ppu_stat_interrupt(mmu->ppu)) {
+        mmu_set_interrupt(mmu, INT_LCD_STAT);
+    }
+
+    return vblank;
+}
+
+static void
+gb_run_frame_event(GameBoy *gb)
+{
+    MMU *mmu = gb->mmu;
+    bool vblank = false;
+
+    while (!vblank && gb->test_result == GB_TEST_RUNNING) {
+        // CPU is clocked at 1/4 of the master clock. The timer is
+        // event-based, it only does work when accessed or when the
+        // overflow is due.
+        if (mmu->ticks%4 == 0) {
+            gb_timer_interrupts(mmu);
+            gb_cpu_cycle(gb);
+        }
+
+        // The PPU only runs when the CPU accesses it or its next event
+        // is due, interrupts can only be requested at events.
+        if (mmu->ticks >= gb->ppu_event) {
+            ppu_sync(mmu->ppu, mmu->ticks + 1);
+            vblank = gb_ppu_interrupts(mmu);
+            gb->ppu_event = ppu_next_event(mmu->ppu);
+        }
+
+        mmu_dma_step(mmu);
+        mmu->ticks++;
+    }
+}
+
+// Reference scheduler: steps the PPU on every master clock cycle.
+static void
+gb_run_frame_lockstep(GameBoy *gb)
+{
+    MMU *mmu = gb->mmu;
+    bool vblank = false;
+
+    while (!vblank && gb->test_result == GB_TEST_RUNNING) {
+        if (mmu->ticks%4 == 0) {
+            gb_timer_interrupts(mmu);
+            gb_cpu_cycle(gb);
+        }
+
+        ppu_sync(mmu->ppu, mmu->ticks + 1);
+        vblank = gb_ppu_interrupts(mmu);
+
+        mmu_dma_step(mmu);
+        mmu->ticks++;
+    }
+}
+
+// The CPU coroutine owns the master clock. It only yields when the timer
+// or the PPU has an event due, register accesses in between are handled
+// by the MMU catching the component up. The deadlines are cached, they
+// only move when a component runs or when one of its registers is written.
+static void
+gb_cpu_main(void *arg)
+{
+    GameBoy *gb = arg;
+    MMU *mmu = gb->mmu;
+
+    while (true) {
+        if (gb->timer_event <= mmu->ticks) {
+            coro_switch(gb->cpu_coro, gb->timer_coro);
+            gb->timer_event = timer_next_overflow(mmu->timer);
+        }
+
+        gb_cpu_cycle(gb);
+
+        if (gb->test_result != GB_TEST_RUNNING) {
+            gb->resume = gb->cpu_coro;
+            coro_switch(gb->cpu_coro, gb->host);
+        }
+
+        if (mmu->events_moved) {
+            mmu->events_moved = false;
+            gb->timer_event = timer_next_overflow(mmu->timer);
+            gb->ppu_event = ppu_next_event(mmu->ppu);
+        }
+
+        for (int i = 0; i < 4; i++) {
+            if (gb->ppu_event <= mmu->ticks) {
+                coro_switch(gb->cpu_coro, gb->ppu_coro);
+                gb->ppu_event = ppu_next_event(mmu->ppu);
+            }
+
+            mmu_dma_step(mmu);
+            mmu->ticks++;
+        }
+    }
+}
+
+static void
+gb_ppu_main(void *arg)
+{
+    GameBoy *gb = arg;
+    MMU *mmu = gb->mmu;
+
+    while (true) {
+        uint64_t event = ppu_next_event(mmu->ppu);
+        if (event > mmu->ticks) {
+            coro_switch(gb->ppu_coro, gb->cpu_coro);
+            continue;
+        }
+
+        ppu_sync(mmu->ppu, event + 1);
+
+        // The frame ends here, the next one resumes right after VBLANK.
+        if (gb_ppu_interrupts(mmu)) {
+            gb->resume = gb->ppu_coro;
+            coro_switch(gb->ppu_coro, gb->host);
+        }
+    }
+}
+
+static void
+gb_timer_main(void *arg)
+{
+    GameBoy *gb = arg;
+
+    while (true) {
+        gb_timer_interrupts(gb->mmu);
+        coro_switch(gb->timer_coro, gb->cpu_coro);
+    }
+}
+
+void
+gb_run_frame(GameBoy *gb)
+{
+    switch (gb->sched) {
+    case GB_SCHED_EVENT:
+        gb_run_frame_event(gb);
+        break;
+    case GB_SCHED_LOCKSTEP:
+        gb_run_frame_lockstep(gb);
+        break;
+    case GB_SCHED_CORO:
+        coro_switch(gb->host, gb->resume);
+        break;
+    }
+
+    if (gb->test_result == GB_TEST_RUNNING) {
+        gb->frames++;
+    }
+
+    if (gb->window.frame != 0 && gb->frames == gb->window.frame) {
+        gb->trace_next = 0;
+    }
+}
+
+struct GBSnapshot {
+    CPU cpu;
+
+    // MMU
+    uint8_t ram[0x2000];
+    uint8_t hram[0x7F];
+    uint8_t IF;
+    uint8_t IE;
+    bool bootrom_mapped;
+    uint8_t dma_cycles;
+    uint8_t dma_page;
+    uint64_t ticks;
+
+    Joypad joypad;
+    uint8_t serial_byte;
+    uint8_t serial_ctrl;
+    size_t serial_len;
+
+    uint64_t frames;
+    uint64_t ppu_event;
+
+    // Components with opaque state
+    uint8_t *ppu;
+    uint8_t *timer;
+    uint8_t *mapper;
+
+    // Frames gb_run_ahead shows ahead of the saved state
+    unsigned ahead;
+};
+
+GBSnapshot *
+gb_snapshot_new(GameBoy *gb)
+{
+    if (gb->sched == GB_SCHED_CORO) {
+        PANIC("snapshots are not supported by the coroutine scheduler");
+    }
+
+    GBSnapshot *snap = xalloc(sizeof(GBSnapshot));
+    snap->ppu = xalloc(ppu_snapshot_size());
+    snap->timer = xalloc(timer_snapshot_size());
+    // A mapper without state has an empty snapshot, calloc may fail on it.
+    snap->mapper = xalloc(mapper_snapshot_size(gb->mmu->mapper) + 1);
+
+    return snap;
+}
+
+void
+gb_snapshot_free(GBSnapshot **snap)
+{
+    if (*snap != NULL) {
+        xfree((*snap)->ppu);
+        xfree((*snap)->timer);
+        xfree((*snap)->mapper);
+    }
+
+    xfree(*snap);
+}
+
+void
+gb_snapshot_reset(GBSnapshot *snap)
+{
+    snap->ahead = 0;
+}
+
+void
+gb_snapshot_save(GameBoy *gb, GBSnapshot *snap)
+{
+    MMU *mmu = gb->mmu;
+
+    snap->cpu = *gb->cpu;
+
+    memcpy(snap->ram, mmu->ram, sizeof(snap->ram));
+    memcpy(snap->hram, mmu->hram, sizeof(snap->hram));
+    snap->IF = mmu->IF;
+    snap->IE = mmu->IE;
+    snap->bootrom_mapped = mmu->bootrom_mapped;
+    snap->dma_cycles = mmu->dma_cycles;
+    snap->dma_page = mmu->dma_page;
+    snap->ticks = mmu->ticks;
+
+    snap->joypad = *mmu->joypad;
+    snap->serial_byte = mmu->serial->byte;
+    snap->serial_ctrl = mmu->serial->ctrl;
+    snap->serial_len = mmu->serial->output.len;
+
+    snap->frames = gb->frames;
+    snap->ppu_event = gb->ppu_event;
+
+    ppu_snapshot(mmu->ppu, snap->ppu);
+    timer_snapshot(mmu->timer, snap->timer);
+    mapper_snapshot(mmu->mapper, snap->mapper);
+}
+
+void
+gb_snapshot_load(GameBoy *gb, const GBSnapshot *snap)
+{
+    MMU *mmu = gb->mmu;
+
+    // The profiler is not part of the emulated state.
+    Profiler *prof = gb->cpu->prof;
+    *gb->cpu = snap->cpu;
+    gb->cpu->prof = prof;
+
+    memcpy(mmu->ram, snap->ram, sizeof(mmu->ram));
+    memcpy(mmu->hram, snap->hram, sizeof(mmu->hram));
+    mmu->IF = snap->IF;
+    mmu->IE = snap->IE;
+    mmu->bootrom_mapped = snap->bootrom_mapped;
+    mmu->dma_cycles = snap->dma_cycles;
+    mmu->dma_page = snap->dma_page;
+    mmu->ticks = snap->ticks;
+
+    *mmu->joypad = snap->joypad;
+    mmu->serial->byte = snap->serial_byte;
+    mmu->serial->ctrl = snap->serial_ctrl;
+    if (snap->serial_len < mmu->serial->output.len) {
+        mmu->serial->output = str_trunc(mmu->serial->output, snap->serial_len);
+    }
+
+    gb->frames = snap->frames;
+    gb->ppu_event = snap->ppu_event;
+
+    ppu_restore(mmu->ppu, snap->ppu);
+    timer_restore(mmu->timer, snap->timer);
+    mapper_restore(mmu->mapper, snap->mapper);
+}
+
+void
+gb_run_ahead(GameBoy *gb, GBSnapshot *snap, unsigned frames)
+{
+    PPU *ppu = gb->mmu->ppu;
+
+    if (frames == 0) {
+        gb_run_frame(gb);
+        return;
+    }
+
+    // The machine trails the shown frame by the run-ahead. It stays put
+    // while the lead builds up after a start or a reset, so that the shown
+    // frames keep the pace of a run without run-ahead.
+    if (snap->ahead < frames) {
+        snap->ahead++;
+    } else {
+        snap->ahead = frames;
+        ppu_set_skip_render(ppu, true);
+        gb_run_frame(gb);
+    }
+
+    gb_snapshot_save(gb, snap);
+
+    for (unsigned i = 0; i < snap->ahead; i++) {
+        ppu_set_skip_render(ppu, i + 1 < snap->ahead);
+        gb_run_frame(gb);
+    }
+
+    gb_snapshot_load(gb, snap);
+}
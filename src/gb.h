@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "coro.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "trace.h"
+
+// How the components are interleaved with the CPU. All schedulers produce
+// the same emulation, they differ only in how much work they do for it.
+typedef enum {
+    GB_SCHED_EVENT = 0,    // PPU and timer run only when accessed or when their next event is due
+    GB_SCHED_LOCKSTEP = 1, // PPU is stepped and interrupts are checked on every master clock cycle
+    GB_SCHED_CORO = 2,     // CPU, PPU and timer are coroutines, the CPU runs ahead until an event is due
+} GBScheduler;
+
+typedef enum {
+    GB_TEST_RUNNING = 0,
+    GB_TEST_PASSED = 1,
+    GB_TEST_FAILED = 2,
+    GB_TEST_HUNG = 3, // Entered a JR -2 loop no interrupt can leave, without a result
+} GBTestResult;
+
+// Limits the debug, state and trace outputs to a part of the run. An
+// instruction is logged only when all of the conditions hold.
+typedef struct {
+    uint64_t from;       // Master clock to start at
+    uint64_t until;      // Master clock to stop at, 0 for no limit
+    uint64_t frame;      // Number of VBLANKs to wait for
+    int32_t bank;        // ROM bank PC must be in, -1 for any
+    uint16_t pc_start;   // PC range, inclusive
+    uint16_t pc_end;
+    int32_t write_addr;  // Log around the first write to this address, -1 for none
+    uint32_t around;     // Instructions logged before and after that write
+} GBTraceWindow;
+
+// Logs every instruction.
+#define GB_TRACE_WINDOW_ALL ((GBTraceWindow) {.bank = -1, .pc_end = 0xFFFF, .write_addr = -1})
+
+// Copy of the emulated state of a GameBoy, to return to it later. Only
+// the event and lockstep schedulers with the inline renderer support it.
+typedef struct GBSnapshot GBSnapshot;
+
+typedef struct GameBoy {
+    CPU *cpu;
+    MMU *mmu;
+    GBScheduler sched;
+    FILE *debug_out; // Disassembly of each instruction, if not NULL
+    FILE *state_out; // CPU state before each instruction, if not NULL
+    Tracer *trace;   // Binary CPU state before each instruction, if not NULL
+    uint64_t frames; // Frames run so far
+    uint64_t ppu_event;   // Next PPU event, cached by the event and coroutine schedulers
+    uint64_t timer_event; // Next timer overflow, cached by the coroutine scheduler
+
+    // Trace window, the outputs are left alone until trace_next
+    GBTraceWindow window;
+    uint64_t trace_next;      // Master clock of the next window check
+    uint32_t trace_left;      // Instructions left to log after the watched write
+    TraceRecord *history;     // Instructions before the watched write
+    size_t history_len;
+    size_t history_pos;
+
+    // Test mode: stop as soon as a test ROM reports its result
+    bool test;
+    GBTestResult test_result;
+    uint64_t test_ticks; // Master clock when the result was reported
+    size_t serial_len;
+
+    // Coroutine scheduler
+    Coro *host;
+    Coro *cpu_coro;
+    Coro *ppu_coro;
+    Coro *timer_coro;
+    Coro *resume; // Coroutine to resume on the next frame
+} GameBoy;
+
+GameBoy *gb_new(CPU *cpu, MMU *mmu, GBScheduler sched);
+
+void gb_free(GameBoy **gb);
+
+void gb_reset(GameBoy *gb);
+
+// Sets the part of the run that is logged to the debug, state and trace
+// outputs, the outputs must be set before.
+void gb_set_trace_window(GameBoy *gb, const GBTraceWindow *window);
+
+// Runs the emulation until the PPU requests the next VBLANK interrupt, or
+// until the test ROM reports its result in test mode.
+void gb_run_frame(GameBoy *gb);
+
+// Each frame of run-ahead is emulated on every host frame.
+#define GB_RUN_AHEAD_MAX 4
+
+GBSnapshot *gb_snapshot_new(GameBoy *gb);
+
+void gb_snapshot_free(GBSnapshot **snap);
+
+// Drops the run-ahead lead, call it after gb_reset so that the lead builds
+// up again from the first frame.
+void gb_snapshot_reset(GBSnapshot *snap);
+
+void gb_snapshot_save(GameBoy *gb, GBSnapshot *snap);
+
+void gb_snapshot_load(GameBoy *gb, const GBSnapshot *snap);
+
+// Shows the next frame with the given number of frames of run-ahead: the
+// machine itself trails the shown frames by that many. Each call runs it
+// one frame, saves it, runs it up to the shown frame with the same input
+// (rendering only that one) and rolls back. The shown frames are the ones
+// of a run without run-ahead, but the input reaches them that many frames
+// sooner.
+void gb_run_ahead(GameBoy *gb, GBSnapshot *snap, unsigned frames);
@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "hist.h"
+
+static inline uint32_t
+hist_index(uint64_t value)
+{
+    if (value < HIST_SUB_COUNT) {
+        return (uint32_t) value;
+    }
+
+    // The top HIST_SUB_BITS bits of the value select the bucket.
+    uint32_t shift = (uint32_t) (63 - __builtin_clzll(value)) - (HIST_SUB_BITS - 1);
+    return shift * HIST_HALF_COUNT + (uint32_t) (value >> shift);
+}
+
+static inline uint64_t
+hist_highest(uint32_t index)
+{
+    if (index < HIST_SUB_COUNT) {
+        return index;
+    }
+
+    uint32_t shift = index / HIST_HALF_COUNT - 1;
+    uint64_t sub = index % HIST_HALF_COUNT + HIST_HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+void
+hist_reset(Hist *h)
+{
+    memset(h, 0, sizeof(Hist));
+    h->min = UINT64_MAX;
+}
+
+void
+hist_record(Hist *h, uint64_t value)
+{
+    if (value > HIST_MAX_VALUE) {
+        value = HIST_MAX_VALUE;
+    }
+
+    h->counts[hist_index(value)]++;
+    h->count++;
+    h->sum += value;
+
+    if (value < h->min) {
+        h->min = value;
+    }
+
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+uint64_t
+hist_percentile(const Hist *h, double percentile)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+
+    // Rank of the value, at least the first one.
+    uint64_t rank = (uint64_t) ((double) h->count * percentile / 100.0 + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = hist_highest(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+double
+hist_mean(const Hist *h)
+{
+    return h->count > 0 ? (double) h->sum / (double) h->count : 0;
+}
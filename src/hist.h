@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+
+// Log-linear histogram in the style of HdrHistogram: values below 128 get
+// a bucket each, above that every power of two is split into 64 buckets,
+// so a percentile is off by less than 1.6% of its value.
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+
+// Larger values are counted as this one, about 18 minutes in ns.
+#define HIST_MAX_VALUE ((UINT64_C(1) << 40) - 1)
+
+#define HIST_BUCKETS ((40 - HIST_SUB_BITS + 2) * HIST_HALF_COUNT)
+
+typedef struct {
+    uint32_t counts[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+} Hist;
+
+void hist_reset(Hist *h);
+
+void hist_record(Hist *h, uint64_t value);
+
+// Returns the largest value counted in the bucket holding the given
+// percentile (0-100), 0 if nothing was recorded.
+uint64_t hist_percentile(const Hist *h, double percentile);
+
+double hist_mean(const Hist *h);
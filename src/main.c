@@ -1,4 +1,4 @@
-#include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
@@ -6,23 +6,33 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #include "opts.h"
 #include "common.h"
 #include "str.h"
-#include "disasm.h"
 #include "serial.h"
 #include "timer.h"
+#include "trace.h"
 #include "mapper.h"
 #include "mmu.h"
 #include "cpu.h"
 #include "rom.h"
 #include "ppu.h"
 #include "ui.h"
-#include "mbc0.h"
-#include "mbc1.h"
 #include "joypad.h"
 #include "interrupt.h"
+#include "gb.h"
+#include "frametime.h"
+#include "pacing.h"
+#include "perf.h"
+#include "prof.h"
+
+// Two minutes of emulated time, longer than any of blargg's tests take.
+#define GB_TEST_FRAMES 7200
+
+// Instructions logged before and after the write watched with --trace-write.
+#define GB_TRACE_AROUND 1000
 
 static void
 bitfield_test(void)
@@ -78,51 +88,29 @@ output_file(const char *filename)
     return fopen(filename, "w");
 }
 
-static inline void
-gb_print_state(CPU *cpu, MMU *bus, FILE *out)
-{
-    fprintf(out, "A: %02X F: %02X B: %02X C: %02X D: %02X E: %02X H: %02X L: %02X SP: %04X PC: 00:%04X",
-            cpu->A, cpu->F, cpu->B, cpu->C, cpu->D, cpu->E, cpu->H, cpu->L, cpu->SP, cpu->PC);
-
-    uint8_t bytes[4] = {
-        mmu_read(bus, cpu->PC),
-        mmu_read(bus, cpu->PC + 1),
-        mmu_read(bus, cpu->PC + 2),
-        mmu_read(bus, cpu->PC + 3),
-    };
+#if PERF_ENABLED
+static volatile sig_atomic_t gb_perf_dump_requested;
 
-    fprintf(out, " (%02X %02X %02X %02X)", bytes[0], bytes[1], bytes[2], bytes[3]);
-    fputc('\n', out);
-
-    if (ferror(out)) {
-        PANIC("%s", strerror(errno));
-    }
+static void
+gb_perf_signal(int sig)
+{
+    UNUSED(sig);
+    gb_perf_dump_requested = 1;
 }
+#endif
 
+// Closes the frame of the timing counters, dumps them on SIGUSR1.
 static inline void
-gb_handle_interrupts(CPU *cpu, MMU *mmu)
+gb_perf_frame(void)
 {
-    static const uint8_t ints[] =  {INT_VBLANK, INT_LCD_STAT, INT_TIMER, INT_SERIAL, INT_JOYPAD};
-    static const uint16_t addrs[] = {0x0040, 0x0048, 0x0050, 0x0058, 0x0060};
-    static_assert(ARRAY_SIZE(ints) == ARRAY_SIZE(addrs), "");
+#if PERF_ENABLED
+    perf_frame();
 
-    if (mmu->IF == 0 || mmu->IE == 0) {
-        return;
-    }
-
-    for (size_t i = 0; i < ARRAY_SIZE(ints); i++) {
-        bool requested = mmu_interrupt_requested(mmu, ints[i]);
-        bool enabled = mmu_interrupt_enabled(mmu, ints[i]);
-
-        if (requested && enabled) {
-            if (cpu_interrput_enabled(cpu)) {
-                mmu_clear_interrupt(mmu, ints[i]);
-                cpu_interrupt(cpu, mmu, addrs[i]);
-            }
-
-            return;
-        }
+    if (gb_perf_dump_requested) {
+        gb_perf_dump_requested = 0;
+        perf_dump(stderr);
     }
+#endif
 }
 
 static inline void
@@ -145,93 +133,253 @@ gb_handle_input(MMU *mmu)
 }
 
 static void
-gb_run_loop(CPU *cpu, MMU *mmu, FILE *debug_out, FILE *state_out)
+gb_run_loop(GameBoy *gb, const Opts *opts)
 {
-    ui_init();
-
-    uint64_t ticks = 0;
-    str_auto disasm_buf = str_new_size(1024);
-
-    while (true) {
-        if (ticks%4 == 0) {
-            if (cpu->step == 0 && !cpu->halted) {
-                if (state_out != NULL) {
-                    gb_print_state(cpu, mmu, state_out);
-                }
-
-                if (debug_out != NULL) {
-                    disasm_buf = str_trunc(disasm_buf, 0);
-                    disasm_buf = disasm_step(mmu, cpu, disasm_buf);
-                    fputs(disasm_buf.ptr, debug_out);
-                    fputc('\n', debug_out);
-
-                    if (ferror(debug_out)) {
-                        PANIC("%s", strerror(errno));
-                    }
-                }
-            }
+    MMU *mmu = gb->mmu;
+    uint64_t max_frames = opts->frames;
+    bool vsync = opts->vsync;
+    ui_init(vsync);
+
+    _cleanup_(gb_snapshot_free) GBSnapshot *snap = NULL;
+    if (opts->run_ahead > 0) {
+        snap = gb_snapshot_new(gb);
+    }
 
-            // CPU is clocked at 1/4 of the master clock.
-            gb_handle_interrupts(cpu, mmu);
-            cpu_step(cpu, mmu);
+    // Without vsync the frames are shown at the rate of the real hardware,
+    // each one as soon as its deadline comes, and the input is read right
+    // after it for the next one.
+    double refresh_hz = vsync ? ui_refresh_rate() : PACING_DMG_HZ;
+    Pacer pacer;
+    pacing_init(&pacer, refresh_hz);
+
+    FrameTimes frame_times;
+    frametime_init(&frame_times, refresh_hz);
+    ui_set_frame_times(&frame_times);
+
+    // The PPU renders straight into the texture pixels of the UI.
+    PPUColor palette[4];
+    ui_get_palette(palette);
+    ppu_set_palette(mmu->ppu, palette);
+    ppu_set_framebuffers(mmu->ppu, PPU_FORMAT_RGBA8888, ui_get_framebuffer(0), ui_get_framebuffer(1));
+
+    while (max_frames == 0 || gb->frames < max_frames) {
+        uint64_t start = frametime_now();
+        gb_run_ahead(gb, snap, (unsigned) opts->run_ahead);
+        frametime_emulate(&frame_times, start, frametime_now());
+
+        PERF_PUSH(PERF_DEBUG);
+        ui_update_debug_view(mmu->ppu);
+        PERF_POP();
+
+        if (ppu_frame_changed(mmu->ppu)) {
+            PERF_PUSH(PERF_UPLOAD);
+            ui_update_frame_view(ppu_get_frame(mmu->ppu));
+            PERF_POP();
         }
 
-        // PPU and timer run at the master clock.
-        timer_step(mmu->timer);
-        ppu_step(mmu->ppu);
-        mmu_dma_step(mmu);
+        PERF_PUSH(PERF_PRESENT);
+        if (!vsync) {
+            pacing_wait(&pacer);
+        }
 
-        // VBLANK interrupt requested
-        if (ppu_vblank_interrupt(mmu->ppu)) {
-            mmu_set_interrupt(mmu, INT_VBLANK);
+        start = frametime_now();
+        ui_refresh();
+        frametime_present(&frame_times, start, frametime_now());
+        PERF_POP();
+        gb_perf_frame();
 
-            ui_update_debug_view(ppu_get_vram(mmu->ppu));
-            ui_update_frame_view(ppu_get_frame(mmu->ppu));
-            ui_refresh();
+        // The palette might have been switched with a hotkey.
+        ui_get_palette(palette);
+        ppu_set_palette(mmu->ppu, palette);
 
-            if (ui_reset_pressed()) {
-                LOG("RESET pressed");
-                cpu_reset(cpu);
-                mmu_reset(mmu);
-            }
+        if (ui_reset_pressed()) {
+            LOG("RESET pressed");
+            gb_reset(gb);
 
-            if (ui_should_close()) {
-                break;
+            if (snap != NULL) {
+                gb_snapshot_reset(snap);
             }
+        }
 
-            gb_handle_input(mmu);
+        if (ui_should_close()) {
+            break;
         }
 
-        // LCD STAT interrupt requested
-        if (ppu_stat_interrupt(mmu->ppu)) {
-            mmu_set_interrupt(mmu, INT_LCD_STAT);
+        gb_handle_input(mmu);
+    }
+
+    ui_close();
+    frametime_report(&frame_times, stdout);
+}
+
+static double
+gb_time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void
+gb_print_stats(GameBoy *gb, double elapsed)
+{
+    const PPUStats *stats = ppu_get_stats(gb->mmu->ppu);
+    uint64_t lookups = stats->tile_row_hits + stats->tile_row_misses;
+    double hit_rate = lookups > 0 ? 100.0 * (double) stats->tile_row_hits / (double) lookups : 0;
+
+    LOG("Statistics:");
+    LOG("  Frames: %llu in %.3f s (%.1f fps)",
+        (unsigned long long) gb->frames, elapsed,
+        elapsed > 0 ? (double) gb->frames / elapsed : 0);
+    LOG("  Tile row cache: %llu hits, %llu misses (%.1f%% hit rate)",
+        (unsigned long long) stats->tile_row_hits,
+        (unsigned long long) stats->tile_row_misses, hit_rate);
+}
+
+// Reports the result of a test ROM, returns the exit code.
+static int
+gb_print_test(GameBoy *gb, Serial *serial)
+{
+    const char *output = serial_output(serial);
+    if (output[0] != '\0') {
+        fputs(output, stdout);
+        if (output[strlen(output) - 1] != '\n') {
+            fputc('\n', stdout);
         }
+    }
+
+    unsigned long long cycles = (unsigned long long) gb->test_ticks;
+    unsigned long long frames = (unsigned long long) gb->frames;
+
+    switch (gb->test_result) {
+    case GB_TEST_PASSED:
+        printf("PASSED in %llu cycles (%llu frames)\n", cycles, frames);
+        return 0;
+    case GB_TEST_FAILED:
+        printf("FAILED in %llu cycles (%llu frames)\n", cycles, frames);
+        return 1;
+    case GB_TEST_HUNG:
+        printf("HUNG without a result in %llu cycles (%llu frames)\n", cycles, frames);
+        return 2;
+    case GB_TEST_RUNNING:
+        break;
+    }
+
+    printf("TIMEOUT after %llu frames\n", frames);
+    return 2;
+}
+
+static int
+gb_render_mode(const char *name, PPURenderMode *mode)
+{
+    if (name == NULL || strcmp(name, "inline") == 0) {
+        *mode = PPU_RENDER_INLINE;
+        return RET_OK;
+    }
+
+    if (strcmp(name, "deferred") == 0) {
+        *mode = PPU_RENDER_DEFERRED;
+        return RET_OK;
+    }
+
+    if (strcmp(name, "threaded") == 0) {
+        *mode = PPU_RENDER_THREADED;
+        return RET_OK;
+    }
+
+    return RET_ERR;
+}
+
+static int
+gb_scheduler(const char *name, GBScheduler *sched)
+{
+    if (name == NULL || strcmp(name, "event") == 0) {
+        *sched = GB_SCHED_EVENT;
+        return RET_OK;
+    }
+
+    if (strcmp(name, "lockstep") == 0) {
+        *sched = GB_SCHED_LOCKSTEP;
+        return RET_OK;
+    }
+
+    if (strcmp(name, "coro") == 0) {
+        *sched = GB_SCHED_CORO;
+        return RET_OK;
+    }
 
-        // Timer interrupt requested
-        if (timer_interrupt(mmu->timer)) {
-            mmu_set_interrupt(mmu, INT_TIMER);
+    return RET_ERR;
+}
+
+static int
+gb_parse_hex16(const char *str, const char **end, uint16_t *value)
+{
+    char *pos;
+    unsigned long n = strtoul(str, &pos, 16);
+    if (pos == str || n > 0xFFFF) {
+        return RET_ERR;
+    }
+
+    *value = (uint16_t) n;
+    *end = pos;
+    return RET_OK;
+}
+
+// Parses the PC range of --trace-pc: [bank:]start-end, the bank and the
+// addresses in hex like in the profiler output and RGBDS .sym files.
+static int
+gb_trace_pc(const char *arg, GBTraceWindow *window)
+{
+    const char *colon = strchr(arg, ':');
+    if (colon != NULL) {
+        char *end;
+        unsigned long bank = strtoul(arg, &end, 16);
+        if (end == arg || end != colon || bank > 0x1FF) {
+            return RET_ERR;
         }
 
-        ticks++;
+        window->bank = (int32_t) bank;
+        arg = colon + 1;
     }
 
-    ui_close();
+    const char *end;
+    if (gb_parse_hex16(arg, &end, &window->pc_start) != RET_OK || *end != '-') {
+        return RET_ERR;
+    }
+
+    if (gb_parse_hex16(end + 1, &end, &window->pc_end) != RET_OK || *end != '\0') {
+        return RET_ERR;
+    }
+
+    return window->pc_start <= window->pc_end ? RET_OK : RET_ERR;
 }
 
-static IMapper *
-gb_get_mapper(ROM *rom)
+static int
+gb_trace_window(const Opts *opts, GBTraceWindow *window)
 {
-    switch (rom->header->type) {
-    case ROM_TYPE_ROM_ONLY:
-        return mbc0_new(rom);
-    case ROM_TYPE_MBC1:
-    case ROM_TYPE_MBC1_RAM:
-    case ROM_TYPE_MBC1_RAM_BATT:
-        return mbc1_new(rom);
-    default:
-        LOG("unknown mapper: %02X", rom->header->type);
-        return NULL;
+    *window = GB_TRACE_WINDOW_ALL;
+    window->from = opts->trace_from;
+    window->until = opts->trace_until;
+    window->frame = opts->trace_frame;
+
+    if (opts->trace_pc != NULL && gb_trace_pc(opts->trace_pc, window) != RET_OK) {
+        LOG("invalid trace PC range: %s", opts->trace_pc);
+        return RET_ERR;
     }
+
+    if (opts->trace_write != NULL) {
+        const char *end;
+        uint16_t addr;
+        if (gb_parse_hex16(opts->trace_write, &end, &addr) != RET_OK || *end != '\0') {
+            LOG("invalid trace write address: %s", opts->trace_write);
+            return RET_ERR;
+        }
+
+        window->write_addr = addr;
+        window->around = (uint32_t) (opts->trace_around > 0 ? opts->trace_around : GB_TRACE_AROUND);
+    }
+
+    return RET_OK;
 }
 
 static String
@@ -271,6 +419,32 @@ main(int argc, char **argv)
         }
     }
 
+    // Binary CPU state output
+    _autoclose_ FILE *trace_out = NULL;
+    if (opts.trace_out != NULL) {
+        // The trace is binary, the logs on stdout would be mixed into it.
+        if (strcmp(opts.trace_out, "-") == 0 || strcmp(opts.trace_out, "stdout") == 0) {
+            LOG("--trace cannot write to stdout");
+            exit(1);
+        }
+
+        trace_out = output_file(opts.trace_out);
+        if (trace_out == NULL) {
+            LOG("failed to open trace output file: %s", opts.trace_out);
+            exit(1);
+        }
+    }
+
+    // Folded call stacks of the profiler
+    _autoclose_ FILE *profile_out = NULL;
+    if (opts.profile_out != NULL) {
+        profile_out = output_file(opts.profile_out);
+        if (profile_out == NULL) {
+            LOG("failed to open profile output file: %s", opts.profile_out);
+            exit(1);
+        }
+    }
+
     // Runtime disassembly output
     _autoclose_ FILE *debug_out = NULL;
     if (opts.debug_out != NULL) {
@@ -281,13 +455,68 @@ main(int argc, char **argv)
         }
     }
 
+    PPURenderMode render_mode;
+    if (gb_render_mode(opts.render, &render_mode) != RET_OK) {
+        LOG("unknown render mode: %s", opts.render);
+        exit(1);
+    }
+
+    GBScheduler sched;
+    if (gb_scheduler(opts.sched, &sched) != RET_OK) {
+        LOG("unknown scheduler: %s", opts.sched);
+        exit(1);
+    }
+
+    GBTraceWindow trace_window;
+    if (gb_trace_window(&opts, &trace_window) != RET_OK) {
+        exit(1);
+    }
+
+    // Test ROMs run headless until they report a result.
+    if (opts.test) {
+        opts.headless = true;
+        if (opts.frames == 0) {
+            opts.frames = GB_TEST_FRAMES;
+        }
+    }
+
+    if (opts.headless && opts.frames == 0) {
+        LOG("--headless requires --frames");
+        exit(1);
+    }
+
+    // Run-ahead rolls the emulation back on every frame, the state must
+    // be copyable and nothing may watch the frames that are undone.
+    if (opts.run_ahead > GB_RUN_AHEAD_MAX) {
+        LOG("--run-ahead is at most %d frames", GB_RUN_AHEAD_MAX);
+        exit(1);
+    }
+
+    if (opts.run_ahead > 0) {
+        // Nothing is shown headless, there is no input latency to hide.
+        if (opts.headless) {
+            LOG("--run-ahead cannot be combined with --headless or --test");
+            exit(1);
+        }
+
+        if (render_mode != PPU_RENDER_INLINE || sched == GB_SCHED_CORO) {
+            LOG("--run-ahead requires the inline renderer and the event or lockstep scheduler");
+            exit(1);
+        }
+
+        if (debug_out != NULL || state_out != NULL || trace_out != NULL || profile_out != NULL) {
+            LOG("--run-ahead cannot be combined with the instruction logs or the profiler");
+            exit(1);
+        }
+    }
+
     _cleanup_(rom_free) ROM *rom = rom_open(opts.romfile);
     if (rom == NULL) {
         LOG("failed to open rom file: %s", opts.romfile);
         exit(1);
     }
 
-    _cleanup_(mapper_free) IMapper *mapper  = gb_get_mapper(rom);
+    _cleanup_(mapper_free) IMapper *mapper  = mapper_new(rom);
     if (mapper == NULL) {
         LOG("failed to load rom: %s", opts.romfile);
         exit(1);
@@ -310,9 +539,81 @@ main(int argc, char **argv)
     _cleanup_(serial_free) Serial *serial = serial_new();
     _cleanup_(joypad_free) Joypad *joypad = joypad_new();
     _cleanup_(mmu_free) MMU *mmu = mmu_new(mapper, serial, timer, ppu, joypad);
+    ppu_set_render_mode(ppu, render_mode);
+
+    _cleanup_(gb_free) GameBoy *gb = gb_new(cpu, mmu, sched);
+    gb->debug_out = debug_out;
+    gb->state_out = state_out;
+    gb->test = opts.test;
+
+    _cleanup_(trace_free) Tracer *tracer = NULL;
+    if (trace_out != NULL) {
+        tracer = trace_new(trace_out);
+        gb->trace = tracer;
+    }
+
+    gb_set_trace_window(gb, &trace_window);
+
+    _cleanup_(prof_free) Profiler *prof = NULL;
+    if (profile_out != NULL) {
+        prof = prof_new();
+        cpu->prof = prof;
+
+        // RGBDS writes the symbols next to the ROM.
+        str_auto sym_file = str_new_from(opts.romfile);
+        sym_file = gb_trunc_ext(sym_file);
+        sym_file = str_add(sym_file, ".sym");
+
+        if (opts.symbols != NULL) {
+            if (prof_load_symbols(prof, opts.symbols) != RET_OK) {
+                LOG("failed to load symbols: %s", opts.symbols);
+                exit(1);
+            }
+        } else if (access(sym_file.ptr, R_OK) == 0) { // NOLINT(misc-include-cleaner): R_OK is defined in unistd.h
+            if (prof_load_symbols(prof, sym_file.ptr) != RET_OK) {
+                LOG("failed to load symbols: %s", sym_file.ptr);
+                exit(1);
+            }
+        }
+    }
+
+#if PERF_ENABLED
+    signal(SIGUSR1, gb_perf_signal);
+    perf_init();
+#endif
 
     // Main loop
-    gb_run_loop(cpu, mmu, debug_out, state_out);
+    double start = gb_time_now();
+    if (opts.headless) {
+        while (gb->frames < opts.frames && gb->test_result == GB_TEST_RUNNING) {
+            gb_run_frame(gb);
+            gb_perf_frame();
+        }
+    } else {
+        gb_run_loop(gb, &opts);
+    }
+
+    if (opts.stats) {
+        gb_print_stats(gb, gb_time_now() - start);
+    }
+
+#if CPU_PROFILE
+    cpu_profile_report(cpu, stdout);
+#endif
+
+#if PERF_ENABLED
+    perf_dump(stderr);
+#endif
+
+    if (prof != NULL) {
+        prof_write_hotspots(prof, stdout, 20);
+        prof_write_folded(prof, profile_out);
+    }
+
+    int exit_code = 0;
+    if (opts.test) {
+        exit_code = gb_print_test(gb, serial);
+    }
 
     // Save battery-backed RAM
     if (mapper_save_state(mapper, save_file.ptr) != RET_OK) {
@@ -320,5 +621,5 @@ main(int argc, char **argv)
         exit(1);
     }
 
-    return 0;
+    return exit_code;
 }
@@ -2,8 +2,27 @@
 #include <stdint.h>
 #include <assert.h>
 
+#include "common.h"
 #include "mapper.h"
+#include "mbc0.h"
+#include "mbc1.h"
+#include "rom.h"
 
+IMapper *
+mapper_new(ROM *rom)
+{
+    switch (rom->header->type) {
+    case ROM_TYPE_ROM_ONLY:
+        return mbc0_new(rom);
+    case ROM_TYPE_MBC1:
+    case ROM_TYPE_MBC1_RAM:
+    case ROM_TYPE_MBC1_RAM_BATT:
+        return mbc1_new(rom);
+    default:
+        LOG("unknown mapper: %02X", rom->header->type);
+        return NULL;
+    }
+}
 
 inline void
 mapper_write(IMapper *mapper, uint16_t addr, uint8_t data)
@@ -26,6 +45,13 @@ mapper_reset(IMapper *mapper)
     mapper->reset(mapper);
 }
 
+inline uint16_t
+mapper_rom_bank(IMapper *mapper, uint16_t addr)
+{
+    assert(mapper->rom_bank != NULL);
+    return mapper->rom_bank(mapper, addr);
+}
+
 int
 mapper_save_state(IMapper *mapper, const char *filename)
 {
@@ -40,6 +66,27 @@ mapper_load_state(IMapper *mapper, const char *filename)
     return mapper->load_state(mapper, filename);
 }
 
+size_t
+mapper_snapshot_size(IMapper *mapper)
+{
+    assert(mapper->snapshot_size != NULL);
+    return mapper->snapshot_size(mapper);
+}
+
+void
+mapper_snapshot(IMapper *mapper, void *buf)
+{
+    assert(mapper->snapshot != NULL);
+    mapper->snapshot(mapper, buf);
+}
+
+void
+mapper_restore(IMapper *mapper, const void *buf)
+{
+    assert(mapper->restore != NULL);
+    mapper->restore(mapper, buf);
+}
+
 inline void
 mapper_free(IMapper **mapper)
 {
@@ -2,6 +2,7 @@
 
 #include <complex.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <assert.h>
 
@@ -15,19 +16,39 @@ typedef struct IMapper {
     void (*reset)(struct IMapper *mapper);
     void (*free)(struct IMapper *mapper);
 
+    // ROM bank mapped at a ROM address (0x0000 - 0x7FFF):
+    uint16_t (*rom_bank)(struct IMapper *mapper, uint16_t addr);
+
     // For battery-backed cartridges:
     int (*save_state)(struct IMapper *mapper, const char *filename);
     int (*load_state)(struct IMapper *mapper, const char *filename);
+
+    // In-memory copies of the registers and cartridge RAM, for run-ahead:
+    size_t (*snapshot_size)(struct IMapper *mapper);
+    void (*snapshot)(struct IMapper *mapper, void *buf);
+    void (*restore)(struct IMapper *mapper, const void *buf);
 } IMapper;
 
+// Creates the mapper for the cartridge type in the ROM header, NULL if it
+// is not supported.
+IMapper *mapper_new(ROM *rom);
+
 void mapper_write(IMapper *mapper, uint16_t addr, uint8_t data);
 
 uint8_t mapper_read(IMapper *mapper, uint16_t addr);
 
 void mapper_reset(IMapper *mapper);
 
+uint16_t mapper_rom_bank(IMapper *mapper, uint16_t addr);
+
 void mapper_free(IMapper **mapper);
 
 int mapper_save_state(IMapper *mapper, const char *filename);
 
 int mapper_load_state(IMapper *mapper, const char *filename);
+
+size_t mapper_snapshot_size(IMapper *mapper);
+
+void mapper_snapshot(IMapper *mapper, void *buf);
+
+void mapper_restore(IMapper *mapper, const void *buf);
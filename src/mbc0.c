@@ -10,8 +10,12 @@ static IMapper mbc0_mapper = {
     .read = mbc0_read,
     .reset = mbc0_reset,
     .free = mbc0_free,
+    .rom_bank = mbc0_rom_bank,
     .load_state = mbc0_load,
     .save_state = mbc0_save,
+    .snapshot_size = mbc0_snapshot_size,
+    .snapshot = mbc0_snapshot,
+    .restore = mbc0_restore,
 };
 
 IMapper *
@@ -37,6 +41,13 @@ mbc0_reset(IMapper *mapper)
     UNUSED(mapper);
 }
 
+uint16_t
+mbc0_rom_bank(IMapper *mapper, uint16_t addr)
+{
+    UNUSED(mapper);
+    return addr < 0x4000 ? 0 : 1;
+}
+
 uint8_t
 mbc0_read(IMapper *mapper, uint16_t addr)
 {
@@ -72,3 +83,25 @@ mbc0_save(IMapper *mapper, const char *filename)
     UNUSED(filename);
     return RET_OK;
 }
+
+// Without registers or RAM there is nothing to snapshot.
+size_t
+mbc0_snapshot_size(IMapper *mapper)
+{
+    UNUSED(mapper);
+    return 0;
+}
+
+void
+mbc0_snapshot(IMapper *mapper, void *buf)
+{
+    UNUSED(mapper);
+    UNUSED(buf);
+}
+
+void
+mbc0_restore(IMapper *mapper, const void *buf)
+{
+    UNUSED(mapper);
+    UNUSED(buf);
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "rom.h"
@@ -20,6 +21,14 @@ void mbc0_free(IMapper *mapper);
 
 void mbc0_reset(IMapper *mapper);
 
+uint16_t mbc0_rom_bank(IMapper *mapper, uint16_t addr);
+
 int mbc0_save(IMapper *mapper, const char *filename);
 
 int mbc0_load(IMapper *mapper, const char *filename);
+
+size_t mbc0_snapshot_size(IMapper *mapper);
+
+void mbc0_snapshot(IMapper *mapper, void *buf);
+
+void mbc0_restore(IMapper *mapper, const void *buf);
@@ -16,8 +16,12 @@ static IMapper mbc1_mapper = {
     .read = mbc1_read,
     .free = mbc1_free,
     .reset = mbc1_reset,
+    .rom_bank = mbc1_rom_bank,
     .load_state = mbc1_load,
     .save_state = mbc1_save,
+    .snapshot_size = mbc1_snapshot_size,
+    .snapshot = mbc1_snapshot,
+    .restore = mbc1_restore,
 };
 
 IMapper *
@@ -54,6 +58,13 @@ void mbc1_reset(IMapper *mapper)
     impl->ram_bank = 0;
 }
 
+uint16_t
+mbc1_rom_bank(IMapper *mapper, uint16_t addr)
+{
+    MBC1 *impl = CONTAINER_OF(mapper, MBC1, imapper);
+    return addr < 0x4000 ? 0 : impl->rom_bank;
+}
+
 uint8_t
 mbc1_read(IMapper *mapper, uint16_t addr)
 {
@@ -190,3 +201,30 @@ mbc1_load(IMapper *mapper, const char *filename)
 
     return 0;
 }
+
+// A snapshot is the whole MBC1, followed by the cartridge RAM.
+size_t
+mbc1_snapshot_size(IMapper *mapper)
+{
+    MBC1 *impl = CONTAINER_OF(mapper, MBC1, imapper);
+    return sizeof(MBC1) + impl->ram_size;
+}
+
+void
+mbc1_snapshot(IMapper *mapper, void *buf)
+{
+    MBC1 *impl = CONTAINER_OF(mapper, MBC1, imapper);
+    memcpy(buf, impl, sizeof(MBC1));
+    memcpy((uint8_t *) buf + sizeof(MBC1), impl->ram, impl->ram_size);
+}
+
+void
+mbc1_restore(IMapper *mapper, const void *buf)
+{
+    MBC1 *impl = CONTAINER_OF(mapper, MBC1, imapper);
+    uint8_t *ram = impl->ram;
+
+    memcpy(impl, buf, sizeof(MBC1));
+    impl->ram = ram;
+    memcpy(ram, (const uint8_t *) buf + sizeof(MBC1), impl->ram_size);
+}
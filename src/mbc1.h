@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "mapper.h"
@@ -28,6 +29,14 @@ void mbc1_free(IMapper *mapper);
 
 void mbc1_reset(IMapper *mapper);
 
+uint16_t mbc1_rom_bank(IMapper *mapper, uint16_t addr);
+
 int mbc1_save(IMapper *mapper, const char *filename);
 
 int mbc1_load(IMapper *mapper, const char *filename);
+
+size_t mbc1_snapshot_size(IMapper *mapper);
+
+void mbc1_snapshot(IMapper *mapper, void *buf);
+
+void mbc1_restore(IMapper *mapper, const void *buf);
@@ -6,6 +6,7 @@
 #include "mapper.h"
 #include "timer.h"
 #include "mmu.h"
+#include "perf.h"
 #include "serial.h"
 #include "ppu.h"
 #include "boot.h"
@@ -21,6 +22,7 @@ mmu_new(IMapper *mapper, Serial *serial, Timer *timer, PPU *ppu, Joypad *joypad)
     mmu->serial = serial;
     mmu->timer = timer;
     mmu->ppu = ppu;
+    mmu->watch_addr = -1;
     mmu_reset(mmu);
     return mmu;
 }
@@ -34,7 +36,7 @@ void
 mmu_reset(MMU *mmu)
 {
     ppu_reset(mmu->ppu);
-    timer_reset(mmu->timer);
+    timer_reset(mmu->timer, mmu->ticks);
     serial_reset(mmu->serial);
     mapper_reset(mmu->mapper);
     joypad_reset(mmu->joypad);
@@ -45,17 +47,18 @@ mmu_reset(MMU *mmu)
     mmu->bootrom_mapped = true;
     mmu->IE = 0;
     mmu->IF = 0;
+    mmu->events_moved = true;
 }
 
 static inline uint8_t
-mmu_read_rom(MMU *mmu, uint16_t addr)
+mmu_read_rom(MMU *mmu, uint16_t addr, bool peek)
 {
     if (mmu->bootrom_mapped) {
         if (addr < 0x0100) {
             return boot_rom_dmg[addr];
         }
 
-        if (addr == 0x0100) {
+        if (addr == 0x0100 && !peek) {
             mmu->bootrom_mapped = false;
         }
     }
@@ -63,8 +66,11 @@ mmu_read_rom(MMU *mmu, uint16_t addr)
     return mapper_read(mmu->mapper, addr);
 }
 
-uint8_t
-mmu_read(MMU *mmu, uint16_t addr)
+// Peeking reads the same values as the CPU, but leaves the boot ROM
+// mapped and does not log. Components are still caught up with the
+// clock, which the emulation cannot observe.
+static inline uint8_t
+mmu_read_addr(MMU *mmu, uint16_t addr, bool peek)
 {
 #if MMU_FIXED_LY
     if (addr == 0xFF44) {
@@ -75,7 +81,7 @@ mmu_read(MMU *mmu, uint16_t addr)
     switch (addr) {
     case 0x0000 ... 0x7FFF: // ROM
     case 0xA000 ... 0xBFFF: // External RAM
-        return mmu_read_rom(mmu, addr);
+        return mmu_read_rom(mmu, addr, peek);
     case 0xC000 ... 0xDFFF: // Internal RAM
         return mmu->ram[addr - 0xC000];
     case 0xE000 ... 0xFDFF: // Internal RAM (mirror)
@@ -83,7 +89,7 @@ mmu_read(MMU *mmu, uint16_t addr)
     case 0xFF01 ... 0xFF02: // Serial
         return serial_read(mmu->serial, addr);
     case 0xFF04 ... 0xFF07: // Timer
-        return timer_read(mmu->timer, addr);
+        return timer_read(mmu->timer, addr, mmu->ticks);
     case 0xFF0F: // Interrupt Flags
         return mmu->IF;
     case 0xFF10 ... 0xFF3F: // Sound
@@ -91,6 +97,7 @@ mmu_read(MMU *mmu, uint16_t addr)
     case 0xFF40 ... 0xFF4B: // PPU registers
     case 0x8000 ... 0x9FFF: // VRAM
     case 0xFE00 ... 0xFE9F: // OAM
+        ppu_sync(mmu->ppu, mmu->ticks);
         return ppu_read(mmu->ppu, addr);
     case 0xFEA0 ... 0xFEFF: // Unusable
         return 0;
@@ -101,11 +108,33 @@ mmu_read(MMU *mmu, uint16_t addr)
     case 0xFFFF: // Interrupt Enable
         return mmu->IE;
     default:
-        TRACE("unhandled read from 0x%04X", addr);
+        if (!peek) {
+            TRACE("unhandled read from 0x%04X", addr);
+        }
         return 0;
     }
 }
 
+uint8_t
+mmu_read(MMU *mmu, uint16_t addr)
+{
+    return mmu_read_addr(mmu, addr, false);
+}
+
+uint8_t
+mmu_peek(MMU *mmu, uint16_t addr)
+{
+    return mmu_read_addr(mmu, addr, true);
+}
+
+void
+mmu_peek_range(MMU *mmu, uint16_t addr, uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = mmu_read_addr(mmu, (uint16_t) (addr + i), true);
+    }
+}
+
 void
 mmu_write(MMU *mmu, uint16_t addr, uint8_t data)
 {
@@ -114,6 +143,10 @@ mmu_write(MMU *mmu, uint16_t addr, uint8_t data)
         mmu->dma_page = data;
     }
 
+    if (addr == mmu->watch_addr) {
+        mmu->watch_hit = true;
+    }
+
     switch (addr) {
     case 0x0000 ... 0x7FFF: // ROM
     case 0xA000 ... 0xBFFF: // External RAM
@@ -129,7 +162,8 @@ mmu_write(MMU *mmu, uint16_t addr, uint8_t data)
         serial_write(mmu->serial, addr, data);
         return;
     case 0xFF04 ... 0xFF07: // Timer
-        timer_write(mmu->timer, addr, data);
+        timer_write(mmu->timer, addr, data, mmu->ticks);
+        mmu->events_moved = true;
         return;
     case 0xFF0F: // Interrupt Flags
         mmu->IF = data;
@@ -137,8 +171,11 @@ mmu_write(MMU *mmu, uint16_t addr, uint8_t data)
     case 0xFF10 ... 0xFF3F: // Sound
         return;
     case 0xFF40 ... 0xFF4B: // PPU registers
+        mmu->events_moved = true;
+        _fallthrough_;
     case 0x8000 ... 0x9FFF: // VRAM
     case 0xFE00 ... 0xFE9F: // OAM
+        ppu_sync(mmu->ppu, mmu->ticks);
         ppu_write(mmu->ppu, addr, data);
         return;
     case 0xFEA0 ... 0xFEFF: // Unusable
@@ -187,8 +224,13 @@ mmu_dma_step(MMU *mmu)
     if (mmu->dma_cycles > 0) {
         mmu->dma_cycles--;
 
+        // The copy lands after the PPU cycle of this tick.
         if (mmu->dma_cycles == 0) {
+            ppu_sync(mmu->ppu, mmu->ticks + 1);
+
+            PERF_PUSH(PERF_DMA);
             mmu_dma_copy(mmu, mmu->dma_page);
+            PERF_POP();
         }
     }
 }
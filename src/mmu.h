@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "joypad.h"
@@ -27,6 +28,12 @@ typedef struct MMU {
     bool bootrom_mapped;
     uint8_t dma_cycles;
     uint8_t dma_page;
+
+    int32_t watch_addr;   // Address to watch for writes, -1 for none
+    bool watch_hit;       // Set on the first write to watch_addr
+    bool events_moved;    // Set on writes that can move the next timer or PPU event
+
+    uint64_t ticks;       // Master clock, advanced by the main loop
 } MMU;
 
 MMU *mmu_new(IMapper *mapper, Serial *serial, Timer *timer, PPU *ppu, Joypad *joypad);
@@ -37,6 +44,13 @@ void mmu_reset(MMU *mmu);
 
 uint8_t mmu_read(MMU *mmu, uint16_t addr);
 
+// Reads memory for debuggers and tracers, without the side effects of a
+// CPU read (unmapping the boot ROM, logging unhandled addresses).
+uint8_t mmu_peek(MMU *mmu, uint16_t addr);
+
+// Peeks len bytes starting at addr, wrapping around at 0xFFFF.
+void mmu_peek_range(MMU *mmu, uint16_t addr, uint8_t *buf, size_t len);
+
 void mmu_write(MMU *mmu, uint16_t addr, uint8_t data);
 
 uint16_t mmu_read16(MMU *mmu, uint16_t addr);
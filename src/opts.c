@@ -24,12 +24,28 @@ opts_help(void)
 
     printf("Options:\n");
     printf("  -h, --help           Print this help message\n");
+    printf("  --render <mode>      PPU rendering mode: inline (default), deferred, threaded\n");
+    printf("  --sched <scheduler>  Component scheduler: event (default), lockstep, coro\n");
+    printf("  --frames <n>         Exit after running n frames\n");
+    printf("  --headless           Run without a window (requires --frames)\n");
+    printf("  --vsync              Run at the refresh rate of the display instead of the DMG's 59.73 Hz\n");
+    printf("  --run-ahead <n>      Hide n frames of input lag by emulating ahead and rolling back (0-4)\n");
     printf("\n");
 
     printf("Debug Options:\n");
     printf("  -d, --debug <debug_out>  Enable debug mode (disassemble each instruction before executing it)\n");
     printf("  -l, --state <state_out>  Enable state log mode (log CPU state after each instruction)\n");
-    printf("  --test                   Fixed LY=0x90\n");
+    printf("  --trace <trace_out>      Write a binary CPU state log to a file, convert it with brickboy-trace\n");
+    printf("  --trace-from <cycle>     Start logging at a master clock cycle\n");
+    printf("  --trace-until <cycle>    Stop logging at a master clock cycle\n");
+    printf("  --trace-frame <n>        Start logging after the nth VBLANK\n");
+    printf("  --trace-pc <range>       Only log instructions in a PC range, as [bank:]start-end in hex (1A:4000-4FFF)\n");
+    printf("  --trace-write <addr>     Only log instructions around the first write to an address (hex)\n");
+    printf("  --trace-around <n>       Instructions logged before and after that write (default 1000)\n");
+    printf("  --profile <out>          Profile the emulated code, write the call stacks in folded format\n");
+    printf("  --symbols <file.sym>     Name the routines in the profile (default: the .sym file next to the ROM)\n");
+    printf("  --test                   Run a test ROM headless until it reports a result, exit with 0 if it passed\n");
+    printf("  --stats                  Print emulation statistics on exit\n");
 }
 
 static const struct option opts_long[] = {
@@ -38,7 +54,23 @@ static const struct option opts_long[] = {
     {"debug", required_argument, NULL, 'd'},
     {"state", required_argument, NULL, 'l'},
     {"nologo", no_argument, NULL, 0},
+    {"trace", required_argument, NULL, 0},
+    {"trace-from", required_argument, NULL, 0},
+    {"trace-until", required_argument, NULL, 0},
+    {"trace-frame", required_argument, NULL, 0},
+    {"trace-pc", required_argument, NULL, 0},
+    {"trace-write", required_argument, NULL, 0},
+    {"trace-around", required_argument, NULL, 0},
+    {"profile", required_argument, NULL, 0},
+    {"symbols", required_argument, NULL, 0},
     {"test", no_argument, NULL, 0},
+    {"stats", no_argument, NULL, 0},
+    {"render", required_argument, NULL, 0},
+    {"sched", required_argument, NULL, 0},
+    {"frames", required_argument, NULL, 0},
+    {"headless", no_argument, NULL, 0},
+    {"vsync", no_argument, NULL, 0},
+    {"run-ahead", required_argument, NULL, 0},
 
     {NULL, 0, NULL, 0},
 };
@@ -63,6 +95,40 @@ opts_parse(Opts *opts, int argc, char **argv)
                 opts->slow = true;
             } else if (strcmp(name, "nologo") == 0) {
                 opts->no_logo = true;
+            } else if (strcmp(name, "stats") == 0) {
+                opts->stats = true;
+            } else if (strcmp(name, "render") == 0) {
+                opts->render = optarg;
+            } else if (strcmp(name, "sched") == 0) {
+                opts->sched = optarg;
+            } else if (strcmp(name, "frames") == 0) {
+                opts->frames = strtoul(optarg, NULL, 10);
+            } else if (strcmp(name, "trace") == 0) {
+                opts->trace_out = optarg;
+            } else if (strcmp(name, "trace-from") == 0) {
+                opts->trace_from = strtoul(optarg, NULL, 10);
+            } else if (strcmp(name, "trace-until") == 0) {
+                opts->trace_until = strtoul(optarg, NULL, 10);
+            } else if (strcmp(name, "trace-frame") == 0) {
+                opts->trace_frame = strtoul(optarg, NULL, 10);
+            } else if (strcmp(name, "trace-pc") == 0) {
+                opts->trace_pc = optarg;
+            } else if (strcmp(name, "trace-write") == 0) {
+                opts->trace_write = optarg;
+            } else if (strcmp(name, "trace-around") == 0) {
+                opts->trace_around = strtoul(optarg, NULL, 10);
+            } else if (strcmp(name, "profile") == 0) {
+                opts->profile_out = optarg;
+            } else if (strcmp(name, "symbols") == 0) {
+                opts->symbols = optarg;
+            } else if (strcmp(name, "test") == 0) {
+                opts->test = true;
+            } else if (strcmp(name, "headless") == 0) {
+                opts->headless = true;
+            } else if (strcmp(name, "vsync") == 0) {
+                opts->vsync = true;
+            } else if (strcmp(name, "run-ahead") == 0) {
+                opts->run_ahead = strtoul(optarg, NULL, 10);
             }
 
             continue;
@@ -7,8 +7,25 @@ typedef struct Opts {
     char *romfile;
     char *debug_out;
     char *state_out;
+    char *trace_out;
+    char *render;
+    char *sched;
+    char *trace_pc;
+    char *trace_write;
+    char *profile_out;
+    char *symbols;
+    unsigned long frames;
+    unsigned long trace_from;
+    unsigned long trace_until;
+    unsigned long trace_frame;
+    unsigned long trace_around;
+    unsigned long run_ahead;
     bool no_logo;
     bool slow;
+    bool stats;
+    bool headless;
+    bool vsync;
+    bool test;
 } Opts;
 
 void opts_parse(Opts *opts, int argc, char **argv);
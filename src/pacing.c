@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "pacing.h"
+
+#define PACING_MIN_SPIN 200000 // 0.2 ms
+#define PACING_MAX_SPIN 4000000
+
+static uint64_t
+pacing_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void
+pacing_sleep_until(uint64_t deadline)
+{
+    struct timespec ts = {
+        .tv_sec = (time_t) (deadline / 1000000000u),
+        .tv_nsec = (long) (deadline % 1000000000u),
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static inline void
+pacing_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+void
+pacing_init(Pacer *p, double hz)
+{
+    p->period_ns = 1e9 / hz;
+    p->origin = pacing_now();
+    p->frame = 0;
+    p->spin_ns = PACING_MAX_SPIN / 2;
+    p->resyncs = 0;
+}
+
+void
+pacing_wait(Pacer *p)
+{
+    p->frame++;
+
+    uint64_t deadline = p->origin + (uint64_t) ((double) p->frame * p->period_ns);
+    uint64_t now = pacing_now();
+
+    if (now >= deadline) {
+        // A stall (a window drag, a breakpoint) is not caught up by
+        // running frames back to back.
+        if (now - deadline > (uint64_t) (PACING_MAX_LATE * p->period_ns)) {
+            p->origin = now;
+            p->frame = 0;
+            p->resyncs++;
+        }
+
+        return;
+    }
+
+    if (deadline - now > p->spin_ns) {
+        uint64_t target = deadline - p->spin_ns;
+        pacing_sleep_until(target);
+
+        // Keep the margin at twice the worst recent oversleep, decaying
+        // slowly when the host wakes up on time.
+        uint64_t woke = pacing_now();
+        uint64_t over = woke > target ? woke - target : 0;
+        uint64_t spin = p->spin_ns - p->spin_ns / 16;
+        if (over * 2 > spin) {
+            spin = over * 2;
+        }
+
+        if (spin < PACING_MIN_SPIN) {
+            spin = PACING_MIN_SPIN;
+        } else if (spin > PACING_MAX_SPIN) {
+            spin = PACING_MAX_SPIN;
+        }
+
+        p->spin_ns = spin;
+    }
+
+    while (pacing_now() < deadline) {
+        pacing_relax();
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+// Refresh rate of the DMG: one frame is 70224 cycles of the 4 MiHz clock.
+#define PACING_DMG_HZ (4194304.0 / 70224.0)
+
+// Frames run this late start a new schedule instead of being caught up.
+#define PACING_MAX_LATE 4
+
+// Schedules frames against the monotonic clock. Deadlines are derived from
+// the start of the schedule, not from the previous frame, so that rounding
+// and wake-up latency do not add up over time.
+typedef struct {
+    double period_ns;
+    uint64_t origin;   // Start of the schedule
+    uint64_t frame;    // Frames since the origin
+    uint64_t spin_ns;  // Busy-wait for this long before a deadline
+    uint64_t resyncs;  // Schedules restarted after falling behind
+} Pacer;
+
+void pacing_init(Pacer *p, double hz);
+
+// Waits for the deadline of the next frame: sleeps until shortly before
+// it, then spins the rest of the way. The spin margin follows the
+// oversleep of the host.
+void pacing_wait(Pacer *p);
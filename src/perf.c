@@ -0,0 +1,100 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "perf.h"
+
+#if PERF_ENABLED
+
+_Thread_local Perf perf;
+
+static const char *perf_zone_names[PERF_ZONE_COUNT] = {
+    [PERF_CPU] = "cpu",
+    [PERF_PPU] = "ppu",
+    [PERF_TIMER] = "timer",
+    [PERF_DMA] = "dma",
+    [PERF_DEBUG] = "debug",
+    [PERF_UPLOAD] = "upload",
+    [PERF_PRESENT] = "present",
+};
+
+static uint64_t
+perf_wall_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+void
+perf_init(void)
+{
+    perf.frame_ns = perf_wall_ns();
+    perf.frame_ticks = perf_now();
+    perf.mark = perf.frame_ticks;
+    perf.zone = PERF_CPU;
+}
+
+void
+perf_frame(void)
+{
+    uint64_t now = perf_now();
+    perf.ticks[perf.zone] += now - perf.mark;
+    perf.mark = now;
+
+    // The counter ticks at an unknown rate, the wall clock scales it.
+    uint64_t wall = perf_wall_ns();
+    double scale = 1.0;
+    if (now > perf.frame_ticks) {
+        scale = (double) (wall - perf.frame_ns) / (double) (now - perf.frame_ticks);
+    }
+
+    for (int i = 0; i < PERF_ZONE_COUNT; i++) {
+        uint64_t ns = (uint64_t) ((double) perf.ticks[i] * scale);
+        perf.window[i] += ns;
+        perf.total[i] += ns;
+        perf.ticks[i] = 0;
+    }
+
+    perf.frame_ns = wall;
+    perf.frame_ticks = now;
+    perf.frames++;
+
+    if (++perf.window_frames == PERF_WINDOW) {
+        for (int i = 0; i < PERF_ZONE_COUNT; i++) {
+            perf.avg[i] = (double) perf.window[i] / PERF_WINDOW;
+            perf.window[i] = 0;
+        }
+
+        perf.window_frames = 0;
+    }
+}
+
+const char *
+perf_zone_name(PerfZone zone)
+{
+    return perf_zone_names[zone];
+}
+
+void
+perf_dump(FILE *out)
+{
+    uint64_t frames = perf.frames > 0 ? perf.frames : 1;
+
+    fprintf(out, "{\"frames\":%llu,\"total_ns\":{", (unsigned long long) perf.frames);
+    for (int i = 0; i < PERF_ZONE_COUNT; i++) {
+        fprintf(out, "%s\"%s\":%llu", i > 0 ? "," : "", perf_zone_names[i],
+                (unsigned long long) perf.total[i]);
+    }
+
+    fprintf(out, "},\"frame_ns\":{");
+    for (int i = 0; i < PERF_ZONE_COUNT; i++) {
+        fprintf(out, "%s\"%s\":%llu", i > 0 ? "," : "", perf_zone_names[i],
+                (unsigned long long) (perf.total[i] / frames));
+    }
+
+    fprintf(out, "}}\n");
+    fflush(out);
+}
+
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Host time spent in each subsystem, per frame. Enabled with
+// -DPERF_ENABLED=1 (cmake -DBRICKBOY_PERF=ON), without it the PERF_*
+// macros expand to nothing.
+#ifndef PERF_ENABLED
+#define PERF_ENABLED 0
+#endif
+
+typedef enum {
+    PERF_CPU = 0, // CPU and scheduling, anything no other zone covers
+    PERF_PPU,     // PPU catch-up and scanline rendering
+    PERF_TIMER,   // Timer overflows
+    PERF_DMA,     // OAM DMA copies
+    PERF_DEBUG,   // Debug view decoding
+    PERF_UPLOAD,  // Frame texture upload
+    PERF_PRESENT, // Drawing the window and waiting for the next refresh
+    PERF_ZONE_COUNT,
+} PerfZone;
+
+#if PERF_ENABLED
+
+// Frames averaged for the overlay.
+#define PERF_WINDOW 60
+
+typedef struct {
+    uint64_t ticks[PERF_ZONE_COUNT];  // Current frame, in perf_now units
+    uint64_t window[PERF_ZONE_COUNT]; // Current window, in ns
+    uint64_t total[PERF_ZONE_COUNT];  // Whole run, in ns
+    double avg[PERF_ZONE_COUNT];      // Last window, in ns per frame
+    uint64_t frames;
+    uint64_t window_frames;
+
+    PerfZone zone;
+    PerfZone stack[8];
+    int depth;
+    uint64_t mark;     // perf_now when the zone was entered
+    uint64_t frame_ns; // Wall clock at the start of the frame
+    uint64_t frame_ticks;
+} Perf;
+
+// Per thread, brickboy-test runs a machine on each of its workers.
+extern _Thread_local Perf perf;
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+// Time stamp counter, converted to ns once per frame.
+static inline uint64_t
+perf_now(void)
+{
+    return __rdtsc();
+}
+#else
+#include <time.h>
+
+static inline uint64_t
+perf_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+#endif
+
+// Charges the time since the last switch to the running zone.
+static inline void
+perf_enter(PerfZone zone)
+{
+    uint64_t now = perf_now();
+    perf.ticks[perf.zone] += now - perf.mark;
+    perf.stack[perf.depth++] = perf.zone;
+    perf.zone = zone;
+    perf.mark = now;
+}
+
+static inline void
+perf_leave(void)
+{
+    uint64_t now = perf_now();
+    perf.ticks[perf.zone] += now - perf.mark;
+    perf.zone = perf.stack[--perf.depth];
+    perf.mark = now;
+}
+
+void perf_init(void);
+
+// Closes the frame: converts its counters to ns and updates the averages.
+void perf_frame(void);
+
+const char *perf_zone_name(PerfZone zone);
+
+// Writes the totals and the per-frame averages as one line of JSON.
+void perf_dump(FILE *out);
+
+#define PERF_PUSH(zone) perf_enter(zone)
+#define PERF_POP() perf_leave()
+
+#else
+
+#define PERF_PUSH(zone) ((void) 0)
+#define PERF_POP() ((void) 0)
+
+#endif
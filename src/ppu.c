@@ -1,8 +1,12 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
 #include "ppu.h"
+#include "perf.h"
+#include "spsc.h"
 #include "common.h"
 
 typedef enum {
@@ -56,8 +60,90 @@ typedef struct {
     };
 } Sprite;
 
+#define PPU_SPRITES_PER_LINE 10
+
+// Line dot at which the scanline is rendered (end of pixel transfer).
+#define PPU_RENDER_DOT 252
+
+// Sprite line buffer pixel layout (see ppu_fetch_obj_line).
+#define OBJ_PIXEL_COLOR 0x03
+#define OBJ_PIXEL_PALETTE1 0x10
+#define OBJ_PIXEL_BEHIND_BG 0x80
+
+// Tile addresses of one tilemap row, resolved for the current tile data
+// area. Consecutive scanlines mostly hit the same row, so it is reused
+// until the tilemap row is written or the lookup key changes.
+typedef struct {
+    bool valid;
+    uint16_t tile_map;
+    uint8_t tile_y;
+    uint8_t tiledata;
+    uint16_t tile_addr[32];
+} TileRowCache;
+
+enum {
+    PPU_LAYER_BG = 0,
+    PPU_LAYER_WIN = 1,
+};
+
+// A write to VRAM, OAM or a register the renderer depends on, stamped
+// with the position of the beam at the time of the write.
+typedef struct {
+    uint16_t addr;
+    uint8_t data;
+    uint8_t ly;
+    uint16_t dot;
+} PPUWrite;
+
+typedef enum {
+    PPU_CMD_WRITE, // VRAM or OAM write
+    PPU_CMD_LINE,  // render a line with the given registers
+    PPU_CMD_SYNC,  // report back once everything before is processed
+    PPU_CMD_QUIT,
+} PPUCommandType;
+
+// Command sent from the emulation thread to the render worker. Register
+// values are snapshotted per line, VRAM and OAM are sent as a stream of
+// writes, so the worker always sees the memory as of the line it renders.
+typedef struct {
+    uint8_t type;
+    uint8_t ly;
+    union {
+        struct {
+            uint16_t addr;
+            uint8_t data;
+        } write;
+        struct {
+            uint8_t LCDC;
+            uint8_t SCY;
+            uint8_t SCX;
+            uint8_t BGP;
+            uint8_t OBP0;
+            uint8_t OBP1;
+            uint8_t WY;
+            uint8_t WX;
+        } regs;
+    };
+} PPUCommand;
+
+#define PPU_QUEUE_SIZE (1 << 16)
+
 struct PPU {
-    uint8_t frame[144][160];
+    // Front and back buffers in the selected pixel format, swapped at
+    // VBLANK. Unless the caller provides its own, they point to
+    // frame_buffers and hold shade indices.
+    uint8_t frame_buffers[2][144][160];
+    void *buffers[2];
+    int back;
+    uint64_t frame_seq;
+
+    // Change tracking: hashes of the lines drawn last, whether the frame
+    // being drawn differs from the previous one so far, and the same for
+    // the frame in the front buffer.
+    uint64_t line_hashes[144];
+    bool back_changed;
+    bool front_changed;
+    uint64_t front_hash;
     uint8_t vram[0x2000];
     uint8_t oam[0xA0];
 
@@ -77,12 +163,82 @@ struct PPU {
     bool vblank_interrupt;
     bool stat_interrupt;
     int line_ticks;
+    uint64_t cycles; // master cycles the PPU has run for
+
+    TileRowCache tile_rows[2]; // BG and window
+    PPUStats stats;
+    PPUDirty dirty;
+
+    // lut maps a shade to its value in the output pixel format.
+    PPUPixelFormat format;
+    PPUColor palette[4];
+    uint32_t lut[4];
+    bool skip_render;
+
+    // Deferred rendering: writes are logged during the frame and replayed
+    // on the shadow PPU, which renders the whole frame in one batch.
+    PPURenderMode render_mode;
+    PPU *shadow;
+    PPUWrite *log;
+    size_t log_len;
+    size_t log_cap;
+    size_t log_frame_end;
+    bool frame_pending;
+
+    // Threaded rendering: the shadow PPU is owned by the worker thread,
+    // which renders into its back buffer from the command queue.
+    pthread_t worker;
+    SPSCQueue *queue;
+    uint64_t syncs_sent;
+    _Atomic uint64_t syncs_done;
+};
+
+// Emulated state, what a snapshot holds. The frames, the change tracking
+// and the caches of the renderer are left out.
+typedef struct {
+    uint8_t vram[0x2000];
+    uint8_t oam[0xA0];
+    LCDCRegister LCDC;
+    StatRegister STAT;
+    uint8_t SCY;
+    uint8_t SCX;
+    uint8_t LY;
+    uint8_t LYC;
+    uint8_t DMA;
+    uint8_t BGP;
+    uint8_t OBP0;
+    uint8_t OBP1;
+    uint8_t WY;
+    uint8_t WX;
+    bool vblank_interrupt;
+    bool stat_interrupt;
+    int line_ticks;
+    uint64_t cycles;
+} PPUSnapshot;
+
+static void ppu_start_worker(PPU *ppu);
+
+static void ppu_stop_worker(PPU *ppu);
+
+static void ppu_worker_sync(PPU *ppu);
+
+static void ppu_worker_write(PPU *ppu, uint16_t addr, uint8_t data);
+
+static void ppu_clear_frames(PPU *ppu);
+
+static const PPUColor ppu_default_palette[4] = {
+    {255, 255, 255, 255},
+    {192, 192, 192, 255},
+    {96, 96, 96, 255},
+    {0, 0, 0, 255},
 };
 
 PPU *
 ppu_new(void)
 {
     PPU *ppu = xalloc(sizeof(PPU));
+    ppu_set_palette(ppu, ppu_default_palette);
+    ppu_set_framebuffers(ppu, PPU_FORMAT_INDEX8, NULL, NULL);
     ppu_reset(ppu);
     return ppu;
 }
@@ -90,15 +246,21 @@ ppu_new(void)
 void
 ppu_free(PPU **ppu)
 {
+    if (*ppu != NULL) {
+        ppu_stop_worker(*ppu);
+        ppu_free(&(*ppu)->shadow);
+        xfree((*ppu)->log);
+    }
+
     xfree(*ppu);
 }
 
 void
 ppu_reset(PPU *ppu)
 {
-    memset(ppu->frame, 0x00, sizeof(ppu->frame));
     memset(ppu->vram, 0x00, sizeof(ppu->vram));
     memset(ppu->oam, 0x00, sizeof(ppu->oam));
+    memset(&ppu->dirty, 0xFF, sizeof(ppu->dirty));
 
     ppu->LCDC.raw = 0x91;
     ppu->STAT.raw = 0;
@@ -109,6 +271,141 @@ ppu_reset(PPU *ppu)
     ppu->DMA = 0;
     ppu->WX = 0;
     ppu->WY = 0;
+
+    memset(ppu->tile_rows, 0, sizeof(ppu->tile_rows));
+
+    // With a shadow PPU the buffers belong to it, see below.
+    if (ppu->shadow == NULL) {
+        ppu_clear_frames(ppu);
+        ppu->back_changed = true;
+    }
+
+    if (ppu->shadow != NULL) {
+        ppu_worker_sync(ppu);
+        ppu_reset(ppu->shadow);
+    }
+
+    ppu->log_len = 0;
+    ppu->log_frame_end = 0;
+    ppu->frame_pending = false;
+}
+
+void
+ppu_set_render_mode(PPU *ppu, PPURenderMode mode)
+{
+    ppu_stop_worker(ppu);
+    ppu_free(&ppu->shadow);
+    ppu->log_len = 0;
+    ppu->log_frame_end = 0;
+    ppu->frame_pending = false;
+
+    if (mode != PPU_RENDER_INLINE) {
+        // The shadow starts as an exact copy of the current state.
+        PPU *shadow = xalloc(sizeof(PPU));
+        *shadow = *ppu;
+        if (ppu->buffers[0] == ppu->frame_buffers[0]) {
+            shadow->buffers[0] = shadow->frame_buffers[0];
+            shadow->buffers[1] = shadow->frame_buffers[1];
+        }
+        shadow->render_mode = PPU_RENDER_INLINE;
+        shadow->shadow = NULL;
+        shadow->log = NULL;
+        shadow->log_cap = 0;
+        shadow->queue = NULL;
+        ppu->shadow = shadow;
+    }
+
+    ppu->render_mode = mode;
+
+    if (mode == PPU_RENDER_THREADED) {
+        ppu_start_worker(ppu);
+    }
+}
+
+size_t
+ppu_frame_pitch(PPUPixelFormat format)
+{
+    switch (format) {
+    case PPU_FORMAT_INDEX8:
+    case PPU_FORMAT_GRAY8:
+        return 160;
+    case PPU_FORMAT_PACKED2:
+        return 160 / 4;
+    case PPU_FORMAT_RGB565:
+        return 160 * sizeof(uint16_t);
+    case PPU_FORMAT_RGBA8888:
+        return 160 * sizeof(uint32_t);
+    default:
+        PANIC("invalid pixel format %d", format);
+    }
+}
+
+// Precomputes the output value of each shade for the current format.
+static void
+ppu_update_lut(PPU *ppu)
+{
+    for (int i = 0; i < 4; i++) {
+        PPUColor c = ppu->palette[i];
+
+        switch (ppu->format) {
+        case PPU_FORMAT_GRAY8: // BT.601 luma
+            ppu->lut[i] = (uint32_t) (77*c.r + 150*c.g + 29*c.b) >> 8;
+            break;
+        case PPU_FORMAT_RGB565:
+            ppu->lut[i] = (uint32_t) ((c.r >> 3) << 11 | (c.g >> 2) << 5 | (c.b >> 3));
+            break;
+        case PPU_FORMAT_RGBA8888:
+            memcpy(&ppu->lut[i], &c, sizeof(uint32_t));
+            break;
+        default:
+            ppu->lut[i] = (uint32_t) i;
+            break;
+        }
+    }
+
+    // Same shades, different pixels.
+    ppu->back_changed = true;
+}
+
+void
+ppu_set_framebuffers(PPU *ppu, PPUPixelFormat format, void *front, void *back)
+{
+    if ((front == NULL) != (back == NULL)) {
+        PANIC("either both or none of the framebuffers must be given");
+    }
+
+    if (front == NULL && format != PPU_FORMAT_INDEX8) {
+        PANIC("pixel format %d requires framebuffers", format);
+    }
+
+    ppu->format = format;
+    ppu->buffers[ppu->back ^ 1] = front != NULL ? front : ppu->frame_buffers[ppu->back ^ 1];
+    ppu->buffers[ppu->back] = back != NULL ? back : ppu->frame_buffers[ppu->back];
+    ppu_update_lut(ppu);
+
+    if (ppu->shadow == NULL) {
+        ppu_clear_frames(ppu);
+        return;
+    }
+
+    ppu_worker_sync(ppu);
+    ppu_set_framebuffers(ppu->shadow, format, front, back);
+}
+
+void
+ppu_set_palette(PPU *ppu, const PPUColor palette[4])
+{
+    if (memcmp(ppu->palette, palette, sizeof(ppu->palette)) == 0) {
+        return;
+    }
+
+    memcpy(ppu->palette, palette, sizeof(ppu->palette));
+    ppu_update_lut(ppu);
+
+    if (ppu->shadow != NULL) {
+        ppu_worker_sync(ppu);
+        ppu_set_palette(ppu->shadow, palette);
+    }
 }
 
 uint8_t
@@ -160,14 +457,93 @@ ppu_read_vram(PPU *ppu, uint16_t addr)
     return ppu->vram[vram_addr];
 }
 
+static inline void
+ppu_invalidate_tile_rows(PPU *ppu, uint16_t addr)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(ppu->tile_rows); i++) {
+        TileRowCache *row = &ppu->tile_rows[i];
+        uint16_t row_addr = row->tile_map + row->tile_y*32;
+
+        if (addr >= row_addr && addr < row_addr+32) {
+            row->valid = false;
+        }
+    }
+}
+
+static inline bool
+ppu_render_visible(uint16_t addr)
+{
+    switch (addr) {
+    case 0x8000 ... 0x9FFF: // VRAM
+    case 0xFE00 ... 0xFE9F: // OAM
+    case 0xFF40: // LCDC
+    case 0xFF42 ... 0xFF43: // SCY, SCX
+    case 0xFF47 ... 0xFF4B: // BGP, OBP0, OBP1, WY, WX
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void
+ppu_log_write(PPU *ppu, uint16_t addr, uint8_t data)
+{
+    if (ppu->log_len == ppu->log_cap) {
+        size_t new_cap = ppu->log_cap ? ppu->log_cap*2 : 1024;
+        ppu->log = xrealloc(ppu->log, ppu->log_cap*sizeof(PPUWrite), new_cap*sizeof(PPUWrite));
+        ppu->log_cap = new_cap;
+    }
+
+    ppu->log[ppu->log_len++] = (PPUWrite) {
+        .addr = addr,
+        .data = data,
+        .ly = ppu->LY,
+        .dot = (uint16_t) ppu->line_ticks,
+    };
+}
+
+static inline void
+ppu_mark_dirty(uint64_t *bitmap, int index)
+{
+    bitmap[index / 64] |= 1ULL << (index % 64);
+}
+
 void
 ppu_write(PPU *ppu, uint16_t addr, uint8_t data)
 {
+    switch (ppu->render_mode) {
+    case PPU_RENDER_DEFERRED:
+        if (ppu_render_visible(addr)) {
+            ppu_log_write(ppu, addr, data);
+        }
+        break;
+    case PPU_RENDER_THREADED:
+        if (addr <= 0x9FFF || (addr >= 0xFE00 && addr <= 0xFE9F)) {
+            ppu_worker_write(ppu, addr, data);
+        }
+        break;
+    default:
+        break;
+    }
+
     switch (addr) {
-    case 0x8000 ... 0x9FFF: // VRAM
+    case 0x8000 ... 0x97FF: // VRAM (tile data)
+        if (ppu->vram[addr - 0x8000] != data) {
+            ppu_mark_dirty(ppu->dirty.tiles, (addr - 0x8000) / 16);
+        }
+        ppu->vram[addr - 0x8000] = data;
+        break;
+    case 0x9800 ... 0x9FFF: // VRAM (tile maps)
+        if (ppu->vram[addr - 0x8000] != data) {
+            ppu_mark_dirty(ppu->dirty.map_cells, addr - 0x9800);
+        }
         ppu->vram[addr - 0x8000] = data;
+        ppu_invalidate_tile_rows(ppu, addr);
         break;
     case 0xFE00 ... 0xFE9F: // OAM
+        if (ppu->oam[addr - 0xFE00] != data) {
+            ppu_mark_dirty(&ppu->dirty.sprites, (addr - 0xFE00) / 4);
+        }
         ppu->oam[addr - 0xFE00] = data;
         break;
     case 0xFF40: // LCDC
@@ -208,12 +584,6 @@ ppu_write(PPU *ppu, uint16_t addr, uint8_t data)
     }
 }
 
-void
-ppu_clear_frame(PPU *ppu, uint8_t color)
-{
-    memset(ppu->frame, color, sizeof(ppu->frame));
-}
-
 static inline uint16_t
 ppu_tile_addr(PPU *ppu, uint8_t tile_id)
 {
@@ -241,81 +611,42 @@ ppu_get_color_id(uint8_t d0, uint8_t d1, uint8_t x)
     return color_id;
 }
 
-static void
-ppu_fetch_tile_line(PPU *ppu, uint16_t tile_map, int tile_y, int tile_x, int pixel_y, uint8_t pixels[8])
+// Returns the resolved tile addresses of a tilemap row, either from the
+// layer's cache or by reading the 32 tile IDs from VRAM.
+static inline const uint16_t *
+ppu_fetch_tile_row(PPU *ppu, int layer, uint16_t tile_map, int tile_y)
 {
-    uint16_t tile_map_addr = tile_map + tile_y*32 + tile_x;
-    uint8_t tile_id = ppu_read_vram(ppu, tile_map_addr);
-    uint16_t tile_addr = ppu_tile_addr(ppu, tile_id);
-
-    uint8_t d0 = ppu_read_vram(ppu, tile_addr + pixel_y*2 + 0);
-    uint8_t d1 = ppu_read_vram(ppu, tile_addr + pixel_y*2 + 1);
+    TileRowCache *row = &ppu->tile_rows[layer];
 
-    for (int x = 0; x < 8; x++) {
-        pixels[7-x] = ppu_get_color_id(d0, d1, x);
+    if (row->valid && row->tile_map == tile_map && row->tile_y == tile_y &&
+        row->tiledata == ppu->LCDC.bg_tiledata) {
+        ppu->stats.tile_row_hits++;
+        return row->tile_addr;
     }
-}
 
-static inline void
-ppu_render_background(PPU *ppu)
-{
-    uint16_t tile_map = ppu->LCDC.bg_tilemap ? 0x9C00 : 0x9800;
-    uint8_t screen_y = ppu->LY;
-
-    int tile_y = ((ppu->LY + ppu->SCY) / 8) % 32;
-    int pixel_y = (ppu->LY + ppu->SCY) % 8;
-
-    uint8_t tile_line[8] = {0};
-    int last_tile_x = -1;
-
-    for (int screen_x = 0; screen_x < 160; screen_x++) {
-        int tile_x = ((ppu->SCX + screen_x) / 8) % 32;
-        int pixel_x = (ppu->SCX + screen_x) % 8;
+    ppu->stats.tile_row_misses++;
 
-        if (tile_x != last_tile_x) {
-            ppu_fetch_tile_line(ppu, tile_map, tile_y, tile_x, pixel_y, tile_line);
-            last_tile_x = tile_x;
-        }
+    for (int tile_x = 0; tile_x < 32; tile_x++) {
+        uint8_t tile_id = ppu_read_vram(ppu, tile_map + tile_y*32 + tile_x);
+        row->tile_addr[tile_x] = ppu_tile_addr(ppu, tile_id);
+    }
 
-        uint8_t color_id = tile_line[pixel_x];
-        uint8_t color = (ppu->BGP >> (color_id * 2)) & 0x3;
+    row->valid = true;
+    row->tile_map = tile_map;
+    row->tile_y = tile_y;
+    row->tiledata = ppu->LCDC.bg_tiledata;
 
-        ppu->frame[screen_y][screen_x] = color;
-    }
+    return row->tile_addr;
 }
 
 static inline void
-ppu_render_window(PPU *ppu)
+ppu_fetch_tile_line(PPU *ppu, uint16_t tile_addr, int pixel_y, uint8_t pixels[8])
 {
-    if (ppu->LY < ppu->WY) {
-        return;
-    }
-
-    uint16_t tile_map = ppu->LCDC.win_tilemap ? 0x9C00 : 0x9800;
-    int tile_y = ((ppu->LY - ppu->WY) / 8) % 32;
-    int pixel_y = (ppu->LY - ppu->WY) % 8;
-    uint8_t screen_y = ppu->LY;
-
-    uint8_t tile_line[8] = {0};
-    int last_tile_x = -1;
-
-    for (int screen_x = 0; screen_x < 160; screen_x++) {
-        if (screen_x+7 < ppu->WX) {
-            continue;
-        }
-
-        int tile_x = ((screen_x+7 - ppu->WX) / 8) % 32;
-        int pixel_x = (screen_x+7 - ppu->WX) % 8;
-
-        if (tile_x != last_tile_x) {
-            ppu_fetch_tile_line(ppu, tile_map, tile_y, tile_x, pixel_y, tile_line);
-            last_tile_x = tile_x;
-        }
-
-        uint8_t color_id = tile_line[pixel_x];
-        uint8_t color = (ppu->BGP >> (color_id * 2)) & 0x3;
+    uint8_t d0 = ppu_read_vram(ppu, tile_addr + pixel_y*2 + 0);
+    uint8_t d1 = ppu_read_vram(ppu, tile_addr + pixel_y*2 + 1);
 
-        ppu->frame[screen_y][screen_x] = color;
+    for (int x = 0; x < 8; x++) {
+        pixels[7-x] = ppu_get_color_id(d0, d1, x);
     }
 }
 
@@ -330,17 +661,21 @@ ppu_get_sprite(PPU *ppu, int sprite_id)
     return sprite;
 }
 
-static inline void
-ppu_render_sprites(PPU *ppu)
+// Resolves the sprite layer of the current scanline into obj_line, one byte
+// per pixel: the color ID in bits 0-1 (0 is transparent) plus the palette and
+// priority bits taken as is from the sprite flags. Returns false if there is
+// no sprite on the line.
+static bool
+ppu_fetch_obj_line(PPU *ppu, uint8_t obj_line[160])
 {
     uint8_t screen_y = ppu->LY;
-    if (screen_y >= 144) {
-        return;
-    }
-
     uint8_t height = ppu->LCDC.obj_size ? 16 : 8;
 
-    for (int i = 0; i < 40; i++) {
+    Sprite sprites[PPU_SPRITES_PER_LINE];
+    int count = 0;
+
+    // OAM scan: the first 10 sprites (in OAM order) overlapping the line.
+    for (int i = 0; i < 40 && count < PPU_SPRITES_PER_LINE; i++) {
         Sprite sprite = ppu_get_sprite(ppu, i);
         int real_sprite_y = sprite.y - 16;
 
@@ -349,10 +684,30 @@ ppu_render_sprites(PPU *ppu)
             continue;
         }
 
-        uint8_t y = screen_y - real_sprite_y;
+        // Sort by X, keeping the OAM order for equal X. The sprite
+        // with the lowest X wins when sprites overlap.
+        int pos = count++;
+        while (pos > 0 && sprites[pos-1].x > sprite.x) {
+            sprites[pos] = sprites[pos-1];
+            pos--;
+        }
+
+        sprites[pos] = sprite;
+    }
+
+    if (count == 0) {
+        return false;
+    }
+
+    memset(obj_line, 0, 160);
+
+    for (int i = 0; i < count; i++) {
+        Sprite sprite = sprites[i];
+
+        uint8_t y = screen_y - (sprite.y - 16);
         uint8_t yflip = sprite.yflip ? height-1-y : y;
-        uint16_t tile_addr = 0x8000 + sprite.tile_id * 16;
-        uint8_t palette = sprite.palette ? ppu->OBP1 : ppu->OBP0;
+        uint8_t tile_id = height == 16 ? sprite.tile_id & 0xFE : sprite.tile_id;
+        uint16_t tile_addr = 0x8000 + tile_id * 16;
 
         uint8_t d0 = ppu_read_vram(ppu, tile_addr + yflip*2 + 0);
         uint8_t d1 = ppu_read_vram(ppu, tile_addr + yflip*2 + 1);
@@ -362,34 +717,404 @@ ppu_render_sprites(PPU *ppu)
             uint8_t screen_x = sprite.x-8 + xflip;
 
             if (screen_x >= 160) {
-                break;
+                continue;
             }
 
             uint8_t color_id = ppu_get_color_id(d0, d1, x);
-            if (color_id == 0) {
+            if (color_id == 0 || (obj_line[screen_x] & OBJ_PIXEL_COLOR) != 0) {
                 continue;
             }
 
-            uint8_t color = (palette >> (color_id * 2)) & 0x3;
-            ppu->frame[screen_y][screen_x] = color;
+            obj_line[screen_x] = color_id | (sprite.flags & (OBJ_PIXEL_PALETTE1 | OBJ_PIXEL_BEHIND_BG));
+        }
+    }
+
+    return true;
+}
+
+// Picks the layer that wins the pixel and returns its shade. BG color 0
+// is always behind sprites, colors 1-3 only cover sprites with priority set.
+static inline uint8_t
+ppu_mix_pixel(PPU *ppu, uint8_t bg_color_id, uint8_t obj)
+{
+    uint8_t obj_color_id = obj & OBJ_PIXEL_COLOR;
+
+    if (obj_color_id != 0 && (bg_color_id == 0 || !(obj & OBJ_PIXEL_BEHIND_BG))) {
+        uint8_t palette = (obj & OBJ_PIXEL_PALETTE1) ? ppu->OBP1 : ppu->OBP0;
+        return (palette >> (obj_color_id * 2)) & 0x3;
+    }
+
+    return (ppu->BGP >> (bg_color_id * 2)) & 0x3;
+}
+
+// Renders screen pixels [x0, x1) of a tile layer (background or window),
+// starting at (src_x, src_y) in the 256x256 layer space.
+static inline void
+ppu_render_span(PPU *ppu, uint8_t *row, const uint8_t *obj_line, int x0, int x1,
+                int layer, uint16_t tile_map, int src_x, int src_y)
+{
+    int tile_y = (src_y / 8) % 32;
+    int pixel_y = src_y % 8;
+
+    const uint16_t *tile_row = ppu_fetch_tile_row(ppu, layer, tile_map, tile_y);
+
+    uint8_t tile_line[8];
+    int screen_x = x0;
+
+    while (screen_x < x1) {
+        int tile_x = (src_x / 8) % 32;
+        int pixel_x = src_x % 8;
+
+        ppu_fetch_tile_line(ppu, tile_row[tile_x], pixel_y, tile_line);
+
+        for (; pixel_x < 8 && screen_x < x1; pixel_x++, screen_x++, src_x++) {
+            row[screen_x] = ppu_mix_pixel(ppu, tile_line[pixel_x], obj_line[screen_x]);
+        }
+    }
+}
+
+// With BG and window disabled the line is blank (shade 0), only sprites are visible.
+static inline void
+ppu_render_blank(PPU *ppu, uint8_t *row, const uint8_t *obj_line)
+{
+    for (int screen_x = 0; screen_x < 160; screen_x++) {
+        uint8_t obj = obj_line[screen_x];
+        row[screen_x] = (obj & OBJ_PIXEL_COLOR) ? ppu_mix_pixel(ppu, 0, obj) : 0;
+    }
+}
+
+// Composes the background, window and sprite layers of the current line in
+// a single pass, so that every pixel of the row is written exactly once.
+static void
+ppu_compose_line(PPU *ppu, uint8_t *row)
+{
+    static const uint8_t no_objects[160] = {0};
+
+    uint8_t obj_line[160];
+    const uint8_t *obj = no_objects;
+
+    if (ppu->LCDC.obj_enable && ppu_fetch_obj_line(ppu, obj_line)) {
+        obj = obj_line;
+    }
+
+    if (!ppu->LCDC.bg_enable) {
+        ppu_render_blank(ppu, row, obj);
+        return;
+    }
+
+    // The window covers the line from WX-7 to the right edge.
+    int win_x = 160;
+    if (ppu->LCDC.win_enable && ppu->LY >= ppu->WY && ppu->WX < 167) {
+        win_x = ppu->WX < 7 ? 0 : ppu->WX - 7;
+    }
+
+    if (win_x > 0) {
+        uint16_t tile_map = ppu->LCDC.bg_tilemap ? 0x9C00 : 0x9800;
+        ppu_render_span(ppu, row, obj, 0, win_x, PPU_LAYER_BG, tile_map, ppu->SCX, ppu->LY + ppu->SCY);
+    }
+
+    if (win_x < 160) {
+        uint16_t tile_map = ppu->LCDC.win_tilemap ? 0x9C00 : 0x9800;
+        ppu_render_span(ppu, row, obj, win_x, 160, PPU_LAYER_WIN, tile_map, win_x + 7 - ppu->WX, ppu->LY - ppu->WY);
+    }
+}
+
+// Converts a line of shades into the output format, the line is still
+// in L1 so this is much cheaper than a separate pass over the frame.
+static void
+ppu_output_line(PPU *ppu, uint8_t *out, const uint8_t *shades)
+{
+    const uint32_t *lut = ppu->lut;
+
+    switch (ppu->format) {
+    case PPU_FORMAT_PACKED2:
+        for (int x = 0; x < 160; x += 4) {
+            out[x/4] = (uint8_t) (shades[x] << 6 | shades[x+1] << 4 | shades[x+2] << 2 | shades[x+3]);
+        }
+        break;
+    case PPU_FORMAT_GRAY8:
+        for (int x = 0; x < 160; x++) {
+            out[x] = (uint8_t) lut[shades[x]];
+        }
+        break;
+    case PPU_FORMAT_RGB565:
+        for (int x = 0; x < 160; x++) {
+            ((uint16_t *) out)[x] = (uint16_t) lut[shades[x]];
+        }
+        break;
+    case PPU_FORMAT_RGBA8888:
+        for (int x = 0; x < 160; x++) {
+            ((uint32_t *) out)[x] = lut[shades[x]];
         }
+        break;
+    default:
+        memcpy(out, shades, 160);
+        break;
     }
 }
 
+// Hashes a line of shades, eight pixels at a time.
+static inline uint64_t
+ppu_hash_line(const uint8_t *shades)
+{
+    uint64_t h = 0x9E3779B97F4A7C15;
+
+    for (int x = 0; x < 160; x += 8) {
+        uint64_t w;
+        memcpy(&w, shades + x, sizeof(w));
+        h = (h ^ w) * 0xFF51AFD7ED558CCD;
+        h ^= h >> 32;
+    }
+
+    return h;
+}
+
+// Compares the line with the same line of the previous frame.
+static inline void
+ppu_track_line(PPU *ppu, const uint8_t *shades)
+{
+    uint64_t hash = ppu_hash_line(shades);
+
+    if (ppu->line_hashes[ppu->LY] != hash) {
+        ppu->line_hashes[ppu->LY] = hash;
+        ppu->back_changed = true;
+    }
+}
+
+static inline uint8_t *
+ppu_frame_row(PPU *ppu, int buffer, int line)
+{
+    return (uint8_t *) ppu->buffers[buffer] + (size_t) line * ppu_frame_pitch(ppu->format);
+}
+
 static void
 ppu_render_scanline(PPU *ppu)
 {
-    if (ppu->LCDC.bg_enable) {
-        ppu_render_background(ppu);
+    uint8_t *row = ppu_frame_row(ppu, ppu->back, ppu->LY);
+
+    // Shade indices need no conversion, compose in place.
+    if (ppu->format == PPU_FORMAT_INDEX8) {
+        ppu_compose_line(ppu, row);
+        ppu_track_line(ppu, row);
+        return;
+    }
+
+    uint8_t line[160];
+    ppu_compose_line(ppu, line);
+    ppu_track_line(ppu, line);
+    ppu_output_line(ppu, row, line);
+}
+
+// Fills both buffers with shade 0.
+static void
+ppu_clear_frames(PPU *ppu)
+{
+    static const uint8_t blank[160] = {0};
+
+    for (int buffer = 0; buffer < 2; buffer++) {
+        for (int line = 0; line < 144; line++) {
+            ppu_output_line(ppu, ppu_frame_row(ppu, buffer, line), blank);
+        }
+    }
+}
+
+// Presents the finished back buffer. Every line is redrawn each frame,
+// so the new back buffer does not need clearing.
+static inline void
+ppu_swap_frames(PPU *ppu)
+{
+    ppu->back ^= 1;
+    ppu->frame_seq++;
 
-        if (ppu->LCDC.win_enable) {
-            ppu_render_window(ppu);
+    ppu->front_changed = ppu->back_changed;
+    ppu->back_changed = false;
+
+    if (ppu->front_changed) {
+        uint64_t hash = 0;
+        for (int line = 0; line < 144; line++) {
+            hash = (hash ^ ppu->line_hashes[line]) * 0x100000001B3;
+        }
+        ppu->front_hash = hash;
+    }
+}
+
+// Whether a logged write happened before the inline renderer would have
+// drawn the given line. Writes made during VBLANK precede the next frame.
+static inline bool
+ppu_write_before_line(const PPUWrite *w, int line)
+{
+    if (w->ly >= 144) {
+        return true;
+    }
+
+    return w->ly < line || (w->ly == line && w->dot < PPU_RENDER_DOT);
+}
+
+// Replays the writes logged during the last frame on the shadow PPU. When
+// rendering, each line is drawn at exactly the point of the log where the
+// inline renderer would have drawn it, so mid-frame raster effects match.
+static void
+ppu_replay_frame(PPU *ppu, bool render)
+{
+    PPU *shadow = ppu->shadow;
+    size_t end = ppu->log_frame_end;
+    size_t i = 0;
+
+    for (int line = 0; line < 144 && render; line++) {
+        for (; i < end && ppu_write_before_line(&ppu->log[i], line); i++) {
+            ppu_write(shadow, ppu->log[i].addr, ppu->log[i].data);
         }
+
+        shadow->LY = (uint8_t) line;
+        ppu_render_scanline(shadow);
+    }
+
+    if (render) {
+        ppu_swap_frames(shadow);
     }
 
-    if (ppu->LCDC.obj_enable) {
-        ppu_render_sprites(ppu);
+    for (; i < end; i++) {
+        ppu_write(shadow, ppu->log[i].addr, ppu->log[i].data);
     }
+
+    // Keep the writes made since the frame ended for the next one.
+    memmove(ppu->log, ppu->log + end, (ppu->log_len - end) * sizeof(PPUWrite));
+    ppu->log_len -= end;
+    ppu->log_frame_end = 0;
+    ppu->frame_pending = false;
+}
+
+static void *
+ppu_worker_main(void *arg)
+{
+    PPU *ppu = arg;
+    PPU *shadow = ppu->shadow;
+    PPUCommand cmds[64];
+    unsigned spins = 0;
+
+    while (true) {
+        size_t count = spsc_pop_many(ppu->queue, cmds, ARRAY_SIZE(cmds));
+        if (count == 0) {
+            spsc_relax(&spins);
+            continue;
+        }
+
+        spins = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            const PPUCommand *cmd = &cmds[i];
+
+            switch (cmd->type) {
+            case PPU_CMD_WRITE:
+                ppu_write(shadow, cmd->write.addr, cmd->write.data);
+                break;
+            case PPU_CMD_LINE:
+                shadow->LCDC.raw = cmd->regs.LCDC;
+                shadow->SCY = cmd->regs.SCY;
+                shadow->SCX = cmd->regs.SCX;
+                shadow->BGP = cmd->regs.BGP;
+                shadow->OBP0 = cmd->regs.OBP0;
+                shadow->OBP1 = cmd->regs.OBP1;
+                shadow->WY = cmd->regs.WY;
+                shadow->WX = cmd->regs.WX;
+                shadow->LY = cmd->ly;
+                ppu_render_scanline(shadow);
+                break;
+            case PPU_CMD_SYNC:
+                atomic_fetch_add_explicit(&ppu->syncs_done, 1, memory_order_release);
+                break;
+            case PPU_CMD_QUIT:
+                return NULL;
+            default:
+                PANIC("invalid PPU command %d", cmd->type);
+            }
+        }
+    }
+}
+
+static void
+ppu_worker_push(PPU *ppu, const PPUCommand *cmd)
+{
+    unsigned spins = 0;
+
+    while (!spsc_push(ppu->queue, cmd)) {
+        spsc_relax(&spins);
+    }
+}
+
+static void
+ppu_worker_write(PPU *ppu, uint16_t addr, uint8_t data)
+{
+    PPUCommand cmd = {
+        .type = PPU_CMD_WRITE,
+        .write = {.addr = addr, .data = data},
+    };
+
+    ppu_worker_push(ppu, &cmd);
+}
+
+static inline void
+ppu_worker_line(PPU *ppu)
+{
+    PPUCommand cmd = {
+        .type = PPU_CMD_LINE,
+        .ly = ppu->LY,
+        .regs = {
+            .LCDC = ppu->LCDC.raw,
+            .SCY = ppu->SCY,
+            .SCX = ppu->SCX,
+            .BGP = ppu->BGP,
+            .OBP0 = ppu->OBP0,
+            .OBP1 = ppu->OBP1,
+            .WY = ppu->WY,
+            .WX = ppu->WX,
+        },
+    };
+
+    ppu_worker_push(ppu, &cmd);
+}
+
+// Waits until the worker has processed every command sent so far.
+static void
+ppu_worker_sync(PPU *ppu)
+{
+    if (ppu->queue == NULL) {
+        return;
+    }
+
+    PPUCommand cmd = {.type = PPU_CMD_SYNC};
+    ppu_worker_push(ppu, &cmd);
+    ppu->syncs_sent++;
+
+    unsigned spins = 0;
+    while (atomic_load_explicit(&ppu->syncs_done, memory_order_acquire) != ppu->syncs_sent) {
+        spsc_relax(&spins);
+    }
+}
+
+static void
+ppu_start_worker(PPU *ppu)
+{
+    ppu->queue = spsc_new(sizeof(PPUCommand), PPU_QUEUE_SIZE);
+    ppu->syncs_sent = 0;
+    atomic_store(&ppu->syncs_done, 0);
+
+    if (pthread_create(&ppu->worker, NULL, ppu_worker_main, ppu) != 0) {
+        PANIC("failed to start PPU worker thread");
+    }
+}
+
+static void
+ppu_stop_worker(PPU *ppu)
+{
+    if (ppu->queue == NULL) {
+        return;
+    }
+
+    PPUCommand cmd = {.type = PPU_CMD_QUIT};
+    ppu_worker_push(ppu, &cmd);
+    pthread_join(ppu->worker, NULL);
+    spsc_free(&ppu->queue);
 }
 
 static inline void
@@ -444,9 +1169,16 @@ ppu_step_oam_scan(PPU *ppu)
 static inline void
 ppu_step_pixel_draw(PPU *ppu)
 {
-    if (ppu->line_ticks == 252) {
+    if (ppu->line_ticks == PPU_RENDER_DOT) {
         ppu_set_mode(ppu, PPU_MODE_HBLANK);
-        ppu_render_scanline(ppu);
+
+        if (ppu->render_mode == PPU_RENDER_INLINE) {
+            if (!ppu->skip_render) {
+                ppu_render_scanline(ppu);
+            }
+        } else if (ppu->render_mode == PPU_RENDER_THREADED) {
+            ppu_worker_line(ppu);
+        }
     }
 }
 
@@ -460,6 +1192,22 @@ ppu_step_hblank(PPU *ppu)
         if (ppu->LY == 144) {
             ppu->vblank_interrupt = true;
             ppu_set_mode(ppu, PPU_MODE_VBLANK);
+
+            if (ppu->render_mode == PPU_RENDER_INLINE && !ppu->skip_render) {
+                ppu_swap_frames(ppu);
+            }
+
+            if (ppu->render_mode == PPU_RENDER_DEFERRED) {
+                ppu->log_frame_end = ppu->log_len;
+                ppu->frame_pending = true;
+            }
+
+            // Join the worker at the frame boundary, the finished
+            // frame becomes the front buffer.
+            if (ppu->render_mode == PPU_RENDER_THREADED) {
+                ppu_worker_sync(ppu);
+                ppu_swap_frames(ppu->shadow);
+            }
         } else {
             ppu_set_mode(ppu, PPU_MODE_OAM_SCAN);
         }
@@ -475,15 +1223,20 @@ ppu_step_vblank(PPU *ppu)
 
         if (ppu->LY == 153) {
             ppu_set_mode(ppu, PPU_MODE_OAM_SCAN);
-            ppu_clear_frame(ppu, 0);
             ppu->LY = 0;
+
+            // Nobody asked for the last frame, skip rendering it.
+            if (ppu->frame_pending) {
+                ppu_replay_frame(ppu, false);
+            }
         }
     }
 }
 
-void
+static void
 ppu_step(PPU *ppu)
 {
+    ppu->cycles++;
     ppu->line_ticks++;
 
     switch (ppu->STAT.mode) {
@@ -504,10 +1257,176 @@ ppu_step(PPU *ppu)
     }
 }
 
-inline const uint8_t *
+// Returns the PPU holding the last finished frame in its front buffer.
+static PPU *
+ppu_presenter(PPU *ppu)
+{
+    if (ppu->render_mode == PPU_RENDER_DEFERRED && ppu->frame_pending) {
+        ppu_replay_frame(ppu, true);
+    }
+
+    return ppu->shadow != NULL ? ppu->shadow : ppu;
+}
+
+const void *
 ppu_get_frame(PPU *ppu)
 {
-    return (uint8_t *) ppu->frame;
+    PPU *presenter = ppu_presenter(ppu);
+    return presenter->buffers[presenter->back ^ 1];
+}
+
+uint64_t
+ppu_get_frame_seq(PPU *ppu)
+{
+    return ppu_presenter(ppu)->frame_seq;
+}
+
+uint64_t
+ppu_get_frame_hash(PPU *ppu)
+{
+    return ppu_presenter(ppu)->front_hash;
+}
+
+bool
+ppu_frame_changed(PPU *ppu)
+{
+    return ppu_presenter(ppu)->front_changed;
+}
+
+// Line dot at which the current mode ends.
+static inline int
+ppu_mode_end(PPU *ppu)
+{
+    switch (ppu->STAT.mode) {
+    case PPU_MODE_OAM_SCAN:
+        return 80;
+    case PPU_MODE_PIXEL_DRAW:
+        return PPU_RENDER_DOT;
+    default:
+        return 456;
+    }
+}
+
+uint64_t
+ppu_next_event(PPU *ppu)
+{
+    int dot = ppu_mode_end(ppu);
+
+    if (ppu->line_ticks >= dot) {
+        return UINT64_MAX;
+    }
+
+    return ppu->cycles + (uint64_t) (dot - ppu->line_ticks - 1);
+}
+
+void
+ppu_sync(PPU *ppu, uint64_t now)
+{
+    if (ppu->cycles >= now) {
+        return;
+    }
+
+    PERF_PUSH(PERF_PPU);
+
+    while (ppu->cycles < now) {
+        // Nothing happens until the next event, skip right to it.
+        uint64_t event = ppu_next_event(ppu);
+        uint64_t idle = (event < now ? event : now - 1) - ppu->cycles;
+
+        ppu->cycles += idle;
+        ppu->line_ticks += (int) idle;
+        ppu_step(ppu);
+    }
+
+    PERF_POP();
+}
+
+void
+ppu_set_skip_render(PPU *ppu, bool skip)
+{
+    ppu->skip_render = skip;
+}
+
+size_t
+ppu_snapshot_size(void)
+{
+    return sizeof(PPUSnapshot);
+}
+
+void
+ppu_snapshot(PPU *ppu, void *buf)
+{
+    if (ppu->render_mode != PPU_RENDER_INLINE) {
+        PANIC("snapshots require the inline renderer");
+    }
+
+    PPUSnapshot *snap = buf;
+    memcpy(snap->vram, ppu->vram, sizeof(snap->vram));
+    memcpy(snap->oam, ppu->oam, sizeof(snap->oam));
+    snap->LCDC = ppu->LCDC;
+    snap->STAT = ppu->STAT;
+    snap->SCY = ppu->SCY;
+    snap->SCX = ppu->SCX;
+    snap->LY = ppu->LY;
+    snap->LYC = ppu->LYC;
+    snap->DMA = ppu->DMA;
+    snap->BGP = ppu->BGP;
+    snap->OBP0 = ppu->OBP0;
+    snap->OBP1 = ppu->OBP1;
+    snap->WY = ppu->WY;
+    snap->WX = ppu->WX;
+    snap->vblank_interrupt = ppu->vblank_interrupt;
+    snap->stat_interrupt = ppu->stat_interrupt;
+    snap->line_ticks = ppu->line_ticks;
+    snap->cycles = ppu->cycles;
+}
+
+// Restores the emulated state. Memory that changes is marked dirty, as a
+// write would mark it.
+void
+ppu_restore(PPU *ppu, const void *buf)
+{
+    const PPUSnapshot *snap = buf;
+
+    for (int tile = 0; tile < 384; tile++) {
+        if (memcmp(&ppu->vram[tile * 16], &snap->vram[tile * 16], 16) != 0) {
+            ppu_mark_dirty(ppu->dirty.tiles, tile);
+        }
+    }
+
+    for (int cell = 0; cell < 2048; cell++) {
+        if (ppu->vram[0x1800 + cell] != snap->vram[0x1800 + cell]) {
+            ppu_mark_dirty(ppu->dirty.map_cells, cell);
+        }
+    }
+
+    for (int sprite = 0; sprite < 40; sprite++) {
+        if (memcmp(&ppu->oam[sprite * 4], &snap->oam[sprite * 4], 4) != 0) {
+            ppu_mark_dirty(&ppu->dirty.sprites, sprite);
+        }
+    }
+
+    memcpy(ppu->vram, snap->vram, sizeof(ppu->vram));
+    memcpy(ppu->oam, snap->oam, sizeof(ppu->oam));
+    ppu->LCDC = snap->LCDC;
+    ppu->STAT = snap->STAT;
+    ppu->SCY = snap->SCY;
+    ppu->SCX = snap->SCX;
+    ppu->LY = snap->LY;
+    ppu->LYC = snap->LYC;
+    ppu->DMA = snap->DMA;
+    ppu->BGP = snap->BGP;
+    ppu->OBP0 = snap->OBP0;
+    ppu->OBP1 = snap->OBP1;
+    ppu->WY = snap->WY;
+    ppu->WX = snap->WX;
+    ppu->vblank_interrupt = snap->vblank_interrupt;
+    ppu->stat_interrupt = snap->stat_interrupt;
+    ppu->line_ticks = snap->line_ticks;
+    ppu->cycles = snap->cycles;
+
+    // The tile rows were resolved for the memory of the frames run since.
+    memset(ppu->tile_rows, 0, sizeof(ppu->tile_rows));
 }
 
 inline const uint8_t *
@@ -516,6 +1435,29 @@ ppu_get_vram(PPU *ppu)
     return ppu->vram;
 }
 
+const uint8_t *
+ppu_get_oam(PPU *ppu)
+{
+    return ppu->oam;
+}
+
+void
+ppu_take_dirty(PPU *ppu, PPUDirty *dirty)
+{
+    *dirty = ppu->dirty;
+    memset(&ppu->dirty, 0, sizeof(ppu->dirty));
+}
+
+inline const PPUStats *
+ppu_get_stats(PPU *ppu)
+{
+    if (ppu->shadow != NULL) {
+        return &ppu->shadow->stats;
+    }
+
+    return &ppu->stats;
+}
+
 inline bool
 ppu_stat_interrupt(PPU *ppu)
 {
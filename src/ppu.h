@@ -1,28 +1,116 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "common.h"
 
 typedef struct PPU PPU;
 
+typedef enum {
+    PPU_RENDER_INLINE = 0,   // Render each line as the beam reaches it
+    PPU_RENDER_DEFERRED = 1, // Log writes and render the frame when requested
+    PPU_RENDER_THREADED = 2, // Render lines on a worker thread
+} PPURenderMode;
+
+typedef enum {
+    PPU_FORMAT_INDEX8 = 0,   // Shade index (0-3), one byte per pixel
+    PPU_FORMAT_PACKED2 = 1,  // Shade index, four pixels per byte, leftmost in the high bits
+    PPU_FORMAT_GRAY8 = 2,    // Luminance of the palette color
+    PPU_FORMAT_RGB565 = 3,   // Palette color, one native-endian uint16_t per pixel
+    PPU_FORMAT_RGBA8888 = 4, // Palette color, bytes in R, G, B, A order
+} PPUPixelFormat;
+
+typedef struct PPUColor {
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    uint8_t a;
+} PPUColor;
+
+typedef struct PPUStats {
+    uint64_t tile_row_hits;
+    uint64_t tile_row_misses;
+} PPUStats;
+
+// VRAM and OAM entries changed since the last ppu_take_dirty call, one
+// bit per entry. Lets viewers redraw only what has changed.
+typedef struct PPUDirty {
+    uint64_t tiles[384 / 64];      // 16-byte tiles at 0x8000-0x97FF
+    uint64_t map_cells[2048 / 64]; // tilemap entries at 0x9800-0x9FFF
+    uint64_t sprites;              // 40 OAM entries
+} PPUDirty;
+
 PPU *ppu_new(void);
 
 void ppu_free(PPU **ppu);
 
 void ppu_reset(PPU *ppu);
 
+void ppu_set_render_mode(PPU *ppu, PPURenderMode mode);
+
+// Returns the size of one line of the frame in the given format, the
+// whole frame is 144 lines.
+size_t ppu_frame_pitch(PPUPixelFormat format);
+
+// Makes the PPU render straight into the caller's buffers in the given
+// format. The back buffer is drawn while the front one holds the last
+// finished frame, they are swapped at VBLANK. With NULL buffers the
+// frames are kept internally as shade indices.
+void ppu_set_framebuffers(PPU *ppu, PPUPixelFormat format, void *front, void *back);
+
+// Sets the colors of the four shades used by the GRAY8, RGB565 and RGBA8888
+// formats. Takes effect from the next rendered line.
+void ppu_set_palette(PPU *ppu, const PPUColor palette[4]);
+
 void ppu_write(PPU *ppu, uint16_t addr, uint8_t data);
 
 uint8_t ppu_read(PPU *ppu, uint16_t addr);
 
-void ppu_step(PPU *ppu);
+// Runs the PPU for the master cycles before the given one. Between events
+// (mode changes and line ends) the PPU is not stepped, it is only caught
+// up when accessed and when ppu_next_event is due.
+void ppu_sync(PPU *ppu, uint64_t now);
+
+// Returns the master cycle at which the next event happens, this is where
+// the PPU may render a line or request an interrupt.
+uint64_t ppu_next_event(PPU *ppu);
 
-const uint8_t *ppu_get_frame(PPU *ppu);
+// Returns the front buffer, it stays intact until the next VBLANK.
+const void *ppu_get_frame(PPU *ppu);
+
+// Returns the sequence number of the frame in the front buffer.
+uint64_t ppu_get_frame_seq(PPU *ppu);
+
+// Returns a hash of the shades of the frame in the front buffer.
+uint64_t ppu_get_frame_hash(PPU *ppu);
+
+// Returns whether the frame in the front buffer differs from the previous
+// one, either in shades or because the palette or format has changed.
+bool ppu_frame_changed(PPU *ppu);
 
 const uint8_t *ppu_get_vram(PPU *ppu);
 
+const uint8_t *ppu_get_oam(PPU *ppu);
+
+// Returns the changes since the last call and starts tracking anew.
+void ppu_take_dirty(PPU *ppu, PPUDirty *dirty);
+
+const PPUStats *ppu_get_stats(PPU *ppu);
+
+// Frames are still run but not drawn, and the front buffer is kept.
+// Used for the frames of run-ahead that are never shown.
+void ppu_set_skip_render(PPU *ppu, bool skip);
+
+// Snapshots of the emulated state, without the frames, for run-ahead.
+// Only the inline renderer supports them.
+size_t ppu_snapshot_size(void);
+
+void ppu_snapshot(PPU *ppu, void *buf);
+
+void ppu_restore(PPU *ppu, const void *buf);
+
 bool ppu_stat_interrupt(PPU *ppu);
 
 bool ppu_vblank_interrupt(PPU *ppu);
@@ -0,0 +1,454 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "mapper.h"
+#include "mmu.h"
+#include "prof.h"
+#include "str.h"
+
+#define PROF_NONE UINT32_MAX
+
+// Deeper calls are not tracked, they are charged to the deepest routine.
+#define PROF_MAX_DEPTH 1024
+
+#define PROF_NAME_SIZE 64
+
+// Banks of the code that does not run from the cartridge ROM, above any
+// ROM bank number.
+#define PROF_BOOT_BANK 0xFFFF  // Boot ROM, while it is mapped over the cartridge
+#define PROF_WRAM_BANK 0xFFFE  // 0xC000 - 0xFDFF
+#define PROF_HRAM_BANK 0xFFFD  // 0xFF80 - 0xFFFE
+#define PROF_SRAM_BANK 0xFFFC  // Cartridge RAM, 0xA000 - 0xBFFF
+#define PROF_OTHER_BANK 0xFFFB // VRAM, OAM and I/O registers
+
+// Bank of a location outside of the cartridge ROM.
+static uint32_t
+prof_ram_bank(uint16_t addr)
+{
+    if (addr >= 0xA000 && addr < 0xC000) {
+        return PROF_SRAM_BANK;
+    }
+
+    if (addr >= 0xC000 && addr < 0xFE00) {
+        return PROF_WRAM_BANK;
+    }
+
+    if (addr >= 0xFF80 && addr < 0xFFFF) {
+        return PROF_HRAM_BANK;
+    }
+
+    return PROF_OTHER_BANK;
+}
+
+// Locations are keyed by bank and address: bank << 16 | addr. ROM
+// locations use the ROM bank, the others a bank of their memory region.
+static inline uint32_t
+prof_key(MMU *mmu, uint16_t addr)
+{
+    uint32_t bank = 0;
+    if (addr >= 0x8000) {
+        bank = prof_ram_bank(addr);
+    } else if (addr >= 0x4000) {
+        bank = mapper_rom_bank(mmu->mapper, addr);
+    } else if (addr < 0x0100 && mmu->bootrom_mapped) {
+        bank = PROF_BOOT_BANK;
+    }
+
+    return bank << 16 | addr;
+}
+
+// Labels only name locations of their own region. Bank 0 is two regions:
+// the fixed ROM bank and, on mappers that allow it, the switchable one.
+static inline bool
+prof_same_region(uint32_t a, uint32_t b)
+{
+    return (a >> 16) == (b >> 16) && ((a & 0xFFFF) >= 0x4000) == ((b & 0xFFFF) >= 0x4000);
+}
+
+static const char *
+prof_location(uint32_t key, char *buf)
+{
+    static const char *regions[] = {
+        [PROF_BOOT_BANK - PROF_OTHER_BANK] = "BOOT",
+        [PROF_WRAM_BANK - PROF_OTHER_BANK] = "WRAM",
+        [PROF_HRAM_BANK - PROF_OTHER_BANK] = "HRAM",
+        [PROF_SRAM_BANK - PROF_OTHER_BANK] = "SRAM",
+        [PROF_OTHER_BANK - PROF_OTHER_BANK] = "MEM",
+    };
+
+    uint32_t bank = key >> 16;
+    if (bank >= PROF_OTHER_BANK) {
+        snprintf(buf, PROF_NAME_SIZE, "%s:%04X", regions[bank - PROF_OTHER_BANK], key & 0xFFFF);
+    } else {
+        snprintf(buf, PROF_NAME_SIZE, "%02X:%04X", bank, key & 0xFFFF);
+    }
+
+    return buf;
+}
+
+// Node of the call tree, the root is the code that runs outside of any call.
+typedef struct {
+    uint32_t key;
+    uint32_t parent;
+    uint32_t child;   // First callee
+    uint32_t sibling; // Next callee of the parent
+    uint64_t cycles;  // Spent in the routine itself
+} ProfNode;
+
+typedef struct {
+    uint32_t node;
+    uint16_t sp;
+} ProfFrame;
+
+typedef struct {
+    uint32_t key;
+    uint64_t cycles;
+} ProfHit;
+
+typedef struct {
+    uint32_t key;
+    char *name;
+} ProfSymbol;
+
+struct Profiler {
+    ProfNode *nodes;
+    size_t nodes_len;
+    size_t nodes_cap;
+
+    ProfFrame stack[PROF_MAX_DEPTH];
+    size_t depth;     // Frames on the stack
+    uint32_t current; // Node of the running routine
+
+    // Open addressing table of cycles per location
+    ProfHit *hits;
+    size_t hits_len;
+    size_t hits_cap;
+
+    ProfSymbol *symbols; // Sorted by key
+    size_t symbols_len;
+};
+
+static uint32_t
+prof_add_node(Profiler *p, uint32_t key, uint32_t parent)
+{
+    if (p->nodes_len == p->nodes_cap) {
+        size_t cap = p->nodes_cap * 2;
+        p->nodes = xrealloc(p->nodes, p->nodes_cap * sizeof(ProfNode), cap * sizeof(ProfNode));
+        p->nodes_cap = cap;
+    }
+
+    uint32_t index = (uint32_t) p->nodes_len++;
+    p->nodes[index] = (ProfNode) {
+        .key = key,
+        .parent = parent,
+        .child = PROF_NONE,
+        .sibling = PROF_NONE,
+    };
+
+    if (parent != PROF_NONE) {
+        p->nodes[index].sibling = p->nodes[parent].child;
+        p->nodes[parent].child = index;
+    }
+
+    return index;
+}
+
+Profiler *
+prof_new(void)
+{
+    Profiler *p = xalloc(sizeof(Profiler));
+
+    p->nodes_cap = 1024;
+    p->nodes = xalloc(p->nodes_cap * sizeof(ProfNode));
+    p->current = prof_add_node(p, PROF_NONE, PROF_NONE);
+
+    p->hits_cap = 4096;
+    p->hits = xalloc(p->hits_cap * sizeof(ProfHit));
+    memset(p->hits, 0xFF, p->hits_cap * sizeof(ProfHit));
+
+    return p;
+}
+
+void
+prof_free(Profiler **p)
+{
+    if (*p != NULL) {
+        for (size_t i = 0; i < (*p)->symbols_len; i++) {
+            xfree((*p)->symbols[i].name);
+        }
+
+        xfree((*p)->symbols);
+        xfree((*p)->nodes);
+        xfree((*p)->hits);
+    }
+
+    xfree(*p);
+}
+
+static inline size_t
+prof_hash(uint32_t key, size_t cap)
+{
+    return (size_t) ((key * 0x9E3779B1u) >> 8) & (cap - 1);
+}
+
+static ProfHit *
+prof_hit(Profiler *p, uint32_t key)
+{
+    size_t i = prof_hash(key, p->hits_cap);
+    while (p->hits[i].key != key && p->hits[i].key != PROF_NONE) {
+        i = (i + 1) & (p->hits_cap - 1);
+    }
+
+    return &p->hits[i];
+}
+
+static void
+prof_grow_hits(Profiler *p)
+{
+    ProfHit *old = p->hits;
+    size_t old_cap = p->hits_cap;
+
+    p->hits_cap *= 2;
+    p->hits = xalloc(p->hits_cap * sizeof(ProfHit));
+    memset(p->hits, 0xFF, p->hits_cap * sizeof(ProfHit));
+
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key != PROF_NONE) {
+            *prof_hit(p, old[i].key) = old[i];
+        }
+    }
+
+    xfree(old);
+}
+
+void
+prof_step(Profiler *p, MMU *mmu, uint16_t pc, uint8_t cycles)
+{
+    p->nodes[p->current].cycles += cycles;
+
+    uint32_t key = prof_key(mmu, pc);
+    ProfHit *hit = prof_hit(p, key);
+
+    if (hit->key == PROF_NONE) {
+        // Keep the table at most half full.
+        if ((p->hits_len + 1) * 2 > p->hits_cap) {
+            prof_grow_hits(p);
+            hit = prof_hit(p, key);
+        }
+
+        hit->key = key;
+        hit->cycles = 0;
+        p->hits_len++;
+    }
+
+    hit->cycles += cycles;
+}
+
+void
+prof_call(Profiler *p, MMU *mmu, uint16_t addr, uint16_t sp)
+{
+    if (p->depth == PROF_MAX_DEPTH) {
+        return;
+    }
+
+    uint32_t key = prof_key(mmu, addr);
+    uint32_t node = p->nodes[p->current].child;
+
+    while (node != PROF_NONE && p->nodes[node].key != key) {
+        node = p->nodes[node].sibling;
+    }
+
+    if (node == PROF_NONE) {
+        node = prof_add_node(p, key, p->current);
+    }
+
+    p->stack[p->depth++] = (ProfFrame) {.node = p->current, .sp = sp};
+    p->current = node;
+}
+
+void
+prof_ret(Profiler *p, uint16_t sp)
+{
+    // The stack grows down: frames entered at or below sp are left.
+    while (p->depth > 0 && p->stack[p->depth - 1].sp <= sp) {
+        p->current = p->stack[--p->depth].node;
+    }
+}
+
+static int
+prof_symbol_compare(const void *a, const void *b)
+{
+    const ProfSymbol *x = a;
+    const ProfSymbol *y = b;
+
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+
+    return 0;
+}
+
+int
+prof_load_symbols(Profiler *p, const char *filename)
+{
+    _autoclose_ FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        TRACE("failed to open file: %s", filename);
+        return RET_ERR;
+    }
+
+    size_t cap = p->symbols_len;
+    char line[512];
+
+    // Lines look like "01:4000 Label", comments start with a semicolon.
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned bank;
+        unsigned addr;
+        char name[256];
+
+        if (sscanf(line, " %x:%x %255s", &bank, &addr, name) != 3 || bank > 0xFFFF || addr > 0xFFFF) {
+            continue;
+        }
+
+        if (p->symbols_len == cap) {
+            size_t new_cap = cap > 0 ? cap * 2 : 256;
+            p->symbols = xrealloc(p->symbols, cap * sizeof(ProfSymbol), new_cap * sizeof(ProfSymbol));
+            cap = new_cap;
+        }
+
+        size_t len = strlen(name);
+        char *copy = xalloc(len + 1);
+        memcpy(copy, name, len);
+
+        // The fixed ROM bank is keyed by address only, RAM by its region.
+        if (addr < 0x4000) {
+            bank = 0;
+        } else if (addr >= 0x8000) {
+            bank = prof_ram_bank((uint16_t) addr);
+        }
+
+        p->symbols[p->symbols_len++] = (ProfSymbol) {.key = bank << 16 | addr, .name = copy};
+    }
+
+    if (ferror(f)) {
+        TRACE("failed to read file: %s", filename);
+        return RET_ERR;
+    }
+
+    qsort(p->symbols, p->symbols_len, sizeof(ProfSymbol), prof_symbol_compare);
+
+    return RET_OK;
+}
+
+// Names a location after the closest label at or before it in the same
+// memory region, or as bank:addr when there is none.
+static const char *
+prof_name(Profiler *p, uint32_t key, char *buf)
+{
+    size_t lo = 0;
+    size_t hi = p->symbols_len;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (p->symbols[mid].key <= key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo > 0 && prof_same_region(p->symbols[lo - 1].key, key)) {
+        const ProfSymbol *sym = &p->symbols[lo - 1];
+        if (sym->key == key) {
+            return sym->name;
+        }
+
+        snprintf(buf, PROF_NAME_SIZE, "%.40s+0x%X", sym->name, key - sym->key);
+        return buf;
+    }
+
+    return prof_location(key, buf);
+}
+
+static String
+prof_write_node(Profiler *p, uint32_t index, String path, FILE *out)
+{
+    const ProfNode *node = &p->nodes[index];
+    size_t len = path.len;
+    char buf[PROF_NAME_SIZE];
+
+    if (node->key == PROF_NONE) {
+        path = str_add(path, "(top)");
+    } else {
+        path = str_addc(path, ';');
+        path = str_add(path, prof_name(p, node->key, buf));
+    }
+
+    if (node->cycles > 0) {
+        fprintf(out, "%s %llu\n", path.ptr, (unsigned long long) node->cycles);
+    }
+
+    for (uint32_t child = node->child; child != PROF_NONE; child = p->nodes[child].sibling) {
+        path = prof_write_node(p, child, path, out);
+    }
+
+    return str_trunc(path, len);
+}
+
+void
+prof_write_folded(Profiler *p, FILE *out)
+{
+    str_auto path = str_new_size(256);
+    path = prof_write_node(p, 0, path, out);
+}
+
+static int
+prof_hit_compare(const void *a, const void *b)
+{
+    const ProfHit *x = a;
+    const ProfHit *y = b;
+
+    if (x->cycles != y->cycles) {
+        return x->cycles < y->cycles ? 1 : -1;
+    }
+
+    return x->key < y->key ? -1 : 1;
+}
+
+void
+prof_write_hotspots(Profiler *p, FILE *out, size_t limit)
+{
+    _autofree_ ProfHit *hits = xalloc((p->hits_len + 1) * sizeof(ProfHit));
+    size_t count = 0;
+    uint64_t total = 0;
+
+    for (size_t i = 0; i < p->hits_cap; i++) {
+        if (p->hits[i].key != PROF_NONE) {
+            hits[count++] = p->hits[i];
+            total += p->hits[i].cycles;
+        }
+    }
+
+    qsort(hits, count, sizeof(ProfHit), prof_hit_compare);
+
+    fprintf(out, "Hotspots (M-cycles):\n");
+    for (size_t i = 0; i < count && i < limit; i++) {
+        char location[PROF_NAME_SIZE];
+        char name[PROF_NAME_SIZE];
+
+        fprintf(out, "  %-9s %14llu %6.2f%%", prof_location(hits[i].key, location),
+                (unsigned long long) hits[i].cycles,
+                100.0 * (double) hits[i].cycles / (double) total);
+
+        if (p->symbols_len > 0) {
+            fprintf(out, "  %s", prof_name(p, hits[i].key, name));
+        }
+
+        fputc('\n', out);
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mmu.h"
+
+// Exact CPU profiler: charges the cycles of every instruction to its
+// (ROM bank, PC) and to the routine on top of a shadow call stack, which
+// CALL, RST and interrupt entry push and RET/RETI pop.
+typedef struct Profiler Profiler;
+
+Profiler *prof_new(void);
+
+void prof_free(Profiler **p);
+
+// Loads the labels of an RGBDS .sym file to name routines and hotspots.
+int prof_load_symbols(Profiler *p, const char *filename);
+
+// Charges an instruction at pc, called before it runs.
+void prof_step(Profiler *p, MMU *mmu, uint16_t pc, uint8_t cycles);
+
+// Enters the routine at addr, sp is the stack pointer after the return
+// address was pushed.
+void prof_call(Profiler *p, MMU *mmu, uint16_t addr, uint16_t sp);
+
+// Returns with the return address at sp. Routines that left the stack
+// without returning (by popping their return address and jumping) are
+// unwound as well.
+void prof_ret(Profiler *p, uint16_t sp);
+
+// Writes one line per call stack with the cycles spent in it, in the
+// folded format of flamegraph.pl and speedscope.
+void prof_write_folded(Profiler *p, FILE *out);
+
+// Writes the hottest (ROM bank, PC) locations.
+void prof_write_hotspots(Profiler *p, FILE *out, size_t limit);
@@ -1,20 +1,27 @@
-#include <ctype.h>
 #include <stdint.h>
-#include <stdio.h>
 
 #include "common.h"
 #include "serial.h"
+#include "str.h"
+
+// Games that talk to a link partner would otherwise grow the capture forever.
+#define SERIAL_OUTPUT_MAX (64 * 1024)
 
 Serial *
 serial_new(void)
 {
     Serial *s = xalloc(sizeof(Serial));
+    s->output = str_new_size(256);
     serial_reset(s);
     return s;
 }
 
 void serial_free(Serial **s)
 {
+    if (*s != NULL) {
+        str_free(&(*s)->output);
+    }
+
     xfree(*s);
 }
 
@@ -23,6 +30,7 @@ serial_reset(Serial *s)
 {
     s->byte = 0;
     s->ctrl = 0;
+    s->output = str_trunc(s->output, 0);
 }
 
 uint8_t
@@ -47,19 +55,19 @@ serial_write(Serial *s, uint16_t addr, uint8_t val)
         break;
     case 0xFF02:
         s->ctrl = val;
+
+        // A transfer on the internal clock shifts out the data byte.
+        if (s->transfer && s->master && s->output.len < SERIAL_OUTPUT_MAX) {
+            s->output = str_addc(s->output, (char) s->byte);
+        }
         break;
     default:
         PANIC("unhandled serial write at 0x%04X", addr);
     }
 }
 
-void
-serial_print(Serial *s) {
-    if (s->transfer) {
-        if (isprint(s->byte) || s->byte == '\n' || s->byte == '\r' || s->byte == '\t') {
-            putchar(s->byte);
-        }
-
-        s->transfer = 0;
-    }
+const char *
+serial_output(Serial *s)
+{
+    return s->output.ptr;
 }
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include "common.h"
+#include "str.h"
 
 typedef struct Serial {
     uint8_t byte;
@@ -15,6 +16,8 @@ typedef struct Serial {
             uint8_t transfer: 1;
         } _packed_;
     };
+
+    String output; // Bytes sent so far, there is no link partner to receive them
 } Serial;
 
 Serial *serial_new(void);
@@ -27,4 +30,5 @@ uint8_t serial_read(Serial *s, uint16_t addr);
 
 void serial_write(Serial *s, uint16_t addr, uint8_t val);
 
-void serial_print(Serial *s);
+// Returns everything the game has sent over the link cable since reset.
+const char *serial_output(Serial *s);
@@ -0,0 +1,107 @@
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "spsc.h"
+
+struct SPSCQueue {
+    // Producer and consumer indices live on separate cache lines.
+    _Atomic size_t head _aligned_(64); // next item to pop
+    _Atomic size_t tail _aligned_(64); // next slot to push
+
+    size_t item_size _aligned_(64);
+    size_t mask;
+    unsigned char *items;
+};
+
+SPSCQueue *
+spsc_new(size_t item_size, size_t capacity)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        PANIC("queue capacity must be a power of two: %zu", capacity);
+    }
+
+    // calloc only aligns to 16 bytes, the cache line members need 64.
+    SPSCQueue *q = aligned_alloc(_Alignof(SPSCQueue), sizeof(SPSCQueue));
+    if (q == NULL) {
+        PANIC("failed to allocate %zu bytes", sizeof(SPSCQueue));
+    }
+
+    memset(q, 0, sizeof(SPSCQueue));
+    q->items = xalloc(item_size * capacity);
+    q->item_size = item_size;
+    q->mask = capacity - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return q;
+}
+
+void
+spsc_free(SPSCQueue **q)
+{
+    if (*q != NULL) {
+        xfree((*q)->items);
+    }
+
+    xfree(*q);
+}
+
+bool
+spsc_push(SPSCQueue *q, const void *item)
+{
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    if (tail - head > q->mask) {
+        return false;
+    }
+
+    memcpy(q->items + (tail & q->mask) * q->item_size, item, q->item_size);
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool
+spsc_pop(SPSCQueue *q, void *item)
+{
+    return spsc_pop_many(q, item, 1) == 1;
+}
+
+size_t
+spsc_pop_many(SPSCQueue *q, void *items, size_t max)
+{
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t count = tail - head;
+
+    if (count > max) {
+        count = max;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const void *src = q->items + ((head + i) & q->mask) * q->item_size;
+        memcpy((unsigned char *) items + i * q->item_size, src, q->item_size);
+    }
+
+    atomic_store_explicit(&q->head, head + count, memory_order_release);
+    return count;
+}
+
+void
+spsc_relax(unsigned *spins)
+{
+    if (++(*spins) < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ volatile("yield");
+#endif
+        return;
+    }
+
+    sched_yield();
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lock-free single-producer single-consumer queue of fixed-size items.
+typedef struct SPSCQueue SPSCQueue;
+
+// Creates a queue for items of item_size bytes, capacity must be a power of two.
+SPSCQueue *spsc_new(size_t item_size, size_t capacity);
+
+void spsc_free(SPSCQueue **q);
+
+// Copies the item into the queue, returns false if the queue is full (producer only).
+bool spsc_push(SPSCQueue *q, const void *item);
+
+// Copies the oldest item out of the queue, returns false if the queue is empty (consumer only).
+bool spsc_pop(SPSCQueue *q, void *item);
+
+// Pops up to max items into a contiguous array, returns the number of items (consumer only).
+size_t spsc_pop_many(SPSCQueue *q, void *items, size_t max);
+
+// Yields the CPU while busy-waiting on the queue.
+void spsc_relax(unsigned *spins);
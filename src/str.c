@@ -62,6 +62,7 @@ str_clone(String str)
 {
     String newbuf = str_new_size(str.len);
     memcpy(newbuf.ptr, str.ptr, str.len+1);
+    newbuf.len = str.len;
     return newbuf;
 }
 
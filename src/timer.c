@@ -1,27 +1,36 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "common.h"
+#include "perf.h"
 #include "timer.h"
 
+// TIMA increments on the falling edge of bit 9, 3, 5 or 7 of the internal
+// divider, i.e. once every 1024, 16, 64 or 256 master cycles.
 static const int timer_freqs[] = {1024, 16, 64, 256};
 
+// Nothing is stepped per cycle. The 16-bit internal divider is the number
+// of master cycles since div_base, and TIMA is brought up to date with the
+// number of edges since it was last updated whenever it is accessed or the
+// overflow deadline passes.
 struct Timer {
-    uint8_t divider; // DIV ($FF04)
-    uint8_t counter; // TIMA ($FF05)
+    uint8_t counter; // TIMA ($FF05), as of the updated cycle
     uint8_t reload;  // TMA ($FF06)
     uint8_t ctrl;    // TAC ($FF07)
 
     bool interrupt;
-    int internal_divider;
-    int internal_counter;
+    uint64_t div_base; // cycle the internal divider was last reset at
+    uint64_t updated;  // cycle TIMA is up to date with
+    uint64_t overflow; // cycle of the next TIMA overflow
 };
 
 Timer *
 timer_new(void)
 {
     Timer *t = xalloc(sizeof(Timer));
-    timer_reset(t);
+    timer_reset(t, 0);
     return t;
 }
 
@@ -31,25 +40,114 @@ timer_free(Timer **t)
     xfree(*t);
 }
 
+static inline bool
+timer_enabled(Timer *t)
+{
+    return (t->ctrl & (1 << 2)) != 0;
+}
+
+static inline uint64_t
+timer_period(Timer *t)
+{
+    return (uint64_t) timer_freqs[t->ctrl & 0x03];
+}
+
+static inline uint16_t
+timer_divider(Timer *t, uint64_t now)
+{
+    return (uint16_t) (now - t->div_base);
+}
+
+// Level of the divider bit that clocks TIMA, gated by the enable bit.
+static inline bool
+timer_signal(Timer *t, uint64_t now)
+{
+    return timer_enabled(t) && (timer_divider(t, now) & (timer_period(t) / 2)) != 0;
+}
+
+// Computes the cycle of the next TIMA overflow in closed form.
+static void
+timer_schedule(Timer *t)
+{
+    if (!timer_enabled(t)) {
+        t->overflow = UINT64_MAX;
+        return;
+    }
+
+    uint64_t period = timer_period(t);
+    uint64_t next_edge = t->div_base + ((t->updated - t->div_base) / period + 1) * period;
+    t->overflow = next_edge + (0xFF - t->counter) * period;
+}
+
+// Adds a number of TIMA increments, reloading from TMA on overflow.
+static void
+timer_count(Timer *t, uint64_t edges)
+{
+    uint64_t to_overflow = 0x100 - t->counter;
+
+    if (edges < to_overflow) {
+        t->counter = (uint8_t) (t->counter + edges);
+        return;
+    }
+
+    edges -= to_overflow;
+    t->counter = (uint8_t) (t->reload + edges % (0x100 - t->reload));
+    t->interrupt = true;
+}
+
+// Brings TIMA up to date with the given cycle.
+static void
+timer_update(Timer *t, uint64_t now)
+{
+    if (timer_enabled(t)) {
+        uint64_t period = timer_period(t);
+        uint64_t edges = (now - t->div_base) / period - (t->updated - t->div_base) / period;
+        timer_count(t, edges);
+    }
+
+    t->updated = now;
+}
+
 void
-timer_reset(Timer *t)
+timer_reset(Timer *t, uint64_t now)
 {
-    t->divider = 0;
     t->counter = 0;
     t->reload = 0;
     t->ctrl = 0;
     t->interrupt = false;
-    t->internal_counter = 0;
-    t->internal_divider = 0;
+    t->div_base = now;
+    t->updated = now;
+    timer_schedule(t);
+}
+
+// The state has no pointers, a snapshot is a copy of it.
+size_t
+timer_snapshot_size(void)
+{
+    return sizeof(Timer);
+}
+
+void
+timer_snapshot(Timer *t, void *buf)
+{
+    memcpy(buf, t, sizeof(Timer));
+}
+
+void
+timer_restore(Timer *t, const void *buf)
+{
+    memcpy(t, buf, sizeof(Timer));
 }
 
 uint8_t
-timer_read(Timer *t, uint16_t addr)
+timer_read(Timer *t, uint16_t addr, uint64_t now)
 {
     switch (addr) {
     case 0xFF04:
-        return t->divider;
+        return (uint8_t) (timer_divider(t, now) >> 8);
     case 0xFF05:
+        timer_update(t, now);
+        timer_schedule(t);
         return t->counter;
     case 0xFF06:
         return t->reload;
@@ -61,11 +159,17 @@ timer_read(Timer *t, uint16_t addr)
 }
 
 void
-timer_write(Timer *t, uint16_t addr, uint8_t val)
+timer_write(Timer *t, uint16_t addr, uint8_t val, uint64_t now)
 {
+    timer_update(t, now);
+
     switch (addr) {
     case 0xFF04:
-        t->divider = 0;
+        // Resetting the divider is a falling edge if the selected bit was set.
+        if (timer_signal(t, now)) {
+            timer_count(t, 1);
+        }
+        t->div_base = now;
         break;
     case 0xFF05:
         t->counter = val;
@@ -73,45 +177,39 @@ timer_write(Timer *t, uint16_t addr, uint8_t val)
     case 0xFF06:
         t->reload = val;
         break;
-    case 0xFF07:
+    case 0xFF07: {
+        // So is disabling the timer or selecting a bit that is clear.
+        bool signal = timer_signal(t, now);
         t->ctrl = val;
+        if (signal && !timer_signal(t, now)) {
+            timer_count(t, 1);
+        }
         break;
+    }
     default:
         PANIC("unhandled timer write at 0x%04X", addr);
     }
+
+    timer_schedule(t);
 }
 
-void
-timer_step(Timer *t)
+uint64_t
+timer_next_overflow(Timer *t)
 {
-    bool enabled = (t->ctrl & (1 << 2)) != 0;
-
-    t->internal_divider++;
-    if (t->internal_divider == 256) {
-        t->internal_divider = 0;
-        t->divider++;
-    }
-
-    if (enabled) {
-        int freq = timer_freqs[t->ctrl & 0x03];
-        t->internal_counter++;
-
-        if (t->internal_counter == freq) {
-            t->internal_counter = 0;
-            t->counter++;
-
-            if (t->counter == 0xFF) {
-                t->interrupt = true;
-            } else if (t->counter == 0x00) {
-                t->counter = t->reload;
-            }
-        }
-    }
+    // A register write can also overflow TIMA, its interrupt is due now.
+    return t->interrupt ? 0 : t->overflow;
 }
 
-inline bool
-timer_interrupt(Timer *t)
+bool
+timer_interrupt(Timer *t, uint64_t now)
 {
+    if (now >= t->overflow) {
+        PERF_PUSH(PERF_TIMER);
+        timer_update(t, now);
+        timer_schedule(t);
+        PERF_POP();
+    }
+
     if (t->interrupt) {
         t->interrupt = false;
         return true;
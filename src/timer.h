@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct Timer Timer;
@@ -9,12 +10,25 @@ Timer *timer_new(void);
 
 void timer_free(Timer **t);
 
-void timer_reset(Timer *t);
+// The timer has no step function, all calls take the current master
+// cycle instead and the state is derived from it.
+void timer_reset(Timer *t, uint64_t now);
 
-uint8_t timer_read(Timer *t, uint16_t addr);
+uint8_t timer_read(Timer *t, uint16_t addr, uint64_t now);
 
-void timer_write(Timer *t, uint16_t addr, uint8_t val);
+void timer_write(Timer *t, uint16_t addr, uint8_t val, uint64_t now);
 
-void timer_step(Timer *t);
+// Snapshots of the timer state, for run-ahead.
+size_t timer_snapshot_size(void);
 
-bool timer_interrupt(Timer *t);
+void timer_snapshot(Timer *t, void *buf);
+
+void timer_restore(Timer *t, const void *buf);
+
+// Returns the cycle at which timer_interrupt has work to do next,
+// UINT64_MAX if the timer is stopped.
+uint64_t timer_next_overflow(Timer *t);
+
+// Returns whether TIMA has overflowed by the given cycle. Until the next
+// overflow is due this is a single comparison.
+bool timer_interrupt(Timer *t, uint64_t now);
@@ -0,0 +1,169 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "cpu.h"
+#include "mmu.h"
+#include "spsc.h"
+#include "trace.h"
+
+#define TRACE_QUEUE_SIZE (1 << 16)
+#define TRACE_BATCH 1024
+
+static_assert(sizeof(TraceRecord) == 24, "trace records must not have padding");
+
+struct Tracer {
+    FILE *out;
+    SPSCQueue *queue;
+    pthread_t writer;
+    atomic_bool closing;
+};
+
+static void
+trace_write(Tracer *t, const TraceRecord *recs, size_t count)
+{
+    if (fwrite(recs, sizeof(TraceRecord), count, t->out) != count) {
+        PANIC("failed to write trace");
+    }
+}
+
+static void *
+trace_writer_main(void *arg)
+{
+    Tracer *t = arg;
+    TraceRecord batch[TRACE_BATCH];
+    unsigned spins = 0;
+
+    while (true) {
+        size_t count = spsc_pop_many(t->queue, batch, TRACE_BATCH);
+        if (count > 0) {
+            trace_write(t, batch, count);
+            spins = 0;
+            continue;
+        }
+
+        // The producer stops pushing before it sets the flag, so the
+        // queue only needs draining once more.
+        if (atomic_load_explicit(&t->closing, memory_order_acquire)) {
+            while ((count = spsc_pop_many(t->queue, batch, TRACE_BATCH)) > 0) {
+                trace_write(t, batch, count);
+            }
+            break;
+        }
+
+        spsc_relax(&spins);
+    }
+
+    return NULL;
+}
+
+Tracer *
+trace_new(FILE *out)
+{
+    TraceHeader header = {
+        .magic = TRACE_MAGIC,
+        .version = TRACE_VERSION,
+        .record_size = sizeof(TraceRecord),
+    };
+
+    if (fwrite(&header, sizeof(header), 1, out) != 1) {
+        PANIC("failed to write trace header");
+    }
+
+    Tracer *t = xalloc(sizeof(Tracer));
+    t->out = out;
+    t->queue = spsc_new(sizeof(TraceRecord), TRACE_QUEUE_SIZE);
+    atomic_init(&t->closing, false);
+
+    if (pthread_create(&t->writer, NULL, trace_writer_main, t) != 0) {
+        PANIC("failed to start trace writer thread");
+    }
+
+    return t;
+}
+
+void
+trace_free(Tracer **t)
+{
+    if (*t != NULL) {
+        atomic_store_explicit(&(*t)->closing, true, memory_order_release);
+        pthread_join((*t)->writer, NULL);
+        fflush((*t)->out);
+        spsc_free(&(*t)->queue);
+    }
+
+    xfree(*t);
+}
+
+void
+trace_push(Tracer *t, const TraceRecord *rec)
+{
+    unsigned spins = 0;
+
+    while (!spsc_push(t->queue, rec)) {
+        spsc_relax(&spins);
+    }
+}
+
+void
+trace_capture(TraceRecord *rec, CPU *cpu, MMU *mmu)
+{
+    rec->cycle = mmu->ticks;
+    rec->AF = cpu->AF;
+    rec->BC = cpu->BC;
+    rec->DE = cpu->DE;
+    rec->HL = cpu->HL;
+    rec->SP = cpu->SP;
+    rec->PC = cpu->PC;
+    mmu_peek_range(mmu, cpu->PC, rec->bytes, sizeof(rec->bytes));
+}
+
+static inline char *
+trace_hex(char *p, unsigned value, int digits)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (int i = digits - 1; i >= 0; i--) {
+        p[i] = hex[value & 0xF];
+        value >>= 4;
+    }
+
+    return p + digits;
+}
+
+static inline char *
+trace_str(char *p, const char *s)
+{
+    size_t len = strlen(s);
+    memcpy(p, s, len);
+    return p + len;
+}
+
+size_t
+trace_format(const TraceRecord *rec, char *buf)
+{
+    char *p = buf;
+
+    p = trace_hex(trace_str(p, "A: "), rec->AF >> 8, 2);
+    p = trace_hex(trace_str(p, " F: "), rec->AF & 0xFF, 2);
+    p = trace_hex(trace_str(p, " B: "), rec->BC >> 8, 2);
+    p = trace_hex(trace_str(p, " C: "), rec->BC & 0xFF, 2);
+    p = trace_hex(trace_str(p, " D: "), rec->DE >> 8, 2);
+    p = trace_hex(trace_str(p, " E: "), rec->DE & 0xFF, 2);
+    p = trace_hex(trace_str(p, " H: "), rec->HL >> 8, 2);
+    p = trace_hex(trace_str(p, " L: "), rec->HL & 0xFF, 2);
+    p = trace_hex(trace_str(p, " SP: "), rec->SP, 4);
+    p = trace_hex(trace_str(p, " PC: 00:"), rec->PC, 4);
+    p = trace_hex(trace_str(p, " ("), rec->bytes[0], 2);
+    p = trace_hex(trace_str(p, " "), rec->bytes[1], 2);
+    p = trace_hex(trace_str(p, " "), rec->bytes[2], 2);
+    p = trace_hex(trace_str(p, " "), rec->bytes[3], 2);
+    p = trace_str(p, ")");
+
+    return (size_t) (p - buf);
+}
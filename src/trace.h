@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cpu.h"
+#include "mmu.h"
+
+// Binary CPU trace: a TraceHeader followed by one TraceRecord per
+// instruction, in host byte order (little-endian on every supported host).
+#define TRACE_MAGIC "BBTRACE"
+#define TRACE_VERSION 1
+
+// Longest line produced by trace_format, without the newline.
+#define TRACE_LINE_SIZE 96
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} TraceHeader;
+
+// CPU state before an instruction runs.
+typedef struct {
+    uint64_t cycle; // Master clock
+    uint16_t AF;
+    uint16_t BC;
+    uint16_t DE;
+    uint16_t HL;
+    uint16_t SP;
+    uint16_t PC;
+    uint8_t bytes[4]; // Memory at PC
+} TraceRecord;
+
+typedef struct Tracer Tracer;
+
+// Starts a background thread that writes records to out.
+Tracer *trace_new(FILE *out);
+
+// Writes the remaining records and stops the thread, out stays open.
+void trace_free(Tracer **t);
+
+// Queues a record, only blocks while the writer is behind.
+void trace_push(Tracer *t, const TraceRecord *rec);
+
+void trace_capture(TraceRecord *rec, CPU *cpu, MMU *mmu);
+
+// Formats a record like the text state log, returns the length.
+size_t trace_format(const TraceRecord *rec, char *buf);
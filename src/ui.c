@@ -1,10 +1,14 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "common.h"
 #include "raylib.h"
+#include "frametime.h"
+#include "hist.h"
 #include "joypad.h"
+#include "perf.h"
 #include "ui.h"
 
 const Color ui_palettes[][4] = {
@@ -34,20 +38,59 @@ const Color ui_palettes[][4] = {
     },
 };
 
+typedef enum {
+    UI_DEBUG_TILES = 0,
+    UI_DEBUG_BG_MAP,
+    UI_DEBUG_WIN_MAP,
+    UI_DEBUG_OAM,
+    UI_DEBUG_VIEW_COUNT,
+} UIDebugView;
+
+static const struct {
+    const char *name;
+    int width;
+    int height;
+} ui_debug_views[UI_DEBUG_VIEW_COUNT] = {
+    [UI_DEBUG_TILES] = {"Tiles", 128, 192},
+    [UI_DEBUG_BG_MAP] = {"BG map", 256, 256},
+    [UI_DEBUG_WIN_MAP] = {"Window map", 256, 256},
+    [UI_DEBUG_OAM] = {"OAM", 64, 80},
+};
+
+// LCDC bits that change what the debug views show: sprite size, BG
+// tilemap, tile data area and window tilemap.
+#define UI_DEBUG_LCDC_MASK 0x5C
+
+// Past this many changed cells a single full upload is cheaper.
+#define UI_DEBUG_MAX_UPLOADS 64
+
 static struct {
-    Color frame_pixels[144*160];
+    Color frame_pixels[2][144*160]; // PPU front and back buffers
     RenderTexture2D frame_texture;
-    Color tileset_pixels[128*192];
-    RenderTexture2D tileset_texture;
+    Color tile_pixels[384][64];     // decoded tiles, shared by the debug views
+    Color debug_pixels[256*256];    // pixels of the active debug view
+    RenderTexture2D debug_textures[UI_DEBUG_VIEW_COUNT];
+    UIDebugView debug_view;
+    bool debug_stale;     // the active view needs a full redraw
+    bool debug_full;      // upload the whole view at the end of the update
+    int debug_uploads;
+    size_t debug_palette; // palette and LCDC the view is drawn with
+    uint8_t debug_lcdc;
     size_t palette;
     bool debug;
+    const FrameTimes *frame_times;
+    bool frame_stats;     // show the frame time overlay
 } ui;
 
 void
-ui_init(void)
+ui_init(bool vsync)
 {
     SetTraceLogLevel(LOG_ERROR);
-    SetTargetFPS(60);
+    SetTargetFPS(0);
+
+    if (vsync) {
+        SetConfigFlags(FLAG_VSYNC_HINT);
+    }
 
     InitWindow(UI_WINDOW_WIDTH, UI_WINDOW_HEIGHT, "BrickBoy");
 
@@ -59,38 +102,60 @@ ui_init(void)
     ui.frame_texture = LoadRenderTexture(160, 144);
     SetTextureFilter(ui.frame_texture.texture, UI_FILTER);
 
-    ui.tileset_texture = LoadRenderTexture(128, 192);
-    SetTextureFilter(ui.tileset_texture.texture, UI_FILTER);
+    for (int i = 0; i < UI_DEBUG_VIEW_COUNT; i++) {
+        ui.debug_textures[i] = LoadRenderTexture(ui_debug_views[i].width, ui_debug_views[i].height);
+        SetTextureFilter(ui.debug_textures[i].texture, UI_FILTER);
+    }
+
+    ui.debug_stale = true;
+}
+
+double
+ui_refresh_rate(void)
+{
+    int hz = GetMonitorRefreshRate(GetCurrentMonitor());
+    return hz > 0 ? hz : 60;
 }
 
 void
 ui_close(void)
 {
     UnloadRenderTexture(ui.frame_texture);
-    UnloadRenderTexture(ui.tileset_texture);
+
+    for (int i = 0; i < UI_DEBUG_VIEW_COUNT; i++) {
+        UnloadRenderTexture(ui.debug_textures[i]);
+    }
+
     CloseWindow();
 }
 
-void
-ui_update_frame_view(const uint8_t *frame)
+void *
+ui_get_framebuffer(int index)
 {
-    BeginTextureMode(ui.frame_texture);
+    return ui.frame_pixels[index];
+}
 
-    for (int y = 0; y < 144; y++) {
-        for (int x = 0; x < 160; x++) {
-            uint8_t pixel = frame[y*160 + x];
-            ui.frame_pixels[y*160 + x] = ui_palettes[ui.palette][pixel];
-        }
+void
+ui_get_palette(PPUColor palette[4])
+{
+    for (int i = 0; i < 4; i++) {
+        Color c = ui_palettes[ui.palette][i];
+        palette[i] = (PPUColor) {c.r, c.g, c.b, c.a};
     }
+}
 
-    UpdateTexture(ui.frame_texture.texture, ui.frame_pixels);
+void
+ui_update_frame_view(const void *frame)
+{
+    BeginTextureMode(ui.frame_texture);
+    UpdateTexture(ui.frame_texture.texture, frame);
     EndTextureMode();
 }
 
 static void
-ui_draw_tile(const uint8_t *vram, int tile_num, int pos_x, int pos_y, Color *pixels)
+ui_decode_tile(const uint8_t *vram, int tile_num)
 {
-    uint8_t tile[8][8];
+    Color *pixels = ui.tile_pixels[tile_num];
 
     for (int y = 0; y < 8; y++) {
         uint16_t offset = tile_num*16 + y*2;
@@ -101,38 +166,144 @@ ui_draw_tile(const uint8_t *vram, int tile_num, int pos_x, int pos_y, Color *pix
         for (int x = 0; x < 8; x++) {
             uint8_t px = ((b0 >> x) & 0x1) << 1;
             px |= ((b1 >> x) & 0x1) << 0;
-            tile[y][7-x] = px;
+            pixels[y*8 + (7-x)] = ui_palettes[ui.palette][px];
+        }
+    }
+}
+
+static inline bool
+ui_is_dirty(const uint64_t *bitmap, int index)
+{
+    return (bitmap[index / 64] >> (index % 64)) & 1;
+}
+
+// Stores an 8x8 cell of the active debug view. Cells are uploaded one by
+// one until too many of them change, then the whole view is uploaded once.
+static void
+ui_debug_put_cell(int x, int y, const Color pixels[64])
+{
+    int width = ui_debug_views[ui.debug_view].width;
+
+    for (int row = 0; row < 8; row++) {
+        memcpy(&ui.debug_pixels[(y + row)*width + x], &pixels[row*8], 8 * sizeof(Color));
+    }
+
+    if (!ui.debug_full && ++ui.debug_uploads > UI_DEBUG_MAX_UPLOADS) {
+        ui.debug_full = true;
+    }
+
+    if (!ui.debug_full) {
+        Rectangle rect = {(float) x, (float) y, 8, 8};
+        UpdateTextureRec(ui.debug_textures[ui.debug_view].texture, rect, pixels);
+    }
+}
+
+static void
+ui_update_tile_view(const PPUDirty *dirty)
+{
+    for (int tile_num = 0; tile_num < 384; tile_num++) {
+        if (ui_is_dirty(dirty->tiles, tile_num)) {
+            ui_debug_put_cell((tile_num % 16) * 8, (tile_num / 16) * 8, ui.tile_pixels[tile_num]);
         }
     }
+}
 
-    for (int y = 0; y < 8; y++) {
-        for (int x = 0; x < 8; x++) {
-            Color color = ui_palettes[ui.palette][tile[y][x]];
-            pixels[(pos_y + y) * 128 + (pos_x + x)] = color;
+// Draws the tilemap selected for the BG or the window, a cell is redrawn
+// when its entry or the tile it points to has changed.
+static void
+ui_update_map_view(const uint8_t *vram, const PPUDirty *dirty, bool window)
+{
+    int map = (ui.debug_lcdc & (window ? 0x40 : 0x08)) ? 1 : 0;
+    bool unsigned_ids = ui.debug_lcdc & 0x10;
+
+    for (int cell = 0; cell < 1024; cell++) {
+        int entry = map*1024 + cell;
+        uint8_t tile_id = vram[0x1800 + entry];
+        int tile_num = (unsigned_ids || tile_id >= 128) ? tile_id : 256 + tile_id;
+
+        if (ui_is_dirty(dirty->map_cells, entry) || ui_is_dirty(dirty->tiles, tile_num)) {
+            ui_debug_put_cell((cell % 32) * 8, (cell / 32) * 8, ui.tile_pixels[tile_num]);
+        }
+    }
+}
+
+// Draws the tiles of the 40 sprites in a grid of 8x16 cells.
+static void
+ui_update_oam_view(const uint8_t *oam, const PPUDirty *dirty)
+{
+    static const Color blank[64] = {0};
+    bool tall = ui.debug_lcdc & 0x04;
+
+    for (int i = 0; i < 40; i++) {
+        int tile_num = tall ? (oam[i*4 + 2] & 0xFE) : oam[i*4 + 2];
+
+        bool changed = ui_is_dirty(&dirty->sprites, i) ||
+            ui_is_dirty(dirty->tiles, tile_num) ||
+            (tall && ui_is_dirty(dirty->tiles, tile_num + 1));
+
+        if (changed) {
+            int x = (i % 8) * 8;
+            int y = (i / 8) * 16;
+            ui_debug_put_cell(x, y, ui.tile_pixels[tile_num]);
+            ui_debug_put_cell(x, y + 8, tall ? ui.tile_pixels[tile_num + 1] : blank);
         }
     }
 }
 
 void
-ui_update_debug_view(const uint8_t *vram)
+ui_update_debug_view(PPU *ppu)
 {
     if (!ui.debug) {
         return;
     }
 
-    BeginTextureMode(ui.tileset_texture);
+    PPUDirty dirty;
+    ppu_take_dirty(ppu, &dirty);
 
-    for (int tile_num  = 0; tile_num < 384; tile_num++) {
-        int tile_x = (tile_num % 16) * 8;
-        int tile_y = (tile_num / 16) * 8;
-        ui_draw_tile(vram, tile_num, tile_x, tile_y, ui.tileset_pixels);
+    const uint8_t *vram = ppu_get_vram(ppu);
+    uint8_t lcdc = ppu_read(ppu, 0xFF40) & UI_DEBUG_LCDC_MASK;
+
+    if (ui.debug_palette != ui.palette || ui.debug_lcdc != lcdc) {
+        ui.debug_palette = ui.palette;
+        ui.debug_lcdc = lcdc;
+        ui.debug_stale = true;
     }
 
-    UpdateTexture(ui.tileset_texture.texture, ui.tileset_pixels);
-    DrawLine(0, 0, 0, 192, BLACK);
-    DrawLine(0, 0, 144, 1, BLACK);
+    if (ui.debug_stale) {
+        memset(&dirty, 0xFF, sizeof(dirty));
+    }
 
-    EndTextureMode();
+    for (int tile_num = 0; tile_num < 384; tile_num++) {
+        if (ui_is_dirty(dirty.tiles, tile_num)) {
+            ui_decode_tile(vram, tile_num);
+        }
+    }
+
+    ui.debug_full = ui.debug_stale;
+    ui.debug_uploads = 0;
+
+    switch (ui.debug_view) {
+    case UI_DEBUG_TILES:
+        ui_update_tile_view(&dirty);
+        break;
+    case UI_DEBUG_BG_MAP:
+        ui_update_map_view(vram, &dirty, false);
+        break;
+    case UI_DEBUG_WIN_MAP:
+        ui_update_map_view(vram, &dirty, true);
+        break;
+    case UI_DEBUG_OAM:
+        ui_update_oam_view(ppu_get_oam(ppu), &dirty);
+        break;
+    default:
+        PANIC("invalid debug view: %d", ui.debug_view);
+    }
+
+    if (ui.debug_full) {
+        UpdateTexture(ui.debug_textures[ui.debug_view].texture, ui.debug_pixels);
+    }
+
+    ui.debug_stale = false;
 }
 
 static inline void
@@ -145,6 +316,56 @@ ui_draw_fps_counter(void)
     int fps = GetFPS();
     DrawText(TextFormat("%d fps", fps), 3, 3, 10, BLACK);
     DrawText(TextFormat("%d fps", fps), 2, 2, 10, WHITE);
+
+#if PERF_ENABLED
+    // Milliseconds per frame, averaged over the last second.
+    for (int i = 0; i < PERF_ZONE_COUNT; i++) {
+        const char *text = TextFormat("%-7s %5.2f ms", perf_zone_name(i), perf.avg[i] / 1e6);
+        DrawText(text, 3, 15 + i * 10, 10, BLACK);
+        DrawText(text, 2, 14 + i * 10, 10, WHITE);
+    }
+#endif
+}
+
+void
+ui_set_frame_times(const FrameTimes *ft)
+{
+    ui.frame_times = ft;
+}
+
+static inline void
+ui_draw_text(const char *text, int x, int y)
+{
+    DrawText(text, x + 1, y + 1, 10, BLACK);
+    DrawText(text, x, y, 10, WHITE);
+}
+
+static inline void
+ui_draw_frame_hist(const char *name, const Hist *h, int y)
+{
+    ui_draw_text(TextFormat("%-8s %5.2f %5.2f %5.2f", name,
+                            (double) hist_percentile(h, 50.0) / 1e6,
+                            (double) hist_percentile(h, 99.0) / 1e6,
+                            (double) hist_percentile(h, 99.9) / 1e6), 2, y);
+}
+
+// Percentiles of the frame times since the start, in ms, at the bottom of
+// the screen.
+static inline void
+ui_draw_frame_stats(void)
+{
+    if (!ui.frame_stats || ui.frame_times == NULL) {
+        return;
+    }
+
+    const FrameTimes *ft = ui.frame_times;
+    int y = UI_WINDOW_HEIGHT - 5 * 10 - 2;
+
+    ui_draw_text("ms       p50   p99   p99.9", 2, y);
+    ui_draw_frame_hist("emulate", &ft->emulate, y + 10);
+    ui_draw_frame_hist("present", &ft->present, y + 20);
+    ui_draw_frame_hist("interval", &ft->interval, y + 30);
+    ui_draw_text(TextFormat("missed   %llu", (unsigned long long) ft->missed), 2, y + 40);
 }
 
 static inline void
@@ -153,6 +374,7 @@ ui_handle_hotkeys(void)
     // Toggle debug view
     if (IsKeyPressed(KEY_F1)) {
         ui.debug = !ui.debug;
+        ui.debug_stale = true;
         if (ui.debug) {
             SetWindowSize(UI_WINDOW_WIDTH + UI_DEBUG_VIEW_WIDTH, UI_WINDOW_HEIGHT);
         } else {
@@ -168,6 +390,19 @@ ui_handle_hotkeys(void)
         return;
     }
 
+    // Cycle through debug views
+    if (IsKeyPressed(KEY_F3) && ui.debug) {
+        ui.debug_view = (ui.debug_view+1) % UI_DEBUG_VIEW_COUNT;
+        ui.debug_stale = true;
+        return;
+    }
+
+    // Toggle the frame time overlay
+    if (IsKeyPressed(KEY_F4)) {
+        ui.frame_stats = !ui.frame_stats;
+        return;
+    }
+
     //  Take a screenshot
     if (IsKeyPressed(KEY_F12)) {
         TakeScreenshot(TextFormat("screenshot-%03d.png", GetRandomValue(0, 1000)));
@@ -187,12 +422,20 @@ ui_refresh(void)
     static Rectangle frame_srect = (Rectangle) {0, 0, 160*UI_SCALE, 144*UI_SCALE};
     DrawTexturePro(ui.frame_texture.texture, frame_rect, frame_srect, origin, 0, WHITE);
 
-    static Rectangle tileset_rect = (Rectangle) {0, 0, 128, 192};
-    static Rectangle tileset_srect = (Rectangle) {160*UI_SCALE, 0, (int) UI_DEBUG_VIEW_WIDTH, (int) UI_DEBUG_VIEW_HEIGHT};
-    DrawTexturePro(ui.tileset_texture.texture, tileset_rect, tileset_srect, origin, 0, WHITE);
+    if (ui.debug) {
+        // Views are scaled to the width of the debug area.
+        int width = ui_debug_views[ui.debug_view].width;
+        int height = ui_debug_views[ui.debug_view].height;
+        Rectangle debug_rect = {0, 0, (float) width, (float) height};
+        Rectangle debug_srect = {160*UI_SCALE, 0, UI_DEBUG_VIEW_WIDTH, (float) (UI_DEBUG_VIEW_WIDTH * height / width)};
+        DrawTexturePro(ui.debug_textures[ui.debug_view].texture, debug_rect, debug_srect, origin, 0, WHITE);
+        DrawLine(160*UI_SCALE, 0, 160*UI_SCALE, UI_WINDOW_HEIGHT, BLACK);
+        DrawText(ui_debug_views[ui.debug_view].name, 160*UI_SCALE + 2, UI_WINDOW_HEIGHT - 12, 10, WHITE);
+    }
 
     ui_handle_hotkeys();
     ui_draw_fps_counter();
+    ui_draw_frame_stats();
 
     EndDrawing();
 }
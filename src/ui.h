@@ -3,11 +3,11 @@
 #include <stdbool.h>
 
 #include "raylib.h"
+#include "frametime.h"
 #include "joypad.h"
 #include "ppu.h"
 
 #define UI_SCALE 3
-#define UI_FPS 60
 #define UI_SHOW_DEBUG_VIEW 0
 #define UI_WINDOW_HEIGHT (144 * UI_SCALE)
 #define UI_WINDOW_WIDTH ((160 * UI_SCALE))
@@ -17,11 +17,25 @@
 
 extern const Color ui_palettes[][4];
 
-void ui_init(void);
+// With vsync the frames are paced by the display, otherwise the caller
+// paces them (see pacing.h) and presenting never waits.
+void ui_init(bool vsync);
 
-void ui_update_frame_view(const uint8_t *frame);
+// Returns the refresh rate of the display the window is on.
+double ui_refresh_rate(void);
 
-void ui_update_debug_view(const uint8_t *vram);
+// Returns one of the two RGBA8888 buffers the PPU renders into.
+void *ui_get_framebuffer(int index);
+
+// Returns the colors of the selected palette.
+void ui_get_palette(PPUColor palette[4]);
+
+void ui_update_frame_view(const void *frame);
+
+void ui_update_debug_view(PPU *ppu);
+
+// Frame times shown by the F4 overlay, the UI only reads them.
+void ui_set_frame_times(const FrameTimes *ft);
 
 bool ui_button_pressed(JoypadButton button);
 
@@ -0,0 +1,918 @@
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "cpu.h"
+#include "gb.h"
+#include "interrupt.h"
+#include "joypad.h"
+#include "mapper.h"
+#include "mmu.h"
+#include "ppu.h"
+#include "rom.h"
+#include "serial.h"
+#include "timer.h"
+
+// Benchmark suite: runs a fixed set of workloads headless for a fixed
+// number of frames with scripted input, then a few microbenchmarks of the
+// hot paths. Every workload runs several times on a fresh emulator, the
+// mean and standard deviation are reported so that runs of two commits
+// can be compared (--json writes one line per benchmark for that).
+//
+// The built-in workloads are small ROMs assembled below, extra ROM files
+// given on the command line are run as workloads too.
+
+#define BENCH_FRAMES 600
+#define BENCH_RUNS 5
+#define BENCH_MAX_RUNS 100
+
+// Master clock cycles per frame.
+#define BENCH_FRAME_TICKS 70224
+
+// Every ROM starts at 0x0100 and jumps over the header.
+
+static const uint8_t bench_entry[] = {
+    0x00,                   // nop
+    0xC3, 0x50, 0x01,       // jp $0150
+};
+
+// cpu: block copies, ALU and CB operations and calls. Only the VBLANK
+// interrupt is enabled, the CPU never halts.
+static const uint8_t bench_cpu_vblank[] = {
+    0xD9,                   // reti
+};
+
+static const uint8_t bench_cpu_main[] = {
+    0xF3,                   // di
+    0x31, 0xFE, 0xFF,       // ld sp,$FFFE
+    0x3E, 0x91,             // ld a,$91
+    0xE0, 0x40,             // ldh ($40),a ; LCDC: LCD and BG on
+    0x3E, 0x01,             // ld a,$01
+    0xE0, 0xFF,             // ldh ($FF),a ; IE: VBLANK
+    0xFB,                   // ei
+    // cpu_loop:
+    0x21, 0x00, 0xC0,       // ld hl,$C000
+    0x11, 0x00, 0xC8,       // ld de,$C800
+    0x01, 0x00, 0x04,       // ld bc,$0400
+    // cpu_copy:
+    0x2A,                   // ld a,(hl+)
+    0x3C,                   // inc a
+    0x12,                   // ld (de),a
+    0x13,                   // inc de
+    0x0B,                   // dec bc
+    0x78,                   // ld a,b
+    0xB1,                   // or c
+    0x20, 0xF7,             // jr nz,cpu_copy
+    0x01, 0x00, 0x00,       // ld bc,$0000
+    // cpu_alu:
+    0x78,                   // ld a,b
+    0x87,                   // add a,a
+    0x89,                   // adc a,c
+    0xAA,                   // xor d
+    0x07,                   // rlca
+    0xCB, 0x37,             // swap a
+    0x4F,                   // ld c,a
+    0xCB, 0x5F,             // bit 3,a
+    0xC4, 0x88, 0x01,       // call nz,cpu_sub
+    0xCB, 0x39,             // srl c
+    0xCB, 0x1A,             // rr d
+    0x04,                   // inc b
+    0x20, 0xEC,             // jr nz,cpu_alu
+    0x18, 0xD5,             // jr cpu_loop
+    // cpu_sub:
+    0xC5,                   // push bc
+    0x26, 0xC0,             // ld h,$C0
+    0x69,                   // ld l,c
+    0x7E,                   // ld a,(hl)
+    0x82,                   // add a,d
+    0x57,                   // ld d,a
+    0xC1,                   // pop bc
+    0xC9,                   // ret
+};
+
+// raster: an HBLANK interrupt on every line changes the horizontal scroll
+// and rotates the palette, with the window over the lower part.
+static const uint8_t bench_raster_vblank[] = {
+    0xC3, 0x95, 0x01,       // jp ras_vblank
+};
+
+static const uint8_t bench_raster_stat[] = {
+    0xC3, 0x9D, 0x01,       // jp ras_stat
+};
+
+static const uint8_t bench_raster_main[] = {
+    0xF3,                   // di
+    0x31, 0xFE, 0xFF,       // ld sp,$FFFE
+    0x3E, 0x00,             // ld a,$00
+    0xE0, 0x40,             // ldh ($40),a ; LCDC: LCD off to fill VRAM
+    0x21, 0x00, 0x80,       // ld hl,$8000
+    0x01, 0x00, 0x18,       // ld bc,$1800
+    // fill_tiles:
+    0x7D,                   // ld a,l
+    0xAC,                   // xor h
+    0x07,                   // rlca
+    0x81,                   // add a,c
+    0x22,                   // ld (hl+),a
+    0x0B,                   // dec bc
+    0x78,                   // ld a,b
+    0xB1,                   // or c
+    0x20, 0xF6,             // jr nz,fill_tiles
+    0x01, 0x00, 0x08,       // ld bc,$0800
+    // fill_maps:
+    0x7D,                   // ld a,l
+    0x87,                   // add a,a
+    0x84,                   // add a,h
+    0x22,                   // ld (hl+),a
+    0x0B,                   // dec bc
+    0x78,                   // ld a,b
+    0xB1,                   // or c
+    0x20, 0xF7,             // jr nz,fill_maps
+    0x3E, 0xE4,             // ld a,$E4
+    0xE0, 0x47,             // ldh ($47),a ; BGP
+    0x3E, 0x40,             // ld a,$40
+    0xE0, 0x4A,             // ldh ($4A),a ; WY
+    0x3E, 0x50,             // ld a,$50
+    0xE0, 0x4B,             // ldh ($4B),a ; WX
+    0x3E, 0x08,             // ld a,$08
+    0xE0, 0x41,             // ldh ($41),a ; STAT: HBLANK interrupt
+    0x3E, 0xF1,             // ld a,$F1
+    0xE0, 0x40,             // ldh ($40),a ; LCDC: LCD, window (9C00), BG on
+    0x3E, 0x00,             // ld a,$00
+    0xE0, 0x0F,             // ldh ($0F),a ; IF
+    0x3E, 0x03,             // ld a,$03
+    0xE0, 0xFF,             // ldh ($FF),a ; IE: VBLANK, STAT
+    0xFB,                   // ei
+    // ras_idle:
+    0x76,                   // halt
+    0x00,                   // nop
+    0x18, 0xFC,             // jr ras_idle
+    // ras_vblank:
+    0xF5,                   // push af
+    0xF0, 0x42,             // ldh a,($42)
+    0x3C,                   // inc a
+    0xE0, 0x42,             // ldh ($42),a ; SCY++
+    0xF1,                   // pop af
+    0xD9,                   // reti
+    // ras_stat:
+    0xF5,                   // push af
+    0xF0, 0x44,             // ldh a,($44)
+    0x87,                   // add a,a
+    0xE0, 0x43,             // ldh ($43),a ; SCX = LY*2
+    0xF0, 0x44,             // ldh a,($44)
+    0xE6, 0x07,             // and $07
+    0x20, 0x06,             // jr nz,ras_done
+    0xF0, 0x47,             // ldh a,($47)
+    0x07,                   // rlca
+    0x07,                   // rlca
+    0xE0, 0x47,             // ldh ($47),a ; rotate BGP
+    // ras_done:
+    0xF1,                   // pop af
+    0xD9,                   // reti
+};
+
+// sprites: 40 8x16 sprites in four rows of ten, the most a line can show,
+// moved every frame through OAM DMA. The D-pad changes their speed.
+static const uint8_t bench_sprites_vblank[] = {
+    0xC3, 0xC4, 0x01,       // jp spr_vblank
+};
+
+static const uint8_t bench_sprites_joypad[] = {
+    0xD9,                   // reti
+};
+
+static const uint8_t bench_sprites_main[] = {
+    0xF3,                   // di
+    0x31, 0xFE, 0xFF,       // ld sp,$FFFE
+    0x3E, 0x00,             // ld a,$00
+    0xE0, 0x40,             // ldh ($40),a ; LCDC: LCD off to fill VRAM
+    0x21, 0x00, 0x80,       // ld hl,$8000
+    0x01, 0x00, 0x18,       // ld bc,$1800
+    // fill_tiles:
+    0x7D,                   // ld a,l
+    0xAC,                   // xor h
+    0x07,                   // rlca
+    0x81,                   // add a,c
+    0x22,                   // ld (hl+),a
+    0x0B,                   // dec bc
+    0x78,                   // ld a,b
+    0xB1,                   // or c
+    0x20, 0xF6,             // jr nz,fill_tiles
+    0x01, 0x00, 0x08,       // ld bc,$0800
+    // fill_maps:
+    0x7D,                   // ld a,l
+    0x87,                   // add a,a
+    0x84,                   // add a,h
+    0x22,                   // ld (hl+),a
+    0x0B,                   // dec bc
+    0x78,                   // ld a,b
+    0xB1,                   // or c
+    0x20, 0xF7,             // jr nz,fill_maps
+    0x21, 0x80, 0xFF,       // ld hl,$FF80
+    0x11, 0x00, 0x02,       // ld de,$0200 ; DMA routine
+    0x0E, 0x0A,             // ld c,10
+    // spr_copy:
+    0x1A,                   // ld a,(de)
+    0x22,                   // ld (hl+),a
+    0x13,                   // inc de
+    0x0D,                   // dec c
+    0x20, 0xFA,             // jr nz,spr_copy
+    0x21, 0x00, 0xC1,       // ld hl,$C100
+    0x06, 0x00,             // ld b,0
+    // spr_init:
+    0x78,                   // ld a,b
+    0xE6, 0x03,             // and $03
+    0xCB, 0x37,             // swap a
+    0x87,                   // add a,a
+    0xC6, 0x10,             // add a,$10
+    0x22,                   // ld (hl+),a ; y = 16 + (i & 3) * 32
+    0x78,                   // ld a,b
+    0xCB, 0x3F,             // srl a
+    0xCB, 0x3F,             // srl a
+    0xCB, 0x37,             // swap a
+    0xC6, 0x08,             // add a,$08
+    0x22,                   // ld (hl+),a ; x = 8 + (i >> 2) * 16
+    0x78,                   // ld a,b
+    0x87,                   // add a,a
+    0x22,                   // ld (hl+),a ; tile
+    0x78,                   // ld a,b
+    0xCB, 0x37,             // swap a
+    0x22,                   // ld (hl+),a ; flags
+    0x04,                   // inc b
+    0x78,                   // ld a,b
+    0xFE, 0x28,             // cp 40
+    0x20, 0xE0,             // jr nz,spr_init
+    0x3E, 0xE4,             // ld a,$E4
+    0xE0, 0x47,             // ldh ($47),a ; BGP
+    0x3E, 0xD2,             // ld a,$D2
+    0xE0, 0x48,             // ldh ($48),a ; OBP0
+    0x3E, 0x1B,             // ld a,$1B
+    0xE0, 0x49,             // ldh ($49),a ; OBP1
+    0x3E, 0x87,             // ld a,$87
+    0xE0, 0x40,             // ldh ($40),a ; LCDC: LCD, 8x16 OBJ, OBJ, BG on
+    0x3E, 0x00,             // ld a,$00
+    0xE0, 0x0F,             // ldh ($0F),a ; IF
+    0x3E, 0x11,             // ld a,$11
+    0xE0, 0xFF,             // ldh ($FF),a ; IE: VBLANK, joypad
+    0xFB,                   // ei
+    // spr_idle:
+    0x76,                   // halt
+    0x00,                   // nop
+    0x18, 0xFC,             // jr spr_idle
+    // spr_vblank:
+    0xF5,                   // push af
+    0xC5,                   // push bc
+    0xE5,                   // push hl
+    0x3E, 0x20,             // ld a,$20
+    0xE0, 0x00,             // ldh ($00),a ; P1: select the D-pad
+    0xF0, 0x00,             // ldh a,($00)
+    0x2F,                   // cpl
+    0xE6, 0x0F,             // and $0F
+    0x3C,                   // inc a
+    0x4F,                   // ld c,a ; step = pressed + 1
+    0x21, 0x01, 0xC1,       // ld hl,$C101
+    0x06, 0x28,             // ld b,40
+    // spr_move:
+    0x7E,                   // ld a,(hl)
+    0x81,                   // add a,c
+    0x22,                   // ld (hl+),a ; x += step
+    0x23,                   // inc hl
+    0x23,                   // inc hl
+    0x23,                   // inc hl
+    0x05,                   // dec b
+    0x20, 0xF7,             // jr nz,spr_move
+    0xCD, 0x80, 0xFF,       // call $FF80 ; OAM DMA from C100
+    0xE1,                   // pop hl
+    0xC1,                   // pop bc
+    0xF1,                   // pop af
+    0xD9,                   // reti
+};
+
+static const uint8_t bench_sprites_dma[] = {
+    0x3E, 0xC1,             // ld a,$C1
+    0xE0, 0x46,             // ldh ($46),a ; start OAM DMA
+    0x3E, 0x28,             // ld a,40
+    // spr_wait:
+    0x3D,                   // dec a
+    0x20, 0xFD,             // jr nz,spr_wait
+    0xC9,                   // ret
+};
+
+typedef struct {
+    uint16_t addr;
+    const uint8_t *code;
+    size_t size;
+} BenchBlock;
+
+#define BENCH_BLOCK(addr, code) {(addr), (code), sizeof(code)}
+
+static const BenchBlock bench_cpu_rom[] = {
+    BENCH_BLOCK(0x0040, bench_cpu_vblank),
+    BENCH_BLOCK(0x0100, bench_entry),
+    BENCH_BLOCK(0x0150, bench_cpu_main),
+};
+
+static const BenchBlock bench_raster_rom[] = {
+    BENCH_BLOCK(0x0040, bench_raster_vblank),
+    BENCH_BLOCK(0x0048, bench_raster_stat),
+    BENCH_BLOCK(0x0100, bench_entry),
+    BENCH_BLOCK(0x0150, bench_raster_main),
+};
+
+static const BenchBlock bench_sprites_rom[] = {
+    BENCH_BLOCK(0x0040, bench_sprites_vblank),
+    BENCH_BLOCK(0x0060, bench_sprites_joypad),
+    BENCH_BLOCK(0x0100, bench_entry),
+    BENCH_BLOCK(0x0150, bench_sprites_main),
+    BENCH_BLOCK(0x0200, bench_sprites_dma),
+};
+
+typedef struct {
+    const char *name;
+    const BenchBlock *blocks;
+    size_t len;
+} BenchROM;
+
+static const BenchROM bench_roms[] = {
+    {"cpu", bench_cpu_rom, ARRAY_SIZE(bench_cpu_rom)},
+    {"raster", bench_raster_rom, ARRAY_SIZE(bench_raster_rom)},
+    {"sprites", bench_sprites_rom, ARRAY_SIZE(bench_sprites_rom)},
+};
+
+typedef struct {
+    unsigned long frames;
+    unsigned long runs;
+    const char *filter;
+    GBScheduler sched;
+    bool json;
+    bool micro;
+    FILE *out; // Report, stdout is taken by the core logs
+    char **romfiles;
+    int romfiles_len;
+} BenchOpts;
+
+typedef struct {
+    double mean;
+    double stddev;
+} BenchStat;
+
+// Emulator instance of one run, with the frames rendered the way the
+// frontend renders them.
+typedef struct {
+    IMapper *mapper;
+    CPU *cpu;
+    PPU *ppu;
+    Timer *timer;
+    Serial *serial;
+    Joypad *joypad;
+    MMU *mmu;
+    GameBoy *gb;
+    uint8_t *frames[2];
+} BenchMachine;
+
+static double
+bench_time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Keeps the compiler from dropping the results of the microbenchmarks.
+static volatile uint64_t bench_sink;
+
+// Assembles a built-in workload into a 32KB ROM without a mapper.
+static ROM *
+bench_rom_new(const BenchROM *br)
+{
+    ROM *rom = xalloc(sizeof(ROM));
+    rom->size = 2 * ROM_BANK_SIZE;
+    rom->data = xalloc(rom->size);
+    rom->header = (ROMHeader *) (rom->data + 0x0100);
+
+    memset(rom->data, 0xFF, rom->size);
+    for (size_t i = 0; i < br->len; i++) {
+        memcpy(rom->data + br->blocks[i].addr, br->blocks[i].code, br->blocks[i].size);
+    }
+
+    memset(rom->header->title, 0, sizeof(rom->header->title));
+    memcpy(rom->header->title, br->name, strlen(br->name));
+    rom->header->type = ROM_TYPE_ROM_ONLY;
+    rom->header->rom_size = 0;
+    rom->header->ram_size = 0;
+
+    return rom;
+}
+
+static void
+bench_machine_free(BenchMachine *m)
+{
+    gb_free(&m->gb);
+    mmu_free(&m->mmu);
+    joypad_free(&m->joypad);
+    serial_free(&m->serial);
+    timer_free(&m->timer);
+    ppu_free(&m->ppu);
+    cpu_free(&m->cpu);
+    mapper_free(&m->mapper);
+    xfree(m->frames[0]);
+    xfree(m->frames[1]);
+}
+
+// Starts the ROM at 0x0100 as the boot ROM would leave it, so that every
+// frame that is timed runs the workload.
+static void
+bench_machine_init(BenchMachine *m, ROM *rom, GBScheduler sched)
+{
+    m->mapper = mapper_new(rom);
+    if (m->mapper == NULL) {
+        PANIC("unsupported mapper");
+    }
+
+    m->cpu = cpu_new();
+    m->ppu = ppu_new();
+    m->timer = timer_new();
+    m->serial = serial_new();
+    m->joypad = joypad_new();
+    m->mmu = mmu_new(m->mapper, m->serial, m->timer, m->ppu, m->joypad);
+    m->gb = gb_new(m->cpu, m->mmu, sched);
+
+    size_t size = ppu_frame_pitch(PPU_FORMAT_RGBA8888) * 144;
+    m->frames[0] = xalloc(size);
+    m->frames[1] = xalloc(size);
+    ppu_set_framebuffers(m->ppu, PPU_FORMAT_RGBA8888, m->frames[0], m->frames[1]);
+
+    m->mmu->bootrom_mapped = false;
+    m->cpu->PC = 0x0100;
+}
+
+// Scripted input: every 16 frames a new set of buttons is held, from a
+// fixed pseudo-random sequence, so that each run sees the same presses.
+static void
+bench_input(MMU *mmu, uint64_t frame)
+{
+    uint32_t x = (uint32_t) (frame / 16) * 0x9E3779B1u + 0x7F4A7C15u;
+    x ^= x >> 15;
+    x *= 0x2C1B3C6Du;
+    x ^= x >> 12;
+
+    mmu_clear_interrupt(mmu, INT_JOYPAD);
+    joypad_clear(mmu->joypad);
+
+    for (int button = JOYPAD_RIGHT; button <= JOYPAD_START; button++) {
+        // About one button in four is pressed.
+        if (((x >> (button * 4)) & 0x3) == 0) {
+            joypad_press(mmu->joypad, (JoypadButton) button);
+            mmu_set_interrupt(mmu, INT_JOYPAD);
+        }
+    }
+}
+
+static BenchStat
+bench_stat(const double *values, size_t len)
+{
+    BenchStat stat = {0};
+
+    for (size_t i = 0; i < len; i++) {
+        stat.mean += values[i];
+    }
+    stat.mean /= (double) len;
+
+    if (len > 1) {
+        double sum = 0;
+        for (size_t i = 0; i < len; i++) {
+            sum += (values[i] - stat.mean) * (values[i] - stat.mean);
+        }
+        stat.stddev = sqrt(sum / (double) (len - 1));
+    }
+
+    return stat;
+}
+
+// Standard deviation as a percentage of the mean.
+static double
+bench_spread(BenchStat stat)
+{
+    return stat.mean != 0 ? 100.0 * stat.stddev / stat.mean : 0;
+}
+
+static void
+bench_print_stat(FILE *out, const char *key, BenchStat stat)
+{
+    fprintf(out, ",\"%s\":{\"mean\":%.6g,\"stddev\":%.6g}", key, stat.mean, stat.stddev);
+}
+
+static void
+bench_report_workload(const BenchOpts *opts, const char *name, const double (*results)[4])
+{
+    double values[4][BENCH_MAX_RUNS];
+    BenchStat stats[4];
+
+    for (int i = 0; i < 4; i++) {
+        for (size_t run = 0; run < opts->runs; run++) {
+            values[i][run] = results[run][i];
+        }
+
+        stats[i] = bench_stat(values[i], opts->runs);
+    }
+
+    if (opts->json) {
+        fprintf(opts->out, "{\"bench\":\"%s\",\"kind\":\"workload\",\"frames\":%lu,\"runs\":%lu", name,
+               opts->frames, opts->runs);
+        bench_print_stat(opts->out, "mhz", stats[0]);
+        bench_print_stat(opts->out, "fps", stats[1]);
+        bench_print_stat(opts->out, "ips", stats[2]);
+        bench_print_stat(opts->out, "ns_per_frame", stats[3]);
+        fprintf(opts->out, "}\n");
+        return;
+    }
+
+    fprintf(opts->out, "%-16s %8.2f ±%5.1f%% %9.1f ±%5.1f%% %9.2fM ±%5.1f%% %11.0f ±%5.1f%%\n", name,
+           stats[0].mean, bench_spread(stats[0]),
+           stats[1].mean, bench_spread(stats[1]),
+           stats[2].mean / 1e6, bench_spread(stats[2]),
+           stats[3].mean, bench_spread(stats[3]));
+}
+
+// Runs a workload on a fresh emulator and returns its emulated clock in
+// MHz, frames and instructions per second and ns per frame.
+static void
+bench_run_workload(const BenchOpts *opts, ROM *rom, double result[4])
+{
+    _cleanup_(bench_machine_free) BenchMachine m = {0};
+    bench_machine_init(&m, rom, opts->sched);
+
+    double start = bench_time_now();
+
+    while (m.gb->frames < opts->frames) {
+        bench_input(m.mmu, m.gb->frames);
+        gb_run_frame(m.gb);
+    }
+
+    double seconds = bench_time_now() - start;
+
+    result[0] = (double) m.mmu->ticks / seconds / 1e6;
+    result[1] = (double) m.gb->frames / seconds;
+    result[2] = (double) m.cpu->instructions / seconds;
+    result[3] = seconds * 1e9 / (double) m.gb->frames;
+}
+
+static void
+bench_workload(const BenchOpts *opts, const char *name, ROM *rom)
+{
+    double results[BENCH_MAX_RUNS][4];
+
+    // The first run only warms up the caches and the allocator.
+    bench_run_workload(opts, rom, results[0]);
+
+    for (size_t run = 0; run < opts->runs; run++) {
+        bench_run_workload(opts, rom, results[run]);
+    }
+
+    bench_report_workload(opts, name, (const double (*)[4]) results);
+}
+
+// Brings up the sprites workload and runs it for a while, the
+// microbenchmarks work on the state it leaves.
+static void
+bench_micro_machine(BenchMachine *m, const BenchROM *br, ROM **rom)
+{
+    *rom = bench_rom_new(br);
+    bench_machine_init(m, *rom, GB_SCHED_EVENT);
+
+    while (m->gb->frames < 60) {
+        gb_run_frame(m->gb);
+    }
+}
+
+// mmu_read over ROM, WRAM, HRAM, VRAM and I/O registers. Returns ns per read.
+static double
+bench_mmu_read(void)
+{
+    _cleanup_(rom_free) ROM *rom = NULL;
+    _cleanup_(bench_machine_free) BenchMachine m = {0};
+    bench_micro_machine(&m, &bench_roms[2], &rom);
+
+    // Weighted towards memory, as in the workloads.
+    static const uint16_t addrs[] = {
+        0x0150, 0x0151, 0x0152, 0x3FF0, 0x4100, 0x7F00, 0x8010, 0x9810,
+        0xC100, 0xC101, 0xC102, 0xC103, 0xD000, 0xDFFE, 0xE100, 0xFE00,
+        0xFF80, 0xFF81, 0xFFFE, 0xFF00, 0xFF04, 0xFF05, 0xFF0F, 0xFF40,
+        0xFF41, 0xFF42, 0xFF43, 0xFF44, 0xFF45, 0xFF47, 0xFF4A, 0xFFFF,
+    };
+
+    const size_t count = 1 << 24;
+    uint64_t sum = 0;
+
+    double start = bench_time_now();
+    for (size_t i = 0; i < count; i++) {
+        sum += mmu_read(m.mmu, addrs[i % ARRAY_SIZE(addrs)]);
+    }
+    double seconds = bench_time_now() - start;
+
+    bench_sink = sum;
+    return seconds * 1e9 / (double) count;
+}
+
+// cpu_step on the cpu workload, without the rest of the machine. Returns
+// ns per instruction.
+static double
+bench_cpu_step(void)
+{
+    _cleanup_(rom_free) ROM *rom = NULL;
+    _cleanup_(bench_machine_free) BenchMachine m = {0};
+    bench_micro_machine(&m, &bench_roms[0], &rom);
+
+    const size_t count = 1 << 24;
+    uint64_t before = m.cpu->instructions;
+
+    double start = bench_time_now();
+    for (size_t i = 0; i < count; i++) {
+        cpu_step(m.cpu, m.mmu);
+    }
+    double seconds = bench_time_now() - start;
+
+    return seconds * 1e9 / (double) (m.cpu->instructions - before);
+}
+
+// Whole frames of the PPU on the sprites scene, in the given format.
+// Returns ns per visible line.
+static double
+bench_ppu_lines(PPUPixelFormat format)
+{
+    _cleanup_(rom_free) ROM *rom = NULL;
+    _cleanup_(bench_machine_free) BenchMachine m = {0};
+    bench_micro_machine(&m, &bench_roms[2], &rom);
+
+    if (format != PPU_FORMAT_RGBA8888) {
+        ppu_set_framebuffers(m.ppu, format, NULL, NULL);
+    }
+
+    const size_t frames = 2000;
+    uint64_t now = m.mmu->ticks;
+
+    double start = bench_time_now();
+    for (size_t i = 0; i < frames; i++) {
+        now += BENCH_FRAME_TICKS;
+        ppu_sync(m.ppu, now);
+    }
+    double seconds = bench_time_now() - start;
+
+    return seconds * 1e9 / (double) (frames * 144);
+}
+
+static double
+bench_ppu_index8(void)
+{
+    return bench_ppu_lines(PPU_FORMAT_INDEX8);
+}
+
+static double
+bench_ppu_rgba(void)
+{
+    return bench_ppu_lines(PPU_FORMAT_RGBA8888);
+}
+
+// The timer at its fastest rate, checked for an overflow on every M-cycle
+// with DIV read now and then. Returns ns per M-cycle.
+static double
+bench_timer(void)
+{
+    _cleanup_(timer_free) Timer *timer = timer_new();
+    timer_reset(timer, 0);
+    timer_write(timer, 0xFF07, 0x05, 0);
+
+    const size_t count = 1 << 24;
+    uint64_t sum = 0;
+
+    double start = bench_time_now();
+    for (size_t i = 0; i < count; i++) {
+        uint64_t now = (uint64_t) i * 4;
+        sum += timer_interrupt(timer, now);
+
+        if (i % 64 == 0) {
+            sum += timer_read(timer, 0xFF04, now);
+        }
+    }
+    double seconds = bench_time_now() - start;
+
+    bench_sink = sum;
+    return seconds * 1e9 / (double) count;
+}
+
+typedef struct {
+    const char *name;
+    const char *unit;
+    double (*run)(void);
+} BenchMicro;
+
+static const BenchMicro bench_micros[] = {
+    {"mmu_read", "read", bench_mmu_read},
+    {"cpu_step", "instr", bench_cpu_step},
+    {"ppu_line", "line", bench_ppu_index8},
+    {"ppu_line_rgba", "line", bench_ppu_rgba},
+    {"timer", "M-cycle", bench_timer},
+};
+
+static void
+bench_micro(const BenchOpts *opts, const BenchMicro *micro)
+{
+    double values[BENCH_MAX_RUNS];
+
+    micro->run();
+    for (size_t run = 0; run < opts->runs; run++) {
+        values[run] = micro->run();
+    }
+
+    BenchStat stat = bench_stat(values, opts->runs);
+
+    if (opts->json) {
+        fprintf(opts->out, "{\"bench\":\"%s\",\"kind\":\"micro\",\"runs\":%lu", micro->name, opts->runs);
+        bench_print_stat(opts->out, "ns_per_op", stat);
+        fprintf(opts->out, "}\n");
+        return;
+    }
+
+    fprintf(opts->out, "%-16s %8.2f ns/%-7s ±%5.1f%%\n", micro->name, stat.mean, micro->unit,
+           bench_spread(stat));
+}
+
+static bool
+bench_selected(const BenchOpts *opts, const char *name)
+{
+    return opts->filter == NULL || strstr(name, opts->filter) != NULL;
+}
+
+static void
+bench_usage(void)
+{
+    printf("Usage:\n");
+    printf("  brickboy-bench [OPTIONS...] [romfile.gb...]\n");
+}
+
+static void
+bench_help(void)
+{
+    printf("BrickBoy benchmark suite\n");
+    printf("\n");
+
+    bench_usage();
+    printf("\n");
+
+    printf("Options:\n");
+    printf("  -h, --help            Print this help message\n");
+    printf("  -f, --frames <n>      Frames per workload run (default: %d)\n", BENCH_FRAMES);
+    printf("  -r, --runs <n>        Runs of each benchmark (default: %d)\n", BENCH_RUNS);
+    printf("  -b, --bench <name>    Only run the benchmarks whose name contains name\n");
+    printf("  --sched <scheduler>   Component scheduler: event (default), lockstep, coro\n");
+    printf("  --no-micro            Skip the microbenchmarks\n");
+    printf("  --json                Write one line of JSON per benchmark\n");
+}
+
+static const struct option bench_opts_long[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"frames", required_argument, NULL, 'f'},
+    {"runs", required_argument, NULL, 'r'},
+    {"bench", required_argument, NULL, 'b'},
+    {"sched", required_argument, NULL, 0},
+    {"no-micro", no_argument, NULL, 0},
+    {"json", no_argument, NULL, 0},
+    {NULL, 0, NULL, 0},
+};
+
+static void
+bench_parse_sched(BenchOpts *opts, const char *name)
+{
+    if (strcmp(name, "event") == 0) {
+        opts->sched = GB_SCHED_EVENT;
+    } else if (strcmp(name, "lockstep") == 0) {
+        opts->sched = GB_SCHED_LOCKSTEP;
+    } else if (strcmp(name, "coro") == 0) {
+        opts->sched = GB_SCHED_CORO;
+    } else {
+        fprintf(stderr, "invalid scheduler: %s\n", name);
+        exit(1);
+    }
+}
+
+static void
+bench_parse_opts(BenchOpts *opts, int argc, char **argv)
+{
+    while (1) {
+        int opt_index = 0;
+        int opt = getopt_long(argc, argv, "hf:r:b:", bench_opts_long, &opt_index);
+
+        if (opt == -1) {
+            break;
+        }
+
+        if (opt == 0) {
+            const char *name = bench_opts_long[opt_index].name;
+
+            if (strcmp(name, "sched") == 0) {
+                bench_parse_sched(opts, optarg);
+            } else if (strcmp(name, "no-micro") == 0) {
+                opts->micro = false;
+            } else if (strcmp(name, "json") == 0) {
+                opts->json = true;
+            }
+
+            continue;
+        }
+
+        switch (opt) {
+        case 'f':
+            opts->frames = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            opts->runs = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            opts->filter = optarg;
+            break;
+        case 'h':
+            bench_help();
+            exit(0);
+        default:
+            bench_usage();
+            exit(1);
+        }
+    }
+
+    if (opts->frames == 0 || opts->runs == 0 || opts->runs > BENCH_MAX_RUNS) {
+        fprintf(stderr, "frames must be positive and runs between 1 and %d\n", BENCH_MAX_RUNS);
+        exit(1);
+    }
+
+    opts->romfiles = argv + optind;
+    opts->romfiles_len = argc - optind;
+}
+
+int
+main(int argc, char **argv)
+{
+    BenchOpts opts = {
+        .frames = BENCH_FRAMES,
+        .runs = BENCH_RUNS,
+        .micro = true,
+    };
+
+    bench_parse_opts(&opts, argc, argv);
+
+    // The core logs to stdout while loading ROM files, keep the report
+    // clean by moving the logs to stderr.
+    _autoclose_ FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (report == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+        PANIC("failed to redirect stdout");
+    }
+    opts.out = report;
+
+    if (!opts.json) {
+        fprintf(report, "%-16s %16s %17s %18s %19s\n", "workload", "MHz", "fps", "instr/s", "ns/frame");
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(bench_roms); i++) {
+        if (bench_selected(&opts, bench_roms[i].name)) {
+            _cleanup_(rom_free) ROM *rom = bench_rom_new(&bench_roms[i]);
+            bench_workload(&opts, bench_roms[i].name, rom);
+        }
+    }
+
+    for (int i = 0; i < opts.romfiles_len; i++) {
+        const char *name = strrchr(opts.romfiles[i], '/');
+        name = name != NULL ? name + 1 : opts.romfiles[i];
+
+        if (!bench_selected(&opts, name)) {
+            continue;
+        }
+
+        _cleanup_(rom_free) ROM *rom = rom_open(opts.romfiles[i]);
+        if (rom == NULL) {
+            fprintf(stderr, "failed to open rom file: %s\n", opts.romfiles[i]);
+            exit(1);
+        }
+
+        bench_workload(&opts, name, rom);
+    }
+
+    if (opts.micro) {
+        if (!opts.json) {
+            fprintf(report, "\n%-16s %16s\n", "micro", "time");
+        }
+
+        for (size_t i = 0; i < ARRAY_SIZE(bench_micros); i++) {
+            if (bench_selected(&opts, bench_micros[i].name)) {
+                bench_micro(&opts, &bench_micros[i]);
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "disasm.h"
+#include "rom.h"
+
+// Disassembles ROM banks in one linear pass, without running anything,
+// so that code regions of two ROMs (or two builds of one) can be diffed.
+
+typedef struct {
+    const char *romfile;
+    long bank; // -1 for all banks
+} DisasmOpts;
+
+static void
+disasm_usage(void)
+{
+    printf("Usage:\n");
+    printf("  brickboy-disasm [OPTIONS...] romfile.gb\n");
+}
+
+static void
+disasm_help(void)
+{
+    printf("BrickBoy ROM disassembler\n");
+    printf("\n");
+
+    disasm_usage();
+    printf("\n");
+
+    printf("Options:\n");
+    printf("  -h, --help        Print this help message\n");
+    printf("  -b, --bank <n>    Only disassemble ROM bank n (default: all banks)\n");
+}
+
+static const struct option disasm_opts_long[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"bank", required_argument, NULL, 'b'},
+    {NULL, 0, NULL, 0},
+};
+
+static void
+disasm_parse_opts(DisasmOpts *opts, int argc, char **argv)
+{
+    while (1) {
+        int opt_index = 0;
+        int opt = getopt_long(argc, argv, "hb:", disasm_opts_long, &opt_index);
+
+        if (opt == -1) {
+            break;
+        }
+
+        switch (opt) {
+        case 'b': {
+            char *end;
+            opts->bank = strtol(optarg, &end, 0);
+            if (*optarg == '\0' || *end != '\0' || opts->bank < 0) {
+                LOG("invalid bank: %s", optarg);
+                disasm_usage();
+                exit(1);
+            }
+            break;
+        }
+        case 'h':
+            disasm_help();
+            exit(0);
+        default:
+            disasm_usage();
+            exit(1);
+        }
+    }
+
+    if (optind >= argc) {
+        disasm_usage();
+        exit(1);
+    }
+
+    opts->romfile = argv[optind];
+}
+
+// Bytes that do not form a whole instruction before the end of the bank.
+static size_t
+disasm_data(uint8_t byte, uint16_t bank, uint16_t addr, char *buf)
+{
+    return (size_t) snprintf(buf, DISASM_LINE_SIZE + 1, "%02X:%04X  %02X        DB $%02X",
+                             bank, addr, byte, byte);
+}
+
+static void
+disasm_bank(const uint8_t *data, uint16_t bank, FILE *out)
+{
+    // Bank 0 is always mapped at 0x0000, the others are switched in at 0x4000.
+    uint16_t base = bank == 0 ? 0x0000 : 0x4000;
+    char line[DISASM_LINE_SIZE + 1];
+    size_t pos = 0;
+
+    while (pos < ROM_BANK_SIZE) {
+        const uint8_t *bytes = data + pos;
+        uint16_t addr = (uint16_t) (base + pos);
+        size_t size = (size_t) disasm_size(bytes);
+        size_t len;
+
+        if (pos + size <= ROM_BANK_SIZE) {
+            len = disasm_static(bytes, bank, addr, line);
+        } else {
+            len = disasm_data(bytes[0], bank, addr, line);
+            size = 1;
+        }
+
+        line[len++] = '\n';
+        fwrite(line, 1, len, out);
+        pos += size;
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    DisasmOpts opts = {.bank = -1};
+    disasm_parse_opts(&opts, argc, argv);
+
+    _autoclose_ FILE *f = fopen(opts.romfile, "rb");
+    if (f == NULL) {
+        LOG("failed to open rom file: %s", opts.romfile);
+        exit(1);
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    if (size < ROM_BANK_SIZE) {
+        LOG("not a rom file: %s", opts.romfile);
+        exit(1);
+    }
+
+    // Padded so that the last instruction of a bank can always be decoded.
+    long banks = size / ROM_BANK_SIZE;
+    _autofree_ uint8_t *data = xalloc((size_t) size + DISASM_MAX_SIZE);
+    if (fread(data, 1, (size_t) size, f) != (size_t) size) {
+        LOG("failed to read rom file: %s", opts.romfile);
+        exit(1);
+    }
+
+    if (opts.bank >= banks) {
+        LOG("bank %ld out of range, the rom has %ld banks", opts.bank, banks);
+        disasm_usage();
+        exit(1);
+    }
+
+    static char outbuf[1 << 16];
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    for (long bank = 0; bank < banks; bank++) {
+        if (opts.bank < 0 || bank == opts.bank) {
+            disasm_bank(data + bank * ROM_BANK_SIZE, (uint16_t) bank, stdout);
+        }
+    }
+
+    if (fflush(stdout) != 0) {
+        LOG("failed to write output");
+        exit(1);
+    }
+
+    return 0;
+}
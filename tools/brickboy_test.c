@@ -0,0 +1,891 @@
+// pipe2 and mkostemp
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "cpu.h"
+#include "gb.h"
+#include "joypad.h"
+#include "mapper.h"
+#include "mmu.h"
+#include "ppu.h"
+#include "rom.h"
+#include "serial.h"
+#include "str.h"
+#include "timer.h"
+
+// Conformance test runner: runs the test ROMs of a manifest on a pool of
+// threads, each test in a process of its own, and reports the results as
+// TAP or JUnit XML. The core panics on some invalid ROM data, a process
+// that dies that way fails its test instead of the whole run. The tests
+// run in fresh instances of the runner (--run-one), forking from the
+// worker threads would leave the children with their locks.
+//
+// Manifest lines, relative ROM paths are resolved from the manifest:
+//
+//   <rom> serial <text>          serial output contains text when the ROM reports a result
+//   <rom> frame <n> <hash>       frame hash after the nth VBLANK
+//   <rom> ram <addr> <bytes>     memory at addr when the ROM reports a result (hex)
+
+#define TEST_FRAMES 7200
+#define TEST_RAM_MAX 16
+
+// A test process sends its result on this descriptor.
+#define TEST_RESULT_FD 3
+
+extern char **environ;
+
+typedef enum {
+    TEST_EXPECT_SERIAL,
+    TEST_EXPECT_FRAME,
+    TEST_EXPECT_RAM,
+} TestExpect;
+
+typedef struct {
+    String name;
+    String rom;
+    TestExpect expect;
+    String serial;
+    uint64_t frame;
+    uint64_t hash;
+    uint16_t addr;
+    uint8_t bytes[TEST_RAM_MAX];
+    size_t len;
+
+    // Result
+    bool passed;
+    String message;
+    String output;
+    uint64_t cycles;
+    double seconds;
+} TestCase;
+
+typedef struct {
+    TestCase *tests;
+    size_t count;
+    const char *manifest;
+    uint64_t max_frames;
+    unsigned run_ahead;
+    atomic_size_t next;
+} TestPool;
+
+typedef struct {
+    const char *manifest;
+    unsigned long jobs;
+    unsigned long frames;
+    unsigned long run_ahead;
+    long run_one; // Index of the test to run in this process, -1 for all
+    bool junit;
+} TestOpts;
+
+static double
+test_time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void
+test_free(TestCase *tc)
+{
+    str_free(&tc->name);
+    str_free(&tc->rom);
+    str_free(&tc->serial);
+    str_free(&tc->message);
+    str_free(&tc->output);
+}
+
+static int
+test_parse_bytes(TestCase *tc, const char *hex)
+{
+    size_t len = strlen(hex);
+    if (len == 0 || len % 2 != 0 || len / 2 > TEST_RAM_MAX) {
+        return RET_ERR;
+    }
+
+    for (size_t i = 0; i < len / 2; i++) {
+        char byte[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+        char *end;
+
+        tc->bytes[i] = (uint8_t) strtoul(byte, &end, 16);
+        if (*end != '\0') {
+            return RET_ERR;
+        }
+    }
+
+    tc->len = len / 2;
+    return RET_OK;
+}
+
+// Parses the expectation that follows the ROM path on a manifest line.
+static int
+test_parse_expect(TestCase *tc, char *kind, char *args)
+{
+    char *end;
+
+    if (strcmp(kind, "serial") == 0) {
+        tc->expect = TEST_EXPECT_SERIAL;
+        tc->serial = str_new_from(args);
+        return RET_OK;
+    }
+
+    char *first = strtok(args, " \t");
+    char *second = strtok(NULL, " \t");
+    if (first == NULL || second == NULL) {
+        return RET_ERR;
+    }
+
+    if (strcmp(kind, "frame") == 0) {
+        tc->expect = TEST_EXPECT_FRAME;
+        tc->frame = strtoull(first, &end, 10);
+        if (*end != '\0' || tc->frame == 0) {
+            return RET_ERR;
+        }
+
+        tc->hash = strtoull(second, &end, 16);
+        return *end == '\0' ? RET_OK : RET_ERR;
+    }
+
+    if (strcmp(kind, "ram") == 0) {
+        tc->expect = TEST_EXPECT_RAM;
+        unsigned long addr = strtoul(first, &end, 16);
+        if (*end != '\0' || addr > 0xFFFF) {
+            return RET_ERR;
+        }
+
+        tc->addr = (uint16_t) addr;
+        return test_parse_bytes(tc, second);
+    }
+
+    return RET_ERR;
+}
+
+static char *
+test_trim(char *s)
+{
+    while (isspace((unsigned char) *s)) {
+        s++;
+    }
+
+    size_t len = strlen(s);
+    while (len > 0 && isspace((unsigned char) s[len - 1])) {
+        s[--len] = '\0';
+    }
+
+    return s;
+}
+
+static int
+test_load_manifest(TestPool *pool, const char *filename)
+{
+    _autoclose_ FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open manifest: %s\n", filename);
+        return RET_ERR;
+    }
+
+    // ROM paths are relative to the manifest.
+    str_auto dir = str_new_from(filename);
+    char *slash = strrchr(dir.ptr, '/');
+    dir = str_trunc(dir, slash != NULL ? (size_t) (slash - dir.ptr + 1) : 0);
+
+    _autofree_ char *line = NULL;
+    size_t line_cap = 0;
+    size_t cap = 0;
+    int lineno = 0;
+
+    while (getline(&line, &line_cap, f) != -1) {
+        lineno++;
+
+        char *s = test_trim(line);
+        if (*s == '\0' || *s == '#') {
+            continue;
+        }
+
+        char *rom = strtok(s, " \t");
+        char *kind = strtok(NULL, " \t");
+        char *args = strtok(NULL, "");
+
+        if (pool->count == cap) {
+            size_t new_cap = cap > 0 ? cap * 2 : 16;
+            pool->tests = xrealloc(pool->tests, cap * sizeof(TestCase), new_cap * sizeof(TestCase));
+            cap = new_cap;
+        }
+
+        TestCase *tc = &pool->tests[pool->count++];
+        tc->name = str_new_from(rom);
+        tc->rom = rom[0] == '/' ? str_new_from(rom) : str_add(str_clone(dir), rom);
+        tc->message = str_new();
+        tc->output = str_new();
+
+        if (kind == NULL || args == NULL || test_parse_expect(tc, kind, test_trim(args)) != RET_OK) {
+            fprintf(stderr, "%s:%d: invalid test\n", filename, lineno);
+            return RET_ERR;
+        }
+    }
+
+    return RET_OK;
+}
+
+// Checks the expectation once the ROM has run, the result goes to tc.
+// frame is the last frame shown.
+static void
+test_check(TestCase *tc, GameBoy *gb, uint64_t frame)
+{
+    MMU *mmu = gb->mmu;
+
+    switch (tc->expect) {
+    case TEST_EXPECT_SERIAL:
+        tc->passed = strstr(tc->output.ptr, tc->serial.ptr) != NULL;
+        if (!tc->passed) {
+            tc->message = str_addf(tc->message, "serial output does not contain \"%s\"", tc->serial.ptr);
+        }
+        break;
+
+    case TEST_EXPECT_FRAME: {
+        uint64_t hash = ppu_get_frame_hash(mmu->ppu);
+        tc->passed = frame == tc->frame && hash == tc->hash;
+        if (!tc->passed) {
+            tc->message = str_addf(tc->message, "frame %llu hash is %016llx, expected %016llx",
+                                   (unsigned long long) frame,
+                                   (unsigned long long) hash,
+                                   (unsigned long long) tc->hash);
+        }
+        break;
+    }
+
+    case TEST_EXPECT_RAM:
+        tc->passed = true;
+        for (size_t i = 0; i < tc->len; i++) {
+            uint16_t addr = (uint16_t) (tc->addr + i);
+            uint8_t byte = mmu_peek(mmu, addr);
+
+            if (byte != tc->bytes[i]) {
+                tc->message = str_addf(tc->message, "memory at %04X is %02X, expected %02X",
+                                       addr, byte, tc->bytes[i]);
+                tc->passed = false;
+                break;
+            }
+        }
+        break;
+    }
+}
+
+static void
+test_run(TestCase *tc, uint64_t max_frames, unsigned run_ahead)
+{
+    _cleanup_(rom_free) ROM *rom = rom_open(tc->rom.ptr);
+    if (rom == NULL) {
+        tc->message = str_add(tc->message, "failed to open rom file");
+        return;
+    }
+
+    _cleanup_(mapper_free) IMapper *mapper = mapper_new(rom);
+    if (mapper == NULL) {
+        tc->message = str_add(tc->message, "unsupported mapper");
+        return;
+    }
+
+    _cleanup_(cpu_free) CPU *cpu = cpu_new();
+    _cleanup_(ppu_free) PPU *ppu = ppu_new();
+    _cleanup_(timer_free) Timer *timer = timer_new();
+    _cleanup_(serial_free) Serial *serial = serial_new();
+    _cleanup_(joypad_free) Joypad *joypad = joypad_new();
+    _cleanup_(mmu_free) MMU *mmu = mmu_new(mapper, serial, timer, ppu, joypad);
+    _cleanup_(gb_free) GameBoy *gb = gb_new(cpu, mmu, GB_SCHED_EVENT);
+
+    // Frame hashes are taken at a fixed frame, the other expectations
+    // are checked when the ROM reports its result.
+    uint64_t frames = max_frames;
+    if (tc->expect == TEST_EXPECT_FRAME) {
+        frames = tc->frame;
+    } else {
+        gb->test = true;
+    }
+
+    // Run-ahead must not change the frames that are shown, only how soon
+    // the input reaches them. The machine trails the shown frames, they
+    // are counted here.
+    if (run_ahead > 0 && tc->expect == TEST_EXPECT_FRAME) {
+        _cleanup_(gb_snapshot_free) GBSnapshot *snap = gb_snapshot_new(gb);
+        for (uint64_t i = 0; i < frames; i++) {
+            gb_run_ahead(gb, snap, run_ahead);
+        }
+
+        tc->cycles = mmu->ticks;
+        tc->output = str_add(tc->output, serial_output(serial));
+        test_check(tc, gb, frames);
+        return;
+    }
+
+    while (gb->frames < frames && gb->test_result == GB_TEST_RUNNING) {
+        gb_run_frame(gb);
+    }
+
+    tc->cycles = gb->test_result != GB_TEST_RUNNING ? gb->test_ticks : mmu->ticks;
+    tc->output = str_add(tc->output, serial_output(serial));
+
+    if (gb->test && gb->test_result == GB_TEST_RUNNING) {
+        tc->message = str_addf(tc->message, "no result after %llu frames", (unsigned long long) gb->frames);
+        return;
+    }
+
+    test_check(tc, gb, gb->frames);
+}
+
+static int
+test_write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            return RET_ERR;
+        }
+
+        p += n;
+        len -= (size_t) n;
+    }
+
+    return RET_OK;
+}
+
+static int
+test_read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) {
+            return RET_ERR;
+        }
+
+        p += n;
+        len -= (size_t) n;
+    }
+
+    return RET_OK;
+}
+
+// Result of a test as the child sends it to the parent, followed by the
+// message and the serial output.
+typedef struct {
+    bool passed;
+    uint64_t cycles;
+    size_t message_len;
+    size_t output_len;
+} TestResult;
+
+static int
+test_send_result(int fd, TestCase *tc)
+{
+    TestResult res = {
+        .passed = tc->passed,
+        .cycles = tc->cycles,
+        .message_len = tc->message.len,
+        .output_len = tc->output.len,
+    };
+
+    if (test_write_all(fd, &res, sizeof(res)) != RET_OK ||
+        test_write_all(fd, tc->message.ptr, tc->message.len) != RET_OK ||
+        test_write_all(fd, tc->output.ptr, tc->output.len) != RET_OK) {
+        return RET_ERR;
+    }
+
+    return RET_OK;
+}
+
+static String
+test_recv_string(int fd, size_t len)
+{
+    _autofree_ char *buf = xalloc(len + 1);
+    if (test_read_all(fd, buf, len) != RET_OK) {
+        return str_new();
+    }
+
+    buf[len] = '\0';
+    return str_new_from(buf);
+}
+
+static int
+test_recv_result(int fd, TestCase *tc)
+{
+    TestResult res;
+    if (test_read_all(fd, &res, sizeof(res)) != RET_OK) {
+        return RET_ERR;
+    }
+
+    tc->passed = res.passed;
+    tc->cycles = res.cycles;
+
+    str_auto message = test_recv_string(fd, res.message_len);
+    str_auto output = test_recv_string(fd, res.output_len);
+    tc->message = str_add(tc->message, message.ptr);
+    tc->output = str_add(tc->output, output.ptr);
+    return RET_OK;
+}
+
+// Copies the logs of a child to stderr and keeps its last panic message.
+static void
+test_copy_log(FILE *log, String *panic)
+{
+    _autofree_ char *line = NULL;
+    size_t line_cap = 0;
+
+    rewind(log);
+    while (getline(&line, &line_cap, log) != -1) {
+        fputs(line, stderr);
+
+        if (strncmp(line, "panic: ", 7) == 0) {
+            *panic = str_trunc(*panic, 0);
+            *panic = str_add(*panic, test_trim(line + 7));
+        }
+    }
+}
+
+// Opens an unlinked temporary file for the logs of a test process. It is
+// closed on exec, so that the processes started by the other workers do
+// not inherit it.
+static FILE *
+test_open_log(void)
+{
+    char path[] = "/tmp/brickboy-test-XXXXXX";
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    unlink(path);
+
+    FILE *log = fdopen(fd, "w+");
+    if (log == NULL) {
+        close(fd);
+    }
+
+    return log;
+}
+
+static pid_t
+test_spawn(TestPool *pool, size_t index, int log_fd, int result_fd)
+{
+    char index_arg[32];
+    char frames_arg[32];
+    char run_ahead_arg[32];
+    snprintf(index_arg, sizeof(index_arg), "%zu", index);
+    snprintf(frames_arg, sizeof(frames_arg), "%llu", (unsigned long long) pool->max_frames);
+    snprintf(run_ahead_arg, sizeof(run_ahead_arg), "%u", pool->run_ahead);
+
+    char *argv[] = {
+        "brickboy-test",
+        "--run-one", index_arg,
+        "--frames", frames_arg,
+        "--run-ahead", run_ahead_arg,
+        (char *) pool->manifest,
+        NULL,
+    };
+
+    // The core logs to stdout, both streams go to the log.
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, log_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, log_fd, STDERR_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, result_fd, TEST_RESULT_FD);
+
+    pid_t pid;
+    int err = posix_spawn(&pid, "/proc/self/exe", &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    return err == 0 ? pid : -1;
+}
+
+// Runs a test in a process of its own. It logs into a temporary file and
+// sends the result back over a pipe, the parent reads it before reaping
+// the process so that a long serial output cannot block it. Both are
+// closed on exec, a process started by another worker meanwhile would
+// otherwise hold the pipe open after this one is gone.
+static void
+test_run_process(TestPool *pool, size_t index)
+{
+    TestCase *tc = &pool->tests[index];
+    _autoclose_ FILE *log = test_open_log();
+    int fds[2];
+
+    if (log == NULL || pipe2(fds, O_CLOEXEC) == -1) {
+        tc->message = str_add(tc->message, "failed to set up the test process");
+        return;
+    }
+
+    pid_t pid = test_spawn(pool, index, fileno(log), fds[1]);
+    close(fds[1]);
+
+    if (pid == -1) {
+        close(fds[0]);
+        tc->message = str_add(tc->message, "failed to start the test process");
+        return;
+    }
+
+    bool received = test_recv_result(fds[0], tc) == RET_OK;
+    close(fds[0]);
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        continue;
+    }
+
+    str_auto panic = str_new();
+    test_copy_log(log, &panic);
+
+    if (received && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return;
+    }
+
+    tc->passed = false;
+    tc->message = str_trunc(tc->message, 0);
+
+    if (panic.len > 0) {
+        tc->message = str_add(tc->message, panic.ptr);
+    } else if (WIFSIGNALED(status)) {
+        tc->message = str_addf(tc->message, "killed by signal %d", WTERMSIG(status));
+    } else {
+        tc->message = str_addf(tc->message, "exited with status %d", WEXITSTATUS(status));
+    }
+}
+
+static void *
+test_worker(void *arg)
+{
+    TestPool *pool = arg;
+
+    while (true) {
+        size_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->count) {
+            break;
+        }
+
+        double start = test_time_now();
+        test_run_process(pool, i);
+        pool->tests[i].seconds = test_time_now() - start;
+    }
+
+    return NULL;
+}
+
+// Writes a string as YAML single-quoted scalar content.
+static void
+test_put_yaml(FILE *out, const char *s)
+{
+    for (; *s != '\0'; s++) {
+        if (*s == '\'') {
+            fputc('\'', out);
+        }
+
+        fputc(*s, out);
+    }
+}
+
+static void
+test_report_tap(FILE *out, TestPool *pool)
+{
+    fprintf(out, "TAP version 13\n");
+    fprintf(out, "1..%zu\n", pool->count);
+
+    for (size_t i = 0; i < pool->count; i++) {
+        TestCase *tc = &pool->tests[i];
+
+        fprintf(out, "%s %zu - %s\n", tc->passed ? "ok" : "not ok", i + 1, tc->name.ptr);
+        fprintf(out, "  ---\n");
+
+        if (!tc->passed) {
+            fprintf(out, "  message: '");
+            test_put_yaml(out, tc->message.ptr);
+            fprintf(out, "'\n");
+        }
+
+        fprintf(out, "  cycles: %llu\n", (unsigned long long) tc->cycles);
+        fprintf(out, "  time: %.3f\n", tc->seconds);
+        fprintf(out, "  ...\n");
+    }
+}
+
+// Writes a string as XML text, dropping characters XML does not allow.
+static void
+test_put_xml(FILE *out, const char *s)
+{
+    for (; *s != '\0'; s++) {
+        switch (*s) {
+        case '&':
+            fputs("&amp;", out);
+            break;
+        case '<':
+            fputs("&lt;", out);
+            break;
+        case '>':
+            fputs("&gt;", out);
+            break;
+        case '"':
+            fputs("&quot;", out);
+            break;
+        case '\n':
+        case '\r':
+        case '\t':
+            fputc(*s, out);
+            break;
+        default:
+            if ((unsigned char) *s >= 0x20) {
+                fputc(*s, out);
+            }
+        }
+    }
+}
+
+static void
+test_report_junit(FILE *out, TestPool *pool, double seconds)
+{
+    size_t failures = 0;
+    for (size_t i = 0; i < pool->count; i++) {
+        failures += pool->tests[i].passed ? 0 : 1;
+    }
+
+    fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf(out, "<testsuite name=\"brickboy\" tests=\"%zu\" failures=\"%zu\" time=\"%.3f\">\n",
+            pool->count, failures, seconds);
+
+    for (size_t i = 0; i < pool->count; i++) {
+        TestCase *tc = &pool->tests[i];
+
+        fprintf(out, "  <testcase classname=\"brickboy\" name=\"");
+        test_put_xml(out, tc->name.ptr);
+        fprintf(out, "\" time=\"%.3f\">\n", tc->seconds);
+
+        fprintf(out, "    <properties>\n");
+        fprintf(out, "      <property name=\"cycles\" value=\"%llu\"/>\n", (unsigned long long) tc->cycles);
+        fprintf(out, "    </properties>\n");
+
+        if (!tc->passed) {
+            fprintf(out, "    <failure message=\"");
+            test_put_xml(out, tc->message.ptr);
+            fprintf(out, "\"/>\n");
+        }
+
+        if (tc->output.len > 0) {
+            fprintf(out, "    <system-out>");
+            test_put_xml(out, tc->output.ptr);
+            fprintf(out, "</system-out>\n");
+        }
+
+        fprintf(out, "  </testcase>\n");
+    }
+
+    fprintf(out, "</testsuite>\n");
+}
+
+static void
+test_usage(void)
+{
+    printf("Usage:\n");
+    printf("  brickboy-test [OPTIONS...] manifest\n");
+}
+
+static void
+test_help(void)
+{
+    printf("BrickBoy conformance test runner\n");
+    printf("\n");
+
+    test_usage();
+    printf("\n");
+
+    printf("Options:\n");
+    printf("  -h, --help          Print this help message\n");
+    printf("  -j, --jobs <n>      Number of worker threads (default: one per core)\n");
+    printf("  --frames <n>        Frames to wait for a test result (default: %d)\n", TEST_FRAMES);
+    printf("  --run-ahead <n>     Check frame hashes with n frames of run-ahead (0-%d)\n", GB_RUN_AHEAD_MAX);
+    printf("  --junit             Report as JUnit XML instead of TAP\n");
+    printf("\n");
+
+    printf("Manifest lines:\n");
+    printf("  <rom> serial <text>       Serial output contains text when the ROM reports a result\n");
+    printf("  <rom> frame <n> <hash>    Frame hash after the nth VBLANK\n");
+    printf("  <rom> ram <addr> <bytes>  Memory at addr when the ROM reports a result (hex)\n");
+}
+
+static const struct option test_opts_long[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"frames", required_argument, NULL, 0},
+    {"run-ahead", required_argument, NULL, 0},
+    {"junit", no_argument, NULL, 0},
+    {"run-one", required_argument, NULL, 0},
+    {NULL, 0, NULL, 0},
+};
+
+static void
+test_parse_opts(TestOpts *opts, int argc, char **argv)
+{
+    while (1) {
+        int opt_index = 0;
+        int opt = getopt_long(argc, argv, "hj:", test_opts_long, &opt_index);
+
+        if (opt == -1) {
+            break;
+        }
+
+        if (opt == 0) {
+            const char *name = test_opts_long[opt_index].name;
+
+            if (strcmp(name, "frames") == 0) {
+                opts->frames = strtoul(optarg, NULL, 10);
+            } else if (strcmp(name, "run-ahead") == 0) {
+                char *end;
+                opts->run_ahead = strtoul(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || opts->run_ahead > GB_RUN_AHEAD_MAX) {
+                    fprintf(stderr, "invalid run-ahead, expected 0-%d frames: %s\n", GB_RUN_AHEAD_MAX, optarg);
+                    exit(1);
+                }
+            } else if (strcmp(name, "junit") == 0) {
+                opts->junit = true;
+            } else if (strcmp(name, "run-one") == 0) {
+                opts->run_one = strtol(optarg, NULL, 10);
+            }
+
+            continue;
+        }
+
+        switch (opt) {
+        case 'j':
+            opts->jobs = strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+            test_help();
+            exit(0);
+        default:
+            test_usage();
+            exit(1);
+        }
+    }
+
+    if (optind >= argc) {
+        test_usage();
+        exit(1);
+    }
+
+    opts->manifest = argv[optind];
+}
+
+// Runs a single test of the manifest in this process and sends the
+// result to the runner that started it.
+static int
+test_run_one(const TestOpts *opts)
+{
+    TestPool pool = {.max_frames = opts->frames, .run_ahead = (unsigned) opts->run_ahead};
+    if (test_load_manifest(&pool, opts->manifest) != RET_OK) {
+        return 1;
+    }
+
+    int ret = 1;
+    if ((size_t) opts->run_one < pool.count) {
+        TestCase *tc = &pool.tests[opts->run_one];
+        test_run(tc, pool.max_frames, pool.run_ahead);
+        fflush(NULL);
+
+        ret = test_send_result(TEST_RESULT_FD, tc) == RET_OK ? 0 : 2;
+    }
+
+    for (size_t i = 0; i < pool.count; i++) {
+        test_free(&pool.tests[i]);
+    }
+
+    xfree(pool.tests);
+    return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+    TestOpts opts = {.frames = TEST_FRAMES, .run_one = -1};
+    test_parse_opts(&opts, argc, argv);
+
+    if (opts.run_one >= 0) {
+        return test_run_one(&opts);
+    }
+
+    if (opts.jobs == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        opts.jobs = cores > 0 ? (unsigned long) cores : 1;
+    }
+
+    // The core logs to stdout, keep the report clean by moving the logs
+    // to stderr.
+    _autoclose_ FILE *report = fdopen(fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0), "w");
+    if (report == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+        PANIC("failed to redirect stdout");
+    }
+
+    TestPool pool = {
+        .manifest = opts.manifest,
+        .max_frames = opts.frames,
+        .run_ahead = (unsigned) opts.run_ahead,
+    };
+
+    if (test_load_manifest(&pool, opts.manifest) != RET_OK) {
+        exit(1);
+    }
+
+    if (opts.jobs > pool.count) {
+        opts.jobs = pool.count > 0 ? pool.count : 1;
+    }
+
+    double start = test_time_now();
+
+    _autofree_ pthread_t *workers = xalloc(opts.jobs * sizeof(pthread_t));
+    for (size_t i = 0; i < opts.jobs; i++) {
+        if (pthread_create(&workers[i], NULL, test_worker, &pool) != 0) {
+            PANIC("failed to start worker thread");
+        }
+    }
+
+    for (size_t i = 0; i < opts.jobs; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    double seconds = test_time_now() - start;
+    fflush(stdout);
+
+    if (opts.junit) {
+        test_report_junit(report, &pool, seconds);
+    } else {
+        test_report_tap(report, &pool);
+    }
+
+    size_t failures = 0;
+    for (size_t i = 0; i < pool.count; i++) {
+        failures += pool.tests[i].passed ? 0 : 1;
+        test_free(&pool.tests[i]);
+    }
+
+    fprintf(stderr, "%zu tests, %zu failed, %.3f s on %lu threads\n",
+            pool.count, failures, seconds, opts.jobs);
+
+    xfree(pool.tests);
+    return failures == 0 ? 0 : 1;
+}
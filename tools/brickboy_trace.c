@@ -0,0 +1,84 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "trace.h"
+
+// Converts a binary CPU trace (brickboy --trace) to the text format of
+// the state log (brickboy --state), so it can be compared with golden logs.
+
+#define TRACE_BATCH 4096
+
+static void
+trace_usage(void)
+{
+    printf("Usage:\n");
+    printf("  brickboy-trace trace.bin [output.log]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 3 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+        trace_usage();
+        exit(argc == 2 ? 0 : 1);
+    }
+
+    _autoclose_ FILE *in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        LOG("failed to open trace file: %s", argv[1]);
+        exit(1);
+    }
+
+    FILE *out = stdout;
+    if (argc == 3 && strcmp(argv[2], "-") != 0) {
+        out = fopen(argv[2], "w");
+        if (out == NULL) {
+            LOG("failed to open output file: %s", argv[2]);
+            exit(1);
+        }
+    }
+
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+        LOG("not a trace file: %s", argv[1]);
+        exit(1);
+    }
+
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        LOG("unsupported trace version %u (record size %u)", header.version, header.record_size);
+        exit(1);
+    }
+
+    _autofree_ TraceRecord *recs = xalloc(TRACE_BATCH * sizeof(TraceRecord));
+    _autofree_ char *text = xalloc(TRACE_BATCH * (TRACE_LINE_SIZE + 1));
+    size_t count;
+
+    while ((count = fread(recs, sizeof(TraceRecord), TRACE_BATCH, in)) > 0) {
+        size_t len = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            len += trace_format(&recs[i], text + len);
+            text[len++] = '\n';
+        }
+
+        if (fwrite(text, 1, len, out) != len) {
+            LOG("failed to write output");
+            exit(1);
+        }
+    }
+
+    if (ferror(in)) {
+        LOG("failed to read trace file: %s", argv[1]);
+        exit(1);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
@@ -0,0 +1,502 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef BRICKBOY_ZLIB
+#include <zlib.h>
+#endif
+
+#include "common.h"
+
+// Compares two state logs line by line, like scripts/linecmp.py and with
+// the same output. Matching data is compared in large blocks, lines are
+// only looked at around a difference. Plain files are mapped into memory,
+// gzipped ones are streamed through a window that keeps the current line
+// and the context lines before it.
+
+#define LC_BLOCK 4096
+#define LC_WINDOW (4 << 20)
+
+typedef struct {
+    const char *filename;
+    const char *label;
+    size_t skip;
+
+    char *map;
+    size_t map_len;
+#ifdef BRICKBOY_ZLIB
+    gzFile gz;
+#endif
+    char *buf;
+    size_t cap;
+
+    const char *data; // Window into the file
+    size_t len;
+    bool eof;
+
+    size_t pos;   // Next byte to compare
+    size_t line;  // Start of the line that contains pos
+    size_t lines; // Lines compared so far
+} LCFile;
+
+typedef struct {
+    size_t prev;
+    bool lineno;
+} LCOpts;
+
+static LCOpts lc_opts = {.prev = 5};
+
+static void
+lc_parse_filename(LCFile *f, char *arg)
+{
+    f->filename = arg;
+
+    char *colon = strrchr(arg, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        f->skip = strtoul(colon + 1, NULL, 10);
+    }
+
+    const char *slash = strrchr(f->filename, '/');
+    f->label = slash != NULL ? slash + 1 : f->filename;
+}
+
+static bool
+lc_has_suffix(const char *s, const char *suffix)
+{
+    size_t len = strlen(s);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+static void
+lc_open(LCFile *f)
+{
+    if (lc_has_suffix(f->filename, ".gz")) {
+#ifdef BRICKBOY_ZLIB
+        f->gz = gzopen(f->filename, "rb");
+        if (f->gz == NULL) {
+            PANIC("failed to open %s", f->filename);
+        }
+
+        gzbuffer(f->gz, 1 << 20);
+        f->cap = LC_WINDOW;
+        f->buf = xalloc(f->cap);
+        f->data = f->buf;
+        return;
+#else
+        PANIC("built without zlib, cannot read %s", f->filename);
+#endif
+    }
+
+    int fd = open(f->filename, O_RDONLY);
+    if (fd == -1) {
+        PANIC("failed to open %s", f->filename);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        PANIC("failed to stat %s", f->filename);
+    }
+
+    f->data = "";
+    f->eof = true;
+
+    if (st.st_size > 0) {
+        f->map_len = (size_t) st.st_size;
+        f->map = mmap(NULL, f->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (f->map == MAP_FAILED) {
+            PANIC("failed to map %s", f->filename);
+        }
+
+        madvise(f->map, f->map_len, MADV_SEQUENTIAL);
+        f->data = f->map;
+        f->len = f->map_len;
+    }
+
+    close(fd);
+}
+
+static void
+lc_close(LCFile *f)
+{
+    if (f->map != NULL) {
+        munmap(f->map, f->map_len);
+    }
+
+#ifdef BRICKBOY_ZLIB
+    if (f->gz != NULL) {
+        gzclose(f->gz);
+    }
+#endif
+
+    xfree(f->buf);
+}
+
+// Start of the line that is n lines before the current one.
+static size_t
+lc_context_start(LCFile *f, size_t n)
+{
+    size_t start = f->line;
+
+    for (size_t i = 0; i < n && start > 0; i++) {
+        start--;
+        while (start > 0 && f->data[start - 1] != '\n') {
+            start--;
+        }
+    }
+
+    return start;
+}
+
+// Reads more of a gzipped file, keeping the current line and the context
+// lines before it in the window.
+static void
+lc_refill(LCFile *f)
+{
+#ifdef BRICKBOY_ZLIB
+    if (f->eof) {
+        return;
+    }
+
+    size_t lines = f->lines < lc_opts.prev ? f->lines : lc_opts.prev;
+    size_t keep = lc_context_start(f, lines);
+
+    memmove(f->buf, f->buf + keep, f->len - keep);
+    f->len -= keep;
+    f->pos -= keep;
+    f->line -= keep;
+
+    // A single line bigger than the window
+    if (f->len == f->cap) {
+        f->buf = xrealloc(f->buf, f->cap, f->cap * 2);
+        f->cap *= 2;
+    }
+
+    int n = gzread(f->gz, f->buf + f->len, (unsigned) (f->cap - f->len));
+    if (n < 0) {
+        PANIC("failed to read %s", f->filename);
+    }
+
+    f->data = f->buf;
+    f->len += (size_t) n;
+    f->eof = n == 0;
+#else
+    UNUSED(f);
+#endif
+}
+
+// Finds the end of the current line, false if the file has no more lines.
+static bool
+lc_line_end(LCFile *f, size_t *end)
+{
+    size_t scanned = f->pos - f->line;
+
+    while (true) {
+        size_t from = f->line + scanned;
+        const char *nl = memchr(f->data + from, '\n', f->len - from);
+
+        if (nl != NULL) {
+            *end = (size_t) (nl - f->data);
+            return true;
+        }
+
+        if (f->eof) {
+            *end = f->len;
+            return f->len > f->line;
+        }
+
+        scanned = f->len - f->line;
+        lc_refill(f);
+    }
+}
+
+static void
+lc_next_line(LCFile *f, size_t end)
+{
+    f->line = end < f->len ? end + 1 : end;
+    f->pos = f->line;
+    f->lines++;
+}
+
+static void
+lc_skip(LCFile *f)
+{
+    size_t end;
+
+    for (size_t i = 0; i < f->skip && lc_line_end(f, &end); i++) {
+        lc_next_line(f, end);
+    }
+
+    f->lines = 0;
+}
+
+// Same as Python's str.rstrip() for ASCII.
+static size_t
+lc_rstrip(const char *s, size_t len)
+{
+    while (len > 0) {
+        unsigned char c = (unsigned char) s[len - 1];
+        if (c != ' ' && (c < '\t' || c > '\r') && (c < 0x1C || c > 0x1F)) {
+            break;
+        }
+        len--;
+    }
+
+    return len;
+}
+
+// Prints a line padded to width.
+static void
+lc_print_padded(const char *s, size_t len, size_t width)
+{
+    fwrite(s, 1, len, stdout);
+    for (size_t i = len; i < width; i++) {
+        putchar(' ');
+    }
+}
+
+static void
+lc_report(LCFile *f1, LCFile *f2, const char *line1, size_t len1, const char *line2, size_t len2)
+{
+    // Context lines, as they are in the first file
+    size_t lines = f1->lines < lc_opts.prev ? f1->lines : lc_opts.prev;
+    size_t start = lc_context_start(f1, lines);
+
+    while (start < f1->line) {
+        const char *nl = memchr(f1->data + start, '\n', f1->line - start);
+        size_t end = (size_t) (nl - f1->data);
+
+        fwrite(f1->data + start, 1, lc_rstrip(f1->data + start, end - start), stdout);
+        putchar('\n');
+        start = end + 1;
+    }
+
+    size_t lineno = f1->lines + 1;
+    size_t width = len1 > len2 ? len1 : len2;
+
+    const char *label1 = f1->label;
+    const char *label2 = f2->label;
+    if (strcmp(label1, label2) == 0) {
+        label1 = f1->filename;
+        label2 = f2->filename;
+    }
+
+    printf("\n");
+    printf("mismatch in line %zu:\n", lineno + f1->skip);
+
+    lc_print_padded(line1, len1, width);
+    printf(" <- %s:%zu\n", label1, lineno + f1->skip);
+    lc_print_padded(line2, len2, width);
+    printf(" <- %s:%zu\n", label2, lineno + f2->skip);
+
+    for (size_t i = 0; i < width; i++) {
+        putchar(i < len1 && i < len2 && line1[i] != line2[i] ? '^' : ' ');
+    }
+    putchar('\n');
+
+    if (lc_opts.lineno) {
+        printf("%zu\n", lineno + f2->skip);
+    }
+}
+
+// Compares the current lines of both files after stripping trailing
+// whitespace. Returns false on a mismatch, moves to the next lines
+// otherwise. At the end of either file there is nothing left to compare.
+static bool
+lc_compare_line(LCFile *f1, LCFile *f2, bool *done)
+{
+    size_t end1;
+    size_t end2;
+
+    bool has1 = lc_line_end(f1, &end1);
+    bool has2 = lc_line_end(f2, &end2);
+    if (!has1 || !has2) {
+        *done = true;
+        return true;
+    }
+
+    const char *line1 = f1->data + f1->line;
+    const char *line2 = f2->data + f2->line;
+    size_t len1 = lc_rstrip(line1, end1 - f1->line);
+    size_t len2 = lc_rstrip(line2, end2 - f2->line);
+
+    if (len1 != len2 || memcmp(line1, line2, len1) != 0) {
+        lc_report(f1, f2, line1, len1, line2, len2);
+        return false;
+    }
+
+    lc_next_line(f1, end1);
+    lc_next_line(f2, end2);
+    return true;
+}
+
+// Length of the common prefix. memcmp is vectorized, only the block that
+// differs is scanned byte by byte.
+static size_t
+lc_common(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n) {
+        size_t block = n - i < LC_BLOCK ? n - i : LC_BLOCK;
+        if (memcmp(a + i, b + i, block) != 0) {
+            break;
+        }
+        i += block;
+    }
+
+    while (i < n && a[i] == b[i]) {
+        i++;
+    }
+
+    return i;
+}
+
+// Moves both files past n identical bytes, keeping track of the lines.
+static void
+lc_advance(LCFile *f1, LCFile *f2, size_t n)
+{
+    const char *p = f1->data + f1->pos;
+    const char *end = p + n;
+    const char *nl;
+
+    while ((nl = memchr(p, '\n', (size_t) (end - p))) != NULL) {
+        f1->lines++;
+        p = nl + 1;
+    }
+
+    size_t line_offset = (size_t) (p - (f1->data + f1->pos));
+    if (line_offset > 0) {
+        f1->line = f1->pos + line_offset;
+        f2->line = f2->pos + line_offset;
+    }
+
+    f2->lines = f1->lines;
+    f1->pos += n;
+    f2->pos += n;
+}
+
+static bool
+lc_compare(LCFile *f1, LCFile *f2)
+{
+    bool done = false;
+
+    while (!done) {
+        if (f1->pos == f1->len) {
+            lc_refill(f1);
+        }
+
+        if (f2->pos == f2->len) {
+            lc_refill(f2);
+        }
+
+        size_t avail1 = f1->len - f1->pos;
+        size_t avail2 = f2->len - f2->pos;
+        size_t n = avail1 < avail2 ? avail1 : avail2;
+
+        if (n == 0) {
+            // One file has ended, only a partial line can still differ.
+            if (f1->pos == f1->line) {
+                break;
+            }
+
+            if (!lc_compare_line(f1, f2, &done)) {
+                return false;
+            }
+            continue;
+        }
+
+        size_t common = lc_common(f1->data + f1->pos, f2->data + f2->pos, n);
+        lc_advance(f1, f2, common);
+
+        if (common < n && !lc_compare_line(f1, f2, &done)) {
+            return false;
+        }
+    }
+
+    if (lc_opts.lineno) {
+        printf("0\n");
+    }
+
+    return true;
+}
+
+static void
+lc_usage(void)
+{
+    printf("Usage:\n");
+    printf("  linecmp [OPTIONS...] log1[:skip] log2[:skip]\n");
+}
+
+static const struct option lc_opts_long[] = {
+    {"help", no_argument, NULL, 'h'},
+    {"prev", required_argument, NULL, 'p'},
+    {"lineno", no_argument, NULL, 'n'},
+    {NULL, 0, NULL, 0},
+};
+
+int
+main(int argc, char **argv)
+{
+    while (1) {
+        int opt = getopt_long(argc, argv, "hp:n", lc_opts_long, NULL);
+        if (opt == -1) {
+            break;
+        }
+
+        switch (opt) {
+        case 'p':
+            lc_opts.prev = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            lc_opts.lineno = true;
+            break;
+        case 'h':
+            lc_usage();
+            printf("\n");
+            printf("Options:\n");
+            printf("  -p, --prev <n>  Number of previous lines to show (default: 5)\n");
+            printf("  -n, --lineno    Output the line number at the end\n");
+            exit(0);
+        default:
+            lc_usage();
+            exit(2);
+        }
+    }
+
+    if (argc - optind != 2) {
+        lc_usage();
+        exit(2);
+    }
+
+    LCFile f1 = {0};
+    LCFile f2 = {0};
+    lc_parse_filename(&f1, argv[optind]);
+    lc_parse_filename(&f2, argv[optind + 1]);
+
+    lc_open(&f1);
+    lc_open(&f2);
+    lc_skip(&f1);
+    lc_skip(&f2);
+
+    bool ok = lc_compare(&f1, &f2);
+
+    lc_close(&f1);
+    lc_close(&f2);
+
+    if (!ok) {
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}